@@ -0,0 +1,486 @@
+/* End-to-end benchmark of the encoder and the decoder.
+
+Each run spawns the codec executable (--exe) as a child process, so that every repetition starts from a
+clean state (the codec keeps its state in globals) and so that the peak resident set size of the run can
+be measured. With --processes P, P independent codec processes run concurrently, each on its own copy
+of the output (the codec itself is single-threaded), which gives the throughput scaling curve of the
+machine. No process shares work with another.
+
+The times are measured inside the codec: it runs with --timing, and its stage table (see
+PrintStageTimes) is read back from the log. The time of a phase is the sum of the coding stages (see
+IsCodingStage), so reading, allocating, writing, process creation, loading and exit are not counted, and
+every stage is reported too. The peak RSS is reported as the increase over an idle run of the executable.
+
+  benchmark --exe ./multiresolution-tree [--in a.ply b.ply ...] [--synthetic uniform clustered shell]
+            [--particles 100000 1000000] [--processes 1 2 4] [--reps 5] [--warmup 1]
+            [--codec_args "--ndims 3 --nlevels 2 --start_depth 6 --height 30 --refinement lossless"]
+            [--work_dir bench] [--format csv|json] [--out results.csv]
+
+Without --in and --synthetic, the uniform synthetic dataset is used. Results go to stdout (human
+readable) and, if --out is given, to a CSV or JSON file with one row per (dataset, processes, phase). */
+
+#define DOCTEST_CONFIG_DISABLE // no test runner in this executable
+#include "common.h"
+#include "platform.h"
+#include <string>
+#include <thread>
+#include <unordered_set>
+#if defined(_WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#elif defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+#define EXIT_ERROR(Msg) { fprintf(stderr, "%s\n", Msg); exit(1); }
+
+/* Seconds per stage, indexed by stage, with the total last. Empty if a run printed no (or another) table. */
+using stage_times = std::vector<f64>;
+constexpr int TotalColumn = int(stage::Count);
+
+struct process_result {
+  f64 Seconds = 0; // wall time, process creation and exit included
+  i64 PeakRssBytes = 0;
+  bool Ok = false;
+  stage_times Stages;
+};
+
+/* Run Args[0] with the given arguments, with its output going to LogFile, and wait for it */
+static process_result
+RunProcess(const std::vector<std::string>& Args, cstr LogFile) {
+  process_result Result;
+  f64 Start = timer();
+#if defined(_WIN32)
+  std::string CmdLine;
+  FOR_EACH (A, Args) { CmdLine += "\"" + *A + "\" "; }
+  SECURITY_ATTRIBUTES Sa{sizeof(Sa), nullptr, TRUE};
+  HANDLE Log = CreateFileA(LogFile, GENERIC_WRITE, FILE_SHARE_READ, &Sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  STARTUPINFOA Si{};
+  Si.cb = sizeof(Si);
+  Si.dwFlags = STARTF_USESTDHANDLES;
+  Si.hStdOutput = Si.hStdError = Log;
+  PROCESS_INFORMATION Pi{};
+  if (CreateProcessA(nullptr, &CmdLine[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &Si, &Pi)) {
+    WaitForSingleObject(Pi.hProcess, INFINITE);
+    Result.Seconds = timer() - Start;
+    DWORD ExitCode = 1;
+    GetExitCodeProcess(Pi.hProcess, &ExitCode);
+    PROCESS_MEMORY_COUNTERS Pmc{};
+    if (GetProcessMemoryInfo(Pi.hProcess, &Pmc, sizeof(Pmc)))
+      Result.PeakRssBytes = Pmc.PeakWorkingSetSize;
+    Result.Ok = ExitCode == 0;
+    CloseHandle(Pi.hProcess);
+    CloseHandle(Pi.hThread);
+  }
+  CloseHandle(Log);
+#elif defined(__linux__) || defined(__APPLE__)
+  std::vector<char*> Argv;
+  FOR_EACH (A, Args) { Argv.push_back(const_cast<char*>(A->c_str())); }
+  Argv.push_back(nullptr);
+  pid_t Pid = fork();
+  if (Pid == 0) { // child
+    int Fd = open(LogFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Fd >= 0) { dup2(Fd, 1); dup2(Fd, 2); close(Fd); }
+    execv(Argv[0], Argv.data());
+    _exit(127);
+  }
+  int Status = 0;
+  rusage Usage{};
+  if (Pid > 0 && wait4(Pid, &Status, 0, &Usage) == Pid) {
+    Result.Seconds = timer() - Start;
+#if defined(__APPLE__)
+    Result.PeakRssBytes = Usage.ru_maxrss; // bytes
+#else
+    Result.PeakRssBytes = i64(Usage.ru_maxrss) * 1024; // kilobytes
+#endif
+    Result.Ok = WIFEXITED(Status) && WEXITSTATUS(Status) == 0;
+  }
+#endif
+  return Result;
+}
+
+static int
+StageIndex(const std::string& Name) {
+  FOR(int, S, 0, int(stage::Count)) { if (Name == StageNames[S]) return S; }
+  return Name == "total" ? TotalColumn : -1;
+}
+
+/* The stage table the codec prints at exit with --timing, the "total" row included. Empty if the log
+has no table, or a row that is not in StageNames (a codec built from another version). */
+static stage_times
+ReadStageTimes(cstr LogFile) {
+  stage_times Stages;
+  FILE* Fp = fopen(LogFile, "r");
+  if (!Fp) return Stages;
+  char Line[1024];
+  bool InTable = false;
+  Stages.assign(TotalColumn+1, 0);
+  bool HasTotal = false;
+  while (fgets(Line, sizeof(Line), Fp)) {
+    if (!InTable) {
+      InTable = strncmp(Line, "stage ", 6) == 0;
+      continue;
+    }
+    if (strlen(Line) < 16) break;
+    std::string Name(Line, 16); // the names are left-aligned in 16 columns
+    Name.erase(Name.find_last_not_of(' ') + 1);
+    bool Total = Name == "total";
+    long long Calls = 0;
+    f64 Seconds = 0;
+    if (Total ? sscanf(Line + 16, "%lf", &Seconds) != 1 : sscanf(Line + 16, "%lld %lf", &Calls, &Seconds) != 2)
+      break;
+    int S = StageIndex(Name);
+    if (S < 0) {
+      fprintf(stderr, "%s: unknown stage \"%s\"\n", LogFile, Name.c_str());
+      break;
+    }
+    Stages[S] = Seconds;
+    if (Total) { HasTotal = true; break; }
+  }
+  fclose(Fp);
+  if (!HasTotal) Stages.clear();
+  return Stages;
+}
+
+/* The stages that code the particles (the node stages are inside block coding, and do not overlap it) */
+static bool
+IsCodingStage(int S) {
+  switch (stage(S)) {
+    case stage::BoundingBox: case stage::Grid: case stage::TreeBuild: case stage::BlockCoding:
+    case stage::Partition: case stage::ContextModel: case stage::EntropyCoding: case stage::Refinement:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* The time spent coding: the coding stages only, not reading, allocating, writing or "other" */
+static f64
+CodingSeconds(const stage_times& Stages) {
+  f64 Seconds = 0;
+  FOR(int, S, 0, int(stage::Count)) { if (IsCodingStage(S)) Seconds += Stages[S]; }
+  return Seconds;
+}
+
+static i64
+FileSize(cstr FileName) {
+  FILE* Fp = fopen(FileName, "rb");
+  if (!Fp) return 0;
+  FSEEK(Fp, 0, SEEK_END);
+  i64 Size = FTELL(Fp);
+  fclose(Fp);
+  return Size;
+}
+
+/* Split a string of space-separated arguments */
+static std::vector<std::string>
+SplitArgs(cstr Str) {
+  std::vector<std::string> Args;
+  std::string Arg;
+  for (cstr C = Str; ; ++C) {
+    if (*C == ' ' || *C == '\0') {
+      if (!Arg.empty()) Args.push_back(Arg);
+      Arg.clear();
+      if (*C == '\0') break;
+    } else {
+      Arg += *C;
+    }
+  }
+  return Args;
+}
+
+/* Write N distinct integer particles to an ascii ply file. The kinds are "uniform" (in a 2^20 cube),
+"clustered" (gaussian blobs, like halos in a cosmology snapshot) and "shell" (near the surface of a
+sphere, like a scanned object). Returns the number of particles written. */
+static i64
+GenerateDataset(cstr Kind, i64 N, u32 Seed, cstr FileName) {
+  constexpr i32 Size = 1 << 20;
+  std::mt19937 Gen(Seed);
+  std::uniform_int_distribution<i32> Uniform(0, Size-1);
+  std::normal_distribution<f64> Normal(0.0, 1.0);
+  std::vector<vec3i> Centers(64);
+  FOR_EACH (C, Centers) { *C = vec3i(Uniform(Gen), Uniform(Gen), Uniform(Gen)); }
+  std::unordered_set<u64> Seen;
+  std::vector<vec3i> Points;
+  Points.reserve(N);
+  i64 Attempts = 0;
+  while (i64(Points.size()) < N && Attempts++ < 8*N) {
+    vec3i P;
+    if (strcmp(Kind, "clustered") == 0) {
+      const vec3i& C = Centers[Gen() % Centers.size()];
+      FOR(int, D, 0, 3) { P[D] = C[D] + i32(Normal(Gen) * Size/64); }
+    } else if (strcmp(Kind, "shell") == 0) {
+      f64 Dir[3] = {Normal(Gen), Normal(Gen), Normal(Gen)};
+      f64 R = (0.4 + 0.002*Normal(Gen)) * Size / sqrt(Dir[0]*Dir[0] + Dir[1]*Dir[1] + Dir[2]*Dir[2]);
+      FOR(int, D, 0, 3) { P[D] = Size/2 + i32(Dir[D] * R); }
+    } else {
+      P = vec3i(Uniform(Gen), Uniform(Gen), Uniform(Gen));
+    }
+    FOR(int, D, 0, 3) { P[D] = MIN(MAX(P[D], 0), Size-1); }
+    if (Seen.insert((u64(P.x) << 40) | (u64(P.y) << 20) | u64(P.z)).second)
+      Points.push_back(P);
+  }
+  FILE* Fp = fopen(FileName, "w");
+  if (!Fp)
+    EXIT_ERROR("cannot write the synthetic dataset");
+  fprintf(Fp, "ply\nformat ascii 1.0\nelement vertex %lld\n", (long long)Points.size());
+  fprintf(Fp, "property int x\nproperty int y\nproperty int z\nend_header\n");
+  FOR_EACH (P, Points) { fprintf(Fp, "%d %d %d\n", P->x, P->y, P->z); }
+  fclose(Fp);
+  return Points.size();
+}
+
+static i64
+CountPlyParticles(cstr FileName) {
+  FILE* Fp = fopen(FileName, "r");
+  if (!Fp) return 0;
+  char Line[512];
+  long long N = 0;
+  while (fgets(Line, sizeof(Line), Fp) && !strstr(Line, "end_header"))
+    sscanf(Line, "element vertex %lld", &N);
+  fclose(Fp);
+  return N;
+}
+
+struct dataset {
+  std::string Name;
+  std::string File;
+  i64 NParticles = 0;
+};
+
+/* One row of the results */
+struct measurement {
+  std::string Dataset;
+  i64 NParticles = 0;
+  int NProcesses = 1;
+  cstr Phase = "";
+  int NReps = 0;
+  f64 MinSeconds = 0, MedianSeconds = 0, MeanSeconds = 0; // of the coding time (see CodingSeconds)
+  f64 MedianWallSeconds = 0; // of the whole processes, for reference
+  stage_times MedianStages; // per stage
+  i64 PeakRssBytes = 0; // the largest over all instances and repetitions, minus the idle RSS
+  i64 CompressedBytes = 0; // of one instance (.mrt)
+  f64 ParticlesPerSecond() const { return NProcesses * NParticles / MedianSeconds; }
+  f64 MBPerSecond() const { return ParticlesPerSecond() * 3 * sizeof(i32) / (1 << 20); } // of raw int positions
+  f64 BitsPerParticle() const { return 8.0 * CompressedBytes / NParticles; }
+};
+
+/* Run NProcesses processes of the same command concurrently (a thread waits for each); Args(I) makes the
+arguments of process I. Returns the wall time of the slowest process, the largest peak RSS and, per stage,
+the largest time of the processes. */
+template <typename func_t> static process_result
+RunConcurrently(int NProcesses, const func_t& Args, const std::string& LogPrefix) {
+  std::vector<process_result> Results(NProcesses);
+  std::vector<std::thread> Threads;
+  f64 Start = timer();
+  FOR(int, I, 0, NProcesses) {
+    Threads.emplace_back([&, I]() {
+      Results[I] = RunProcess(Args(I), (LogPrefix + "-" + std::to_string(I) + ".log").c_str());
+    });
+  }
+  FOR_EACH (T, Threads) { T->join(); }
+  process_result Result;
+  Result.Seconds = timer() - Start;
+  Result.Ok = true;
+  Result.Stages.assign(TotalColumn+1, 0);
+  FOR(int, I, 0, NProcesses) {
+    Result.PeakRssBytes = MAX(Result.PeakRssBytes, Results[I].PeakRssBytes);
+    Result.Ok = Result.Ok && Results[I].Ok;
+    stage_times Stages = ReadStageTimes((LogPrefix + "-" + std::to_string(I) + ".log").c_str());
+    if (Stages.empty()) { // reported by the caller
+      Result.Stages.clear();
+      break;
+    }
+    FOR(int, S, 0, TotalColumn+1) { Result.Stages[S] = MAX(Result.Stages[S], Stages[S]); }
+  }
+  return Result;
+}
+
+static f64
+Median(std::vector<f64> Values) {
+  std::sort(Values.begin(), Values.end());
+  return Values[Values.size()/2];
+}
+
+static void
+Summarize(const std::vector<process_result>& Runs, measurement* M) {
+  std::vector<f64> Seconds, WallSeconds;
+  FOR_EACH (R, Runs) {
+    Seconds.push_back(CodingSeconds(R->Stages));
+    WallSeconds.push_back(R->Seconds);
+  }
+  M->NReps = Seconds.size();
+  M->MinSeconds = *std::min_element(Seconds.begin(), Seconds.end());
+  M->MedianSeconds = Median(Seconds);
+  M->MeanSeconds = 0;
+  FOR_EACH (S, Seconds) { M->MeanSeconds += *S / Seconds.size(); }
+  M->MedianWallSeconds = Median(WallSeconds);
+  M->MedianStages.assign(TotalColumn+1, 0);
+  FOR(int, S, 0, TotalColumn+1) {
+    std::vector<f64> StageSeconds;
+    FOR_EACH (R, Runs) { StageSeconds.push_back(R->Stages[S]); }
+    M->MedianStages[S] = Median(StageSeconds);
+  }
+}
+
+static cstr
+StageName(int S) {
+  return S == TotalColumn ? "total" : StageNames[S];
+}
+
+/* "file read" -> "file_read_s" */
+static std::string
+StageColumn(int S) {
+  std::string Column = std::string(StageName(S)) + "_s";
+  FOR_EACH (C, Column) { if (*C == ' ') *C = '_'; }
+  return Column;
+}
+
+static void
+WriteCsv(FILE* Fp, const std::vector<measurement>& Results) {
+  fprintf(Fp, "dataset,particles,processes,phase,reps,min_s,median_s,mean_s,wall_s,particles_per_s,mb_per_s,"
+              "bits_per_particle,peak_rss_delta_mb");
+  FOR(int, S, 0, TotalColumn+1) { fprintf(Fp, ",%s", StageColumn(S).c_str()); }
+  fprintf(Fp, "\n");
+  FOR_EACH (M, Results) {
+    fprintf(Fp, "%s,%lld,%d,%s,%d,%.6f,%.6f,%.6f,%.6f,%.1f,%.3f,%.4f,%.2f", M->Dataset.c_str(), (long long)M->NParticles,
+      M->NProcesses, M->Phase, M->NReps, M->MinSeconds, M->MedianSeconds, M->MeanSeconds, M->MedianWallSeconds,
+      M->ParticlesPerSecond(), M->MBPerSecond(), M->BitsPerParticle(), f64(M->PeakRssBytes) / (1 << 20));
+    FOR_EACH (S, M->MedianStages) { fprintf(Fp, ",%.6f", *S); }
+    fprintf(Fp, "\n");
+  }
+}
+
+static void
+WriteJson(FILE* Fp, const std::vector<measurement>& Results) {
+  fprintf(Fp, "[\n");
+  FOR(size_t, I, 0, Results.size()) {
+    const measurement& M = Results[I];
+    fprintf(Fp, "  {\"dataset\": \"%s\", \"particles\": %lld, \"processes\": %d, \"phase\": \"%s\", \"reps\": %d, "
+      "\"min_s\": %.6f, \"median_s\": %.6f, \"mean_s\": %.6f, \"wall_s\": %.6f, \"particles_per_s\": %.1f, "
+      "\"mb_per_s\": %.3f, \"bits_per_particle\": %.4f, \"peak_rss_delta_mb\": %.2f, \"stages\": {", M.Dataset.c_str(),
+      (long long)M.NParticles, M.NProcesses, M.Phase, M.NReps, M.MinSeconds, M.MedianSeconds, M.MeanSeconds, M.MedianWallSeconds,
+      M.ParticlesPerSecond(), M.MBPerSecond(), M.BitsPerParticle(), f64(M.PeakRssBytes) / (1 << 20));
+    FOR(int, S, 0, TotalColumn+1) {
+      fprintf(Fp, "%s\"%s\": %.6f", S > 0 ? ", " : "", StageName(S), M.MedianStages[S]);
+    }
+    fprintf(Fp, "}}%s\n", I+1 < Results.size() ? "," : "");
+  }
+  fprintf(Fp, "]\n");
+}
+
+int
+main(int Argc, cstr* Argv) {
+  cstr Exe = nullptr;
+  if (!OptVal(Argc, Argv, "--exe", &Exe))
+    EXIT_ERROR("usage: benchmark --exe codec_executable [--in a.ply ...] [--synthetic uniform clustered shell] "
+               "[--particles N ...] [--processes P ...] [--reps 5] [--warmup 1] [--codec_args \"...\"] "
+               "[--work_dir dir] [--format csv|json] [--out file]");
+  cstr CodecArgs = "--ndims 3 --nlevels 2 --start_depth 6 --height 30 --refinement lossless";
+  OptVal(Argc, Argv, "--codec_args", &CodecArgs);
+  cstr WorkDir = "bench";
+  OptVal(Argc, Argv, "--work_dir", &WorkDir);
+  cstr Format = "csv";
+  OptVal(Argc, Argv, "--format", &Format);
+  cstr OutFile = nullptr;
+  OptVal(Argc, Argv, "--out", &OutFile);
+  int NReps = 5, NWarmups = 1;
+  OptVal(Argc, Argv, "--reps", &NReps);
+  OptVal(Argc, Argv, "--warmup", &NWarmups);
+  NReps = MAX(NReps, 1);
+  std::vector<int> NParticlesList, NProcessesList;
+  if (!OptVal(Argc, Argv, "--particles", &NParticlesList)) NParticlesList = {100000};
+  if (!OptVal(Argc, Argv, "--processes", &NProcessesList)) NProcessesList = {1};
+  if (Access(WorkDir) != 0)
+    MkDir(WorkDir);
+
+  /* the datasets: real files after --in and synthetic kinds after --synthetic */
+  std::vector<dataset> Datasets;
+  std::vector<std::string> Kinds;
+  FOR(int, I, 1, Argc) {
+    std::vector<std::string>* List = nullptr;
+    std::vector<std::string> Files;
+    if (strcmp(Argv[I], "--in") == 0) List = &Files;
+    else if (strcmp(Argv[I], "--synthetic") == 0) List = &Kinds;
+    else continue;
+    while (I+1 < Argc && strncmp(Argv[I+1], "--", 2) != 0) List->push_back(Argv[++I]);
+    FOR_EACH (F, Files) {
+      cstr Base = strrchr(F->c_str(), '/') ? strrchr(F->c_str(), '/') + 1 : F->c_str();
+      Datasets.push_back(dataset{Base, *F, CountPlyParticles(F->c_str())});
+    }
+  }
+  if (Datasets.empty() && Kinds.empty())
+    Kinds.push_back("uniform");
+  FOR_EACH (K, Kinds) {
+    FOR_EACH (N, NParticlesList) {
+      dataset D;
+      D.Name = *K + "-" + std::to_string(*N);
+      D.File = std::string(WorkDir) + "/" + D.Name + ".ply";
+      printf("generating %s\n", D.Name.c_str());
+      D.NParticles = GenerateDataset(K->c_str(), *N, 12345, D.File.c_str());
+      Datasets.push_back(D);
+    }
+  }
+
+  /* the RSS of the executable itself (code, libraries, static data), subtracted from every run */
+  i64 IdleRssBytes = RunProcess({Exe}, (std::string(WorkDir) + "/idle.log").c_str()).PeakRssBytes;
+  std::vector<measurement> Results;
+  std::vector<std::string> Codec = SplitArgs(CodecArgs);
+  FOR_EACH (D, Datasets) {
+    if (D->NParticles == 0)
+      EXIT_ERROR("cannot read the particle count of a dataset (only ascii .ply files are supported)");
+    FOR_EACH (P, NProcessesList) {
+      int NProcesses = MAX(*P, 1);
+      auto Name = [&](int I) { return std::string(WorkDir) + "/" + D->Name + "-p" + std::to_string(I); };
+      auto EncodeArgs = [&](int I) {
+        std::vector<std::string> Args{Exe, "--action", "encode", "--name", Name(I), "--in", D->File, "--timing"};
+        Args.insert(Args.end(), Codec.begin(), Codec.end());
+        return Args;
+      };
+      auto DecodeArgs = [&](int I) {
+        return std::vector<std::string>{Exe, "--action", "decode", "--in", Name(I), "--out", Name(I) + "-decoded", "--timing"};
+      };
+      FOR(int, Phase, 0, 2) { // encode then decode (which reads what the last encode wrote)
+        measurement M;
+        M.Dataset = D->Name;
+        M.NParticles = D->NParticles;
+        M.NProcesses = NProcesses;
+        M.Phase = Phase == 0 ? "encode" : "decode";
+        std::vector<process_result> Runs;
+        FOR(int, R, -NWarmups, NReps) {
+          std::string LogPrefix = std::string(WorkDir) + "/" + D->Name + "-" + M.Phase;
+          process_result Run = Phase == 0 ? RunConcurrently(NProcesses, EncodeArgs, LogPrefix)
+                                          : RunConcurrently(NProcesses, DecodeArgs, LogPrefix);
+          if (!Run.Ok)
+            EXIT_ERROR(PRINT("%s of %s failed, see %s-0.log", M.Phase, D->Name.c_str(), LogPrefix.c_str()));
+          if (Run.Stages.empty() || Run.Stages[TotalColumn] == 0)
+            EXIT_ERROR(PRINT("no stage table in the logs of %s (the codec must support --timing, and match this "
+                             "benchmark's stages)", LogPrefix.c_str()));
+          if (R < 0) continue; // warm-up
+          Runs.push_back(Run);
+          M.PeakRssBytes = MAX(M.PeakRssBytes, Run.PeakRssBytes - IdleRssBytes);
+        }
+        Summarize(Runs, &M);
+        M.CompressedBytes = FileSize((Name(0) + ".mrt").c_str());
+        printf("%-24s %10lld particles %2d processes %s: median %8.3f s (wall %8.3f s), %12.0f particles/s, "
+               "%8.2f MB/s, %6.2f bits/particle, peak RSS +%8.1f MB\n", M.Dataset.c_str(), (long long)M.NParticles, M.NProcesses,
+               M.Phase, M.MedianSeconds, M.MedianWallSeconds, M.ParticlesPerSecond(), M.MBPerSecond(),
+               M.BitsPerParticle(), f64(M.PeakRssBytes) / (1 << 20));
+        FOR(int, S, 0, TotalColumn+1) { printf("    %-16s %8.3f s\n", StageName(S), M.MedianStages[S]); }
+        Results.push_back(M);
+      }
+    }
+  }
+
+  if (OutFile) {
+    FILE* Fp = fopen(OutFile, "w");
+    if (!Fp)
+      EXIT_ERROR("cannot write the results");
+    if (strcmp(Format, "json") == 0) WriteJson(Fp, Results);
+    else WriteCsv(Fp, Results);
+    fclose(Fp);
+  }
+  return 0;
+}
@@ -4,12 +4,14 @@
 
 #include "doctest.h"
 #include "heap.h"
-#include "sexpr.h"
 #include "yocto_math.h"
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <cfloat>
+#include <climits>
 #include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <inttypes.h>
 #include <queue>
@@ -105,6 +107,23 @@ INLINE i8 Lsb(u64 V, i8 Def = -1) { ulong Idx; uchar Ret = _BitScanForward64(&Id
 
 #define LOG2_FLOOR(X) Msb(u64(X))
 
+/* splitmix64's finalizer (a bijection on u64) */
+INLINE u64
+Mix64(u64 X) {
+  X ^= X >> 30; X *= 0xbf58476d1ce4e5b9ull;
+  X ^= X >> 27; X *= 0x94d049bb133111ebull;
+  return X ^ (X >> 31);
+}
+
+/* FNV-1a, to check that the decoder uses the same context model and the same bytes as the encoder */
+constexpr inline u64 HashBasis = 14695981039346656037ull;
+INLINE u64
+HashBytes(const void* Data, i64 Bytes, u64 Hash = HashBasis) {
+  const u8* P = (const u8*)Data;
+  FOR(i64, I, 0, Bytes) { Hash = (Hash ^ P[I]) * 1099511628211ull; }
+  return Hash;
+}
+
 /* File system stuffs */
 #if defined(_WIN32)
 #include <direct.h>
@@ -113,17 +132,530 @@ INLINE i8 Lsb(u64 V, i8 Def = -1) { ulong Idx; uchar Ret = _BitScanForward64(&Id
 #define GetCurrentDir _getcwd
 #define MkDir(Dir) _mkdir(Dir)
 #define Access(Dir) _access(Dir, 0)
+#include <fcntl.h>
+#define OpenReadOnly(Path) _open(Path, _O_RDONLY | _O_BINARY)
+#define CloseFd(Fd) _close(Fd)
+/* positional read: ReadFile at the offset of an OVERLAPPED, not a seek then a read, so that threads can
+share a descriptor (as pread) */
+INLINE i64
+ReadAt(int Fd, void* Buf, i64 Bytes, i64 Offset) {
+  HANDLE File = (HANDLE)_get_osfhandle(Fd);
+  if (File == INVALID_HANDLE_VALUE) return -1;
+  i64 Done = 0;
+  while (Done < Bytes) {
+    OVERLAPPED Ov{};
+    Ov.Offset = DWORD(u64(Offset + Done));
+    Ov.OffsetHigh = DWORD(u64(Offset + Done) >> 32);
+    DWORD Chunk = DWORD(MIN(Bytes - Done, i64(1) << 30)), R = 0;
+    if (!ReadFile(File, (char*)Buf + Done, Chunk, &R, &Ov) || R == 0) break;
+    Done += R;
+  }
+  return Done;
+}
+INLINE i64 FileBytes(int Fd) { return _filelengthi64(Fd); }
 #elif defined(__linux__) || defined(__APPLE__)
 #include <sys/stat.h>
 #include <unistd.h>
 #define GetCurrentDir getcwd
 #define MkDir(Dir) mkdir(Dir, 0733)
 #define Access(Dir) access(Dir, F_OK)
+#include <fcntl.h>
+#define OpenReadOnly(Path) open(Path, O_RDONLY)
+#define CloseFd(Fd) close(Fd)
+/* positional read, does not move the file offset (safe to share a descriptor across threads) */
+INLINE i64
+ReadAt(int Fd, void* Buf, i64 Bytes, i64 Offset) {
+  i64 Done = 0;
+  while (Done < Bytes) {
+    ssize_t R = pread(Fd, (char*)Buf + Done, size_t(Bytes - Done), off_t(Offset + Done));
+    if (R <= 0) break;
+    Done += R;
+  }
+  return Done;
+}
+INLINE i64
+FileBytes(int Fd) {
+  struct stat St;
+  return fstat(Fd, &St) == 0 ? (i64)St.st_size : -1;
+}
 #endif
 
 inline thread_local char ScratchBuf[1024]; // for temporary strings
 #define PRINT(Format, ...) (snprintf(ScratchBuf, sizeof(ScratchBuf), Format, ##__VA_ARGS__), ScratchBuf)
 
+/* Symbol capture for the microbenchmarks (microbenchmark.cpp). When compiled with CAPTURE_SYMBOLS, the
+coding primitives append (kind, n, v) records to SymbolTrace (opened by encode --capture_symbols file) */
+//#define CAPTURE_SYMBOLS 1
+enum class symbol_kind : u32 { Context, Binomial, Uniform, CenteredMinimal, VarByte };
+struct symbol_record { symbol_kind Kind; u32 N; u32 V; };
+#if defined(CAPTURE_SYMBOLS)
+inline FILE* SymbolTrace = nullptr;
+#define TRACE_SYMBOL(Kind, N, V) \
+  { if (SymbolTrace) { symbol_record R_{Kind, u32(N), u32(V)}; fwrite(&R_, sizeof(R_), 1, SymbolTrace); } }
+#else
+#define TRACE_SYMBOL(Kind, N, V)
+#endif
+
+/* Compression statistics (encode --stats file.json). Coded bits are attributed to the current node (depth
+and resolution level), symbol class and context; raw bits written to the block stream are attributed to
+the current node and an explicit class. Compiled in only with STATS; otherwise the STAT_* macros expand
+to nothing. */
+//#define STATS 1
+enum class stat_class : u8 { S, R, Escape, Refinement, Attribute, Other, Count };
+enum class stat_table : u8 { None, S, TS, R, L, A, M }; // the context tables (ContextS, ContextTS, ...)
+#if defined(STATS)
+struct stat_counter {
+  f64 Bits = 0;
+  i64 Symbols = 0;
+  i64 Escapes = 0;
+};
+
+struct stats {
+  i8 Depth = 0, Level = 0;
+  stat_class Class = stat_class::Other;
+  u64 Context = 0; // see StatContextKey()
+  stat_counter PerDepth[128];
+  stat_counter PerLevel[64];
+  stat_counter PerClass[int(stat_class::Count)];
+  std::unordered_map<u64, stat_counter> PerContext;
+};
+inline stats Stats;
+
+/* Table, context index (ResLvl*NLevels + Depth) and up to three sub-indices, 8 bits each */
+INLINE u64
+StatContextKey(stat_table Table, u32 CIdx, u32 A = 0, u32 B = 0, u32 C = 0) {
+  return (u64(Table) << 56) | (u64(CIdx) << 24) | (u64(A & 0xFF) << 16) | (u64(B & 0xFF) << 8) | u64(C & 0xFF);
+}
+
+inline void
+StatAddBits(f64 Bits) {
+  Stats.PerDepth[Stats.Depth & 127].Bits += Bits;
+  Stats.PerLevel[Stats.Level & 63].Bits += Bits;
+  Stats.PerClass[int(Stats.Class)].Bits += Bits;
+  if (Stats.Context) Stats.PerContext[Stats.Context].Bits += Bits;
+}
+
+/* A symbol coded with a context; its bits (and those of a following escape) go to the class and the context */
+inline void
+StatSymbol(stat_class Class, u64 Context) {
+  Stats.Class = Class;
+  Stats.Context = Context;
+  ++Stats.PerDepth[Stats.Depth & 127].Symbols;
+  ++Stats.PerLevel[Stats.Level & 63].Symbols;
+  ++Stats.PerClass[int(Class)].Symbols;
+  ++Stats.PerContext[Context].Symbols;
+}
+
+/* The current symbol was not in its context, the escape and the fallback code go to the escape class */
+inline void
+StatEscape() {
+  ++Stats.PerDepth[Stats.Depth & 127].Escapes;
+  ++Stats.PerLevel[Stats.Level & 63].Escapes;
+  ++Stats.PerClass[int(Stats.Class)].Escapes;
+  ++Stats.PerContext[Stats.Context].Escapes;
+  ++Stats.PerClass[int(stat_class::Escape)].Symbols;
+  Stats.Class = stat_class::Escape;
+}
+
+inline void
+StatRawBits(stat_class Class, i64 Bits) {
+  Stats.Class = Class;
+  Stats.Context = 0;
+  StatAddBits(f64(Bits));
+}
+
+inline void
+WriteStatCounter(FILE* Fp, const stat_counter& C) {
+  fprintf(Fp, "\"bits\": %.1f, \"symbols\": %lld, \"escapes\": %lld, \"escape_rate\": %.6f", C.Bits,
+    (long long)C.Symbols, (long long)C.Escapes, C.Symbols ? f64(C.Escapes) / C.Symbols : 0.0);
+}
+
+/* Dump the statistics as JSON, contexts sorted by decreasing bits */
+inline void
+WriteStats(cstr FileName) {
+  static cstr ClassNames[] = { "S", "R", "escape", "refinement", "attribute", "other" };
+  static cstr TableNames[] = { "none", "S", "TS", "R", "L", "A", "M" };
+  FILE* Fp = fopen(FileName, "w");
+  if (!Fp) return;
+  f64 Total = 0;
+  FOR(int, C, 0, int(stat_class::Count)) { Total += Stats.PerClass[C].Bits; }
+  fprintf(Fp, "{\n  \"total_bits\": %.1f,\n  \"classes\": [\n", Total);
+  FOR(int, C, 0, int(stat_class::Count)) {
+    fprintf(Fp, "    {\"class\": \"%s\", ", ClassNames[C]);
+    WriteStatCounter(Fp, Stats.PerClass[C]);
+    fprintf(Fp, "}%s\n", C+1 < int(stat_class::Count) ? "," : "");
+  }
+  auto WriteLevels = [Fp](cstr Name, cstr Key, const stat_counter* Counters, int N) {
+    int Last = -1;
+    FOR(int, I, 0, N) { if (Counters[I].Bits > 0 || Counters[I].Symbols > 0) Last = I; }
+    fprintf(Fp, "  ],\n  \"%s\": [\n", Name);
+    FOR(int, I, 0, Last+1) {
+      fprintf(Fp, "    {\"%s\": %d, ", Key, I);
+      WriteStatCounter(Fp, Counters[I]);
+      fprintf(Fp, "}%s\n", I < Last ? "," : "");
+    }
+  };
+  WriteLevels("depths", "depth", Stats.PerDepth, 128);
+  WriteLevels("levels", "level", Stats.PerLevel, 64);
+  std::vector<std::pair<u64, stat_counter>> Contexts(Stats.PerContext.begin(), Stats.PerContext.end());
+  std::sort(Contexts.begin(), Contexts.end(), [](const auto& A, const auto& B) { return A.second.Bits > B.second.Bits; });
+  fprintf(Fp, "  ],\n  \"contexts\": [\n");
+  FOR(size_t, I, 0, Contexts.size()) {
+    u64 K = Contexts[I].first;
+    fprintf(Fp, "    {\"table\": \"%s\", \"index\": %u, \"sub\": [%u, %u, %u], ", TableNames[(K >> 56) % 7],
+      u32((K >> 24) & 0xFFFFFFFF), u32((K >> 16) & 0xFF), u32((K >> 8) & 0xFF), u32(K & 0xFF));
+    WriteStatCounter(Fp, Contexts[I].second);
+    fprintf(Fp, "}%s\n", I+1 < Contexts.size() ? "," : "");
+  }
+  fprintf(Fp, "  ]\n}\n");
+  fclose(Fp);
+}
+
+#define STAT_CODE(...) __VA_ARGS__
+#define STAT_NODE(Depth_, Level_) { Stats.Depth = i8(Depth_); Stats.Level = i8(Level_); }
+#define STAT_SYMBOL(Class, ...) StatSymbol(Class, StatContextKey(__VA_ARGS__))
+#define STAT_ESCAPE() StatEscape()
+#define STAT_CODED(Lo, Hi, Count) StatAddBits(log2(f64(Count) / f64((Hi) - (Lo))))
+#define STAT_RAW_BITS(Class, Bits) StatRawBits(Class, Bits)
+#else
+#define STAT_CODE(...)
+#define STAT_NODE(Depth_, Level_)
+#define STAT_SYMBOL(Class, ...)
+#define STAT_ESCAPE()
+#define STAT_CODED(Lo, Hi, Count)
+#define STAT_RAW_BITS(Class, Bits)
+#endif
+
+/* Per-stage timing (--timing, and --perf for hardware counters on Linux). Stages nest, and each stage
+is charged only its exclusive time: entering a stage charges the ticks since the last transition to the
+enclosing stage. Ticks are rdtsc, calibrated against the wall clock when timing (or tracing) is enabled.
+When neither is, a TIME_STAGE scope costs one predictable branch. Tree build is the tree above the blocks.
+The stages inside a block (partition to refinement, entered per node or per symbol) are only timed in one
+block of every SampleInterval, and scaled to all blocks when printed, so the other blocks (and --perf's
+counter reads) pay a branch per scope. */
+#if defined(__GNUC__)
+#include <x86intrin.h>
+#endif
+#include <atomic>
+#include <chrono>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+enum class stage : u8 {
+  Other, FileRead, Allocation, BoundingBox, Grid, TreeBuild, BlockCoding, Partition, ContextModel,
+  EntropyCoding, Refinement, FileWrite, Count
+};
+constexpr inline int NPerfCounters = 4; // cycles, instructions, cache misses, branch misses
+inline cstr StageNames[] = { "other", "file read", "allocation", "bounding box", "grid", "tree build",
+                             "block coding", "partition", "context model", "entropy coding", "refinement",
+                             "file write" };
+
+/* The stages timed in the sampled blocks only */
+inline bool
+IsSampledStage(stage S) {
+  return S >= stage::Partition && S <= stage::Refinement;
+}
+
+struct stage_timer {
+  bool Enabled = false; // stage scopes are active (for --timing or --trace)
+  bool Report = false; // print the table at exit (--timing)
+  bool Perf = false;
+  f64 TicksPerSecond = 1;
+  u64 Last = 0; // ticks at the last transition
+  stage Stack[256] = {};
+  int Top = 0; // Stack[Top] is the current stage
+  u64 Ticks[int(stage::Count)] = {};
+  i64 Calls[int(stage::Count)] = {};
+  int PerfFd = -1; // the group leader
+  u64 LastCounters[NPerfCounters] = {};
+  u64 Counters[int(stage::Count)][NPerfCounters] = {};
+  u64 Charged = 0; // ticks charged to all stages so far
+  int SampleInterval = 16; // time the stages inside one block of every SampleInterval
+  bool Sampling = false; // in a sampled block
+  u64 BlockBegin = 0; // Charged when the current block began
+  u64 BlockTicks = 0, SampledBlockTicks = 0; // inclusive ticks of all blocks and of the sampled ones
+};
+inline stage_timer StageTimer;
+
+inline void
+ReadPerfCounters(u64* Values) {
+#if defined(__linux__)
+  u64 Buf[1 + NPerfCounters] = {}; // PERF_FORMAT_GROUP: the number of counters, then their values
+  if (read(StageTimer.PerfFd, Buf, sizeof(Buf)) == sizeof(Buf))
+    FOR(int, I, 0, NPerfCounters) { Values[I] = Buf[1+I]; }
+#endif
+}
+
+/* Charge the time (and counters) since the last transition to the current stage */
+inline void
+StageTransition() {
+  u64 Now = __rdtsc();
+  StageTimer.Ticks[int(StageTimer.Stack[StageTimer.Top])] += Now - StageTimer.Last;
+  StageTimer.Charged += Now - StageTimer.Last;
+  if (StageTimer.Perf) {
+    u64 Values[NPerfCounters] = {};
+    ReadPerfCounters(Values);
+    FOR(int, I, 0, NPerfCounters) {
+      StageTimer.Counters[int(StageTimer.Stack[StageTimer.Top])][I] += Values[I] - StageTimer.LastCounters[I];
+      StageTimer.LastCounters[I] = Values[I];
+    }
+  }
+  StageTimer.Last = __rdtsc();
+}
+
+/* Trace events (--trace file.json) in the Chrome trace-event format, which chrome://tracing and
+Perfetto load as is. Each thread appends to its own ring buffer that no other thread writes, so
+recording takes no lock; a full ring overwrites its oldest events. The rings are read at exit. */
+struct trace_event {
+  cstr Name;
+  cstr ArgName; // the event has an argument if not null
+  i64 Arg;
+  u64 Ticks;
+  char Phase; // 'B' (begin) or 'E' (end)
+};
+constexpr inline u64 TraceRingSize = 1 << 18; // events per thread (a power of two)
+constexpr inline int TraceMaxThreads = 256;
+struct trace_ring {
+  trace_event Events[TraceRingSize];
+  std::atomic<u64> Head = 0; // the number of events ever recorded
+  int Tid = 0;
+};
+inline bool TraceEnabled = false;
+inline cstr TraceFile = nullptr;
+inline u64 TraceStartTicks = 0;
+inline std::atomic<int> NTraceRings = 0;
+inline std::atomic<trace_ring*> TraceRings[TraceMaxThreads] = {};
+
+inline trace_ring*
+ThisThreadTraceRing() {
+  thread_local trace_ring* Ring = nullptr;
+  thread_local bool Full = false; // more threads than TraceMaxThreads
+  if (!Ring && !Full) {
+    int Tid = NTraceRings.fetch_add(1, std::memory_order_relaxed);
+    if (Tid >= TraceMaxThreads) { Full = true; return nullptr; }
+    Ring = new trace_ring;
+    Ring->Tid = Tid;
+    TraceRings[Tid].store(Ring, std::memory_order_release);
+  }
+  return Ring;
+}
+
+inline void
+TraceEvent(char Phase, cstr Name, cstr ArgName = nullptr, i64 Arg = 0) {
+  trace_ring* Ring = ThisThreadTraceRing();
+  if (!Ring) return;
+  u64 H = Ring->Head.load(std::memory_order_relaxed);
+  Ring->Events[H & (TraceRingSize-1)] = trace_event{Name, ArgName, Arg, __rdtsc(), Phase};
+  Ring->Head.store(H+1, std::memory_order_release);
+}
+
+/* Begin an event if Cond holds, and end it when the scope closes */
+struct trace_scope {
+  cstr Name = nullptr;
+  trace_scope(bool Cond, cstr EventName, cstr ArgName = nullptr, i64 Arg = 0) {
+    if (!TraceEnabled || !Cond) return;
+    Name = EventName;
+    TraceEvent('B', Name, ArgName, Arg);
+  }
+  ~trace_scope() { if (Name) TraceEvent('E', Name); }
+};
+#define TRACE_SCOPE_CAT(A, B) A##B
+#define TRACE_SCOPE_NAME(Line) TRACE_SCOPE_CAT(TraceScope_, Line)
+#define TRACE_SCOPE(...) trace_scope TRACE_SCOPE_NAME(__LINE__)(true, __VA_ARGS__)
+
+/* The blocks are traced on their own, as "block" events with their index, and the stages inside them
+would flood the trace */
+inline bool
+IsTracedStage(stage S) {
+  return S != stage::BlockCoding && !IsSampledStage(S);
+}
+
+struct stage_scope {
+  bool Active;
+  stage S;
+  explicit stage_scope(stage Stage, bool Cond = true) : Active(Cond && StageTimer.Enabled), S(Stage) {
+    if (!Active) return;
+    StageTransition();
+    assert(StageTimer.Top+1 < int(sizeof(StageTimer.Stack)));
+    StageTimer.Stack[++StageTimer.Top] = S;
+    ++StageTimer.Calls[int(S)];
+    if (S == stage::BlockCoding) {
+      StageTimer.Sampling = (StageTimer.Calls[int(S)]-1) % StageTimer.SampleInterval == 0;
+      StageTimer.BlockBegin = StageTimer.Charged;
+    }
+    if (TraceEnabled && IsTracedStage(S))
+      TraceEvent('B', StageNames[int(S)]);
+  }
+  ~stage_scope() { End(); }
+  /* Leave the stage before the end of the enclosing block */
+  void End() {
+    if (!Active) return;
+    if (TraceEnabled && IsTracedStage(S))
+      TraceEvent('E', StageNames[int(S)]);
+    StageTransition();
+    if (S == stage::BlockCoding) {
+      u64 Ticks = StageTimer.Charged - StageTimer.BlockBegin;
+      StageTimer.BlockTicks += Ticks;
+      if (StageTimer.Sampling) StageTimer.SampledBlockTicks += Ticks;
+      StageTimer.Sampling = false;
+    }
+    --StageTimer.Top;
+    Active = false;
+  }
+};
+#define TIME_STAGE_CAT(A, B) A##B
+#define TIME_STAGE_NAME(Line) TIME_STAGE_CAT(StageScope_, Line)
+#define TIME_STAGE(S) stage_scope TIME_STAGE_NAME(__LINE__)(S)
+
+inline void
+CalibrateTicks() {
+  if (StageTimer.Enabled) return; // already done
+  using clock = std::chrono::steady_clock;
+  auto T0 = clock::now();
+  u64 C0 = __rdtsc();
+  while (clock::now() - T0 < std::chrono::milliseconds(20)) {}
+  u64 C1 = __rdtsc();
+  StageTimer.TicksPerSecond = f64(C1-C0) / std::chrono::duration<f64>(clock::now() - T0).count();
+}
+
+/* Calibrate the ticks and start charging time to stage::Other (and open the counters if Perf) */
+inline void
+EnableStageTimer(bool Perf) {
+  CalibrateTicks();
+#if defined(__linux__)
+  if (Perf) {
+    u64 Configs[NPerfCounters] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                   PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    bool Ok = true;
+    FOR(int, I, 0, NPerfCounters) {
+      perf_event_attr Attr = {};
+      Attr.type = PERF_TYPE_HARDWARE;
+      Attr.size = sizeof(Attr);
+      Attr.config = Configs[I];
+      Attr.read_format = PERF_FORMAT_GROUP;
+      Attr.exclude_kernel = 1;
+      Attr.exclude_hv = 1;
+      int Fd = int(syscall(__NR_perf_event_open, &Attr, 0, -1, I==0 ? -1 : StageTimer.PerfFd, 0));
+      if (Fd < 0) { Ok = false; break; }
+      if (I == 0) StageTimer.PerfFd = Fd;
+    }
+    if (Ok) {
+      ioctl(StageTimer.PerfFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+      ReadPerfCounters(StageTimer.LastCounters);
+      StageTimer.Perf = true;
+    } else {
+      fprintf(stderr, "perf_event_open failed, hardware counters are disabled\n");
+    }
+  }
+#else
+  if (Perf) fprintf(stderr, "hardware counters are only supported on Linux\n");
+#endif
+  StageTimer.Enabled = StageTimer.Report = true;
+  StageTimer.Last = __rdtsc();
+}
+
+/* Record the coarse stages (and whatever TRACE_SCOPE marks) to FileName */
+inline void
+EnableTrace(cstr FileName) {
+  CalibrateTicks();
+  TraceFile = FileName;
+  TraceEnabled = true;
+  TraceStartTicks = __rdtsc();
+  if (!StageTimer.Enabled) {
+    StageTimer.Enabled = true;
+    StageTimer.Last = TraceStartTicks;
+  }
+}
+
+/* Write the events of all threads as a Chrome trace (timestamps in microseconds) */
+inline void
+WriteTrace() {
+  if (!TraceEnabled) return;
+  FILE* Fp = fopen(TraceFile, "w");
+  if (!Fp) { fprintf(stderr, "cannot write %s\n", TraceFile); return; }
+  fprintf(Fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(Fp, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"multiresolution-tree\"}}");
+  int NRings = MIN(NTraceRings.load(std::memory_order_acquire), TraceMaxThreads);
+  i64 NDropped = 0;
+  FOR(int, T, 0, NRings) {
+    const trace_ring* Ring = TraceRings[T].load(std::memory_order_acquire);
+    if (!Ring) continue;
+    u64 Head = Ring->Head.load(std::memory_order_acquire);
+    u64 First = Head > TraceRingSize ? Head - TraceRingSize : 0;
+    NDropped += First;
+    for (u64 I = First; I < Head; ++I) {
+      const trace_event& E = Ring->Events[I & (TraceRingSize-1)];
+      f64 Us = 1e6 * f64(i64(E.Ticks - TraceStartTicks)) / StageTimer.TicksPerSecond;
+      fprintf(Fp, ",\n  {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d",
+        E.Name, E.Phase, Us, Ring->Tid);
+      if (E.ArgName)
+        fprintf(Fp, ", \"args\": {\"%s\": %lld}", E.ArgName, (long long)E.Arg);
+      fprintf(Fp, "}");
+    }
+  }
+  fprintf(Fp, "\n]}\n");
+  fclose(Fp);
+  if (NDropped > 0)
+    fprintf(stderr, "the trace ring buffers overflowed, the oldest %lld events were dropped\n", (long long)NDropped);
+}
+
+/* Scale the sampled stages from the sampled blocks to all blocks, and leave block coding the rest of the
+blocks' time (the total does not change). The counters are scaled by the same ratio of ticks. */
+inline void
+ExtrapolateSampledStages() {
+  auto& T = StageTimer;
+  if (T.SampledBlockTicks == 0 || T.SampledBlockTicks == T.BlockTicks) return;
+  f64 Scale = f64(T.BlockTicks) / f64(T.SampledBlockTicks);
+  int B = int(stage::BlockCoding);
+  i64 Rest = i64(T.Ticks[B]);
+  i64 RestCounters[NPerfCounters];
+  FOR(int, I, 0, NPerfCounters) { RestCounters[I] = i64(T.Counters[B][I]); }
+  FOR(int, S, 0, int(stage::Count)) {
+    if (!IsSampledStage(stage(S))) continue;
+    u64 Scaled = u64(T.Ticks[S] * Scale);
+    Rest -= i64(Scaled - T.Ticks[S]);
+    T.Ticks[S] = Scaled;
+    T.Calls[S] = i64(T.Calls[S] * Scale);
+    FOR(int, I, 0, NPerfCounters) {
+      u64 C = u64(T.Counters[S][I] * Scale);
+      RestCounters[I] -= i64(C - T.Counters[S][I]);
+      T.Counters[S][I] = C;
+    }
+  }
+  T.Ticks[B] = u64(MAX(Rest, i64(0)));
+  FOR(int, I, 0, NPerfCounters) { T.Counters[B][I] = u64(MAX(RestCounters[I], i64(0))); }
+}
+
+inline void
+PrintStageTimes() {
+  if (!StageTimer.Report) return;
+  StageTransition();
+  ExtrapolateSampledStages();
+  f64 Total = 0;
+  FOR(int, S, 0, int(stage::Count)) { Total += StageTimer.Ticks[S] / StageTimer.TicksPerSecond; }
+  printf("%-16s %12s %12s %7s", "stage", "calls", "seconds", "%");
+  if (StageTimer.Perf)
+    printf(" %16s %16s %6s %14s %14s", "cycles", "instructions", "ipc", "cache misses", "branch misses");
+  printf("\n");
+  FOR(int, S, 0, int(stage::Count)) {
+    f64 Seconds = StageTimer.Ticks[S] / StageTimer.TicksPerSecond;
+    printf("%-16s %12lld %12.6f %6.2f%%", StageNames[S], (long long)StageTimer.Calls[S], Seconds,
+      Total > 0 ? 100 * Seconds / Total : 0.0);
+    if (StageTimer.Perf) {
+      const u64* C = StageTimer.Counters[S];
+      printf(" %16llu %16llu %6.2f %14llu %14llu", (unsigned long long)C[0], (unsigned long long)C[1],
+        C[0] ? f64(C[1]) / C[0] : 0.0, (unsigned long long)C[2], (unsigned long long)C[3]);
+    }
+    printf("\n");
+  }
+  printf("%-16s %12s %12.6f\n", "total", "", Total);
+  if (StageTimer.SampledBlockTicks > 0)
+    printf("(partition to refinement are timed in 1 of %d blocks and scaled to all %lld blocks)\n",
+      StageTimer.SampleInterval, (long long)StageTimer.Calls[int(stage::BlockCoding)]);
+}
+
 #define mg_RAII(...) mg_MacroOverload(mg_RAII, __VA_ARGS__)
 #define mg_RAII_3(Type, Var, Init) Type Var; mg_CleanUp_1(Dealloc(&Var)); Init;
 #define mg_RAII_4(Type, Var, Init, Clean) Type Var; mg_CleanUp_1(Clean); Init;
@@ -934,6 +1466,7 @@ Clone(const buffer & Src, buffer * Dst, allocator * Alloc) {
 
 INLINE int
 WriteVarByte(bitstream* Bs, u64 Val) {
+  TRACE_SYMBOL(symbol_kind::VarByte, 0, Val);
   int BytesWritten = 0;
   while (++BytesWritten) {
     Write(Bs, Val & 0x7F, 7);
@@ -1124,6 +1657,21 @@ OptVal(int NArgs, cstr* Args, cstr Opt, int* Val) {
   return false;
 }
 
+inline bool
+OptVal(int NArgs, cstr* Args, cstr Opt, i64* Val) {
+  for (int I = 0; I + 1 < NArgs; ++I) {
+    if (strncmp(Args[I], Opt, 32) == 0) {
+      char* End = nullptr;
+      i64 V = strtoll(Args[I + 1], &End, 10);
+      if (End == Args[I + 1] || *End != '\0')
+        return false;
+      *Val = V;
+      return true;
+    }
+  }
+  return false;
+}
+
 inline bool
 OptVal(int NArgs, cstr* Args, cstr Opt, i8* Val) {
   int V = *Val;
@@ -1321,6 +1869,14 @@ struct arithmetic_coder {
     ::InitWrite(&BitStream, Bytes);
   }
 
+  /* Start a new, independent stream in the already allocated buffer */
+  void
+  RewindWrite() {
+    CodeLow = CodeVal = PendingBits = 0;
+    CodeHigh = CodeMax;
+    Rewind(&BitStream);
+  }
+
   /* Init for decoding */
   void
   InitRead() {
@@ -1348,6 +1904,8 @@ struct arithmetic_coder {
   void
   Encode(const prob<count_t>& P) {
     assert(P.Count > 0);
+    STAT_CODED(P.Low, P.High, P.Count);
+    stage_scope EntropyScope(stage::EntropyCoding, StageTimer.Sampling);
     code_t Range = CodeHigh - CodeLow + 1;
     CodeHigh = CodeLow + (Range*P.High/P.Count) - 1; // the -1 makes sure new m_code_high <= old m_code_high (== happens when p.high==p.count)
     CodeLow = CodeLow + (Range*P.Low/P.Count);
@@ -1385,6 +1943,7 @@ struct arithmetic_coder {
 
   u32
   Decode(const count_t* CdfTable, u32 Size, count_t Count) {
+    stage_scope EntropyScope(stage::EntropyCoding, StageTimer.Sampling);
     //if (Counter < 200) printf("%d begin ", Counter);
     assert(Size > 0);
     //count_t Count = CdfTable[Size-1];
@@ -1441,6 +2000,7 @@ struct arithmetic_coder {
   /* Decode a single symbol and return its index in the CDF table */
   size_t
   Decode(const std::vector<count_t>& CdfTable) {
+    stage_scope EntropyScope(stage::EntropyCoding, StageTimer.Sampling);
     assert(CdfTable.size() > 0);
     count_t Count = CdfTable[CdfTable.size() - 1];
     assert(Count > 0);
@@ -1597,6 +2157,7 @@ inline void
 EncodeCenteredMinimal(u32 v, u32 n, bitstream* Bs) {
   assert(n > 0);
   assert(v < n);
+  TRACE_SYMBOL(symbol_kind::CenteredMinimal, n, v);
   if (n == 2) {
     Write(Bs, v == 1);
     return;
@@ -1793,15 +2354,21 @@ CreateGeneralBinomialTables() {
 inline void
 ArithmeticEncode(u32 n, u32 v, u32 c, const u32* CdfTable, arithmetic_coder<>* Coder) {
   assert(v >= 0 && v <= n);
+  TRACE_SYMBOL(symbol_kind::Binomial, n, v);
   u32 lo = v == 0 ? 0 : CdfTable[v - 1];
   u32 hi = CdfTable[v];
   prob<u32> prob{lo, hi, c};
   Coder->Encode(prob);
 }
 
+/* Largest symbol of the adaptive contexts (bit lengths and the like). A context holds ContextMax+2
+counts, the first one for the escape. */
+constexpr inline u32 ContextMax = 32;
+
 inline void
 EncodeWithContext(u32 N, u32 V, const u32* Context, arithmetic_coder<>* Coder) {
   //assert(V>=0 && V<=N);
+  TRACE_SYMBOL(symbol_kind::Context, N, V);
   u32 Hi = Context[V];
   u32 Lo = 0;
   for (u32 I = 0; I < V; ++I) Lo += Context[I];
@@ -1836,15 +2403,24 @@ EncodeGeometric(u32 N, u32 V, arithmetic_coder<>* Coder) {
 inline void
 EncodeUniform(u32 N, u32 V, arithmetic_coder<>* Coder) {
   assert(V>=0 && V<=N);
+  TRACE_SYMBOL(symbol_kind::Uniform, N, V);
   u32 Lo = V;
   u32 Hi = Lo + 1;
   u32 Scale = N + 1;
   Coder->Encode(prob<u32>{Lo, Hi, Scale});
 }
 
+inline u32
+DecodeUniform(u32 N, arithmetic_coder<>* Coder) {
+  static const auto Ones = []() { std::array<u32, 64> A; A.fill(1); return A; }();
+  assert(N < Ones.size());
+  return (u32)Coder->Decode(Ones.data(), N+1, N+1);
+}
+
 inline void
 EncodeBinomialSmallRange(u32 n, u32 v, const cdf& CdfTable, arithmetic_coder<>* Coder) {
   assert(v>=0 && v<=n);
+  TRACE_SYMBOL(symbol_kind::Binomial, n, v);
   u32 lo = v == 0 ? 0 : CdfTable[v-1];
   u32 hi = CdfTable[v];
   u32 scale = 1 << n;
@@ -1953,6 +2529,14 @@ struct bbox { vec3f Min, Max; };
 struct bbox_int { vec3i Min, Max; };
 INLINE vec3f Extent(const bbox& BBox) { return BBox.Max - BBox.Min; }
 INLINE vec3i Extent(const bbox_int& BBox) { return BBox.Max - BBox.Min; }
+INLINE bool
+Overlaps(const bbox_int& A, const bbox_int& B) {
+  return A.Min.x<=B.Max.x && B.Min.x<=A.Max.x && A.Min.y<=B.Max.y && B.Min.y<=A.Max.y && A.Min.z<=B.Max.z && B.Min.z<=A.Max.z;
+}
+INLINE bool
+Inside(const vec3i& P, const bbox_int& B) {
+  return B.Min.x<=P.x && P.x<=B.Max.x && B.Min.y<=P.y && P.y<=B.Max.y && B.Min.z<=P.z && P.z<=B.Max.z;
+}
 
 enum node_type { Root, Inner };
 
@@ -1993,6 +2577,16 @@ struct q_item {
 
 enum class refinement_mode { ERROR_BASED, LOSSLESS, SEPARATION_ONLY }; 
 
+/* Per axis, the runs of (sign, exponent) classes used by float positions. The class of an ordered int V
+is V >> MantBits, and only the classes in a run get int values, so an axis that crosses zero (or spans
+many exponents) does not pay for the unused classes in between. */
+constexpr inline int FloatMaxRuns = 8;
+struct float_runs {
+  i16 NRuns = 0;
+  i16 First[FloatMaxRuns] = {}; // first class of the run
+  i16 Count[FloatMaxRuns] = {}; // number of classes in the run
+};
+
 struct params {
   char Name[64];
   char DimsStr[128] = {};
@@ -2022,6 +2616,65 @@ struct params {
   int MaxParticleSubSampling = 0;
   //bool NoRefinement = false;
   refinement_mode RefinementMode = refinement_mode::ERROR_BASED;
+  i8 NAttrs = 0; // number of per-particle attribute components (e.g. 4 for intensity + rgb)
+  u32 AttrFloatMask = 0; // bit I is set if attribute component I is a float
+  i8 FloatBits = 0; // 32 or 64 if the input positions are floats (mapped losslessly to ints), 0 otherwise
+  i8 FloatShift3[3] = {}; // per axis, number of (always zero) low bits dropped from the magnitudes
+  i64 FloatMin3[3] = {}; // per axis, the smallest mapped int
+  i8 FloatLowBits3[3] = {}; // per axis, number of low bits of the mapped int coded as an attribute (see MapFloatsToInts)
+  float_runs FloatRuns3[3]; // per axis, the float classes in use (the "float-runs" section)
+  i32 NTimeSteps = 0; // > 0 for a time series (one segment per time step in the dataset)
+  i32 KeyframeInterval = 0; // every KeyframeInterval-th time step is coded without the previous frame
+  bool TemporalLeaves = false; // predict leaf positions from the previous frame's particles
+  bool CarryContexts = false; // predicted frames continue from the previous frame's context counts
+  u64 ModelHash = 0; // of the context model the counts start from (0 = no model)
+  bool Multiplicity = false; // a leaf cell can hold several particles at the same position
+  i8 ChunkDepth = 0; // > 0 if every subtree at this depth is coded on its own (see chunk_meta)
+  bool LevelStreams = false; // each resolution level is coded into its own sub-stream (see level_stream_meta)
+};
+
+/* Per time step entry of a series' offset index (the "steps" section of the dataset). The grid
+parameters are per time step since each frame has its own bounding box. */
+struct time_step_meta {
+  i64 Offset = 0; // of the time step's segment in the "series" section
+  i64 BlockStreamSize = 0;
+  i64 CoderStreamSize = 0;
+  u64 Checksum = 0; // of the segment, so that a single time step can be checked on its own
+  i64 NParticles = 0;
+  bbox_int BBoxInt;
+  vec3i Dims3;
+  vec3i W3;
+  char DimsStr[128] = {};
+  i8 FloatShift3[3] = {};
+  i64 FloatMin3[3] = {};
+  i8 FloatLowBits3[3] = {};
+  i8 NAttrs = 0; // the float low bits are attributes too, and their number can change between time steps
+  bool Keyframe = false; // does not depend on the previous time step
+};
+
+/* Entry of the chunk index of a chunked tree (the "chunk-index" section). A chunk is a non-empty
+subtree at depth Params.ChunkDepth, coded from fresh contexts into its own segment, so that a region
+of interest only decodes the chunks it overlaps. The tree above the chunks is a plain spatial
+partition, so the grid and particle count of each chunk are all the decoder needs to start. */
+struct chunk_meta {
+  grid_int Grid;
+  i64 NParticles = 0;
+  i64 Offset = 0; // of the chunk's segment in the "chunks" section
+  i64 BlockStreamSize = 0;
+  i64 CoderStreamSize = 0;
+  u64 Checksum = 0; // of the segment
+};
+
+/* Entry of the level index of a tree coded with level streams (the "level-index" section). Level 0 is
+the coarsest: the tree above and along the chain of resolution splits. The right child of the
+resolution split at ResLvl r (and its subtree) is level NLevels-1-r. The levels are stored in order in
+the "levels" section, so decoding up to a level reads a prefix of it. */
+struct level_stream_meta {
+  i64 Offset = 0; // of the level's sub-stream in the "levels" section
+  i64 BlockStreamSize = 0;
+  i64 CoderStreamSize = 0;
+  u64 Checksum = 0; // of the sub-stream
+  i64 NParticles = 0; // coded in the level
 };
 
 /* the left side is favored if the dimension is odd */
@@ -2067,32 +2720,80 @@ INLINE bool operator<(const block_meta& Lhs, const block_meta& Rhs) {
   return Lhs.BlockId < Rhs.BlockId;
 }
 
+/* A decoded block. Only the nodes from the first to the last non-zero count are stored, as u32
+(i64 only if some count does not fit), so that a block costs what it holds rather than
+POW2(BlockBits) counts. A refinement block keeps its raw bits instead. */
 struct block {
-  std::vector<i64> Nodes; // used when level <= BaseHeight
-//  bitset BitSet = bitset{ nullptr, 0 }; // used when level > BaseHeight
-  bitstream Bs;
+  u64 First = 0; // node index (in the block) of Counts[0]
+  std::vector<u32> Counts; // used when level <= BaseHeight
+  std::vector<i64> WideCounts; // replaces Counts when a count needs more than 32 bits
+  std::vector<byte> Bits; // used when level > BaseHeight
+  bitstream Bs; // reads Bits
   int NParticles = 0; // only used when level > BaseHeight (to complement BitSet)
-  block() { Nodes.resize(POW2(Params.BlockBits)); }
-  block(bitstream* Bs) { 
-    Nodes.resize(Size(Bs->Stream) / sizeof(Nodes[0]) + 1);
-    memcpy(Nodes.data(), Bs->Stream.Data, Size(Bs->Stream));
-    this->Bs.Stream.Data = (byte*)Nodes.data();
-    this->Bs.Stream.Bytes = Bs->Stream.Bytes;
-    InitRead(&this->Bs, this->Bs.Stream); 
+  block() = default;
+  block(block&&) = default;
+  block& operator=(block&&) = default;
+  block(const block& Other) { *this = Other; }
+  /* Bs has to point into our own copy of the bits */
+  block& operator=(const block& Other) {
+    First = Other.First;
+    Counts = Other.Counts;
+    WideCounts = Other.WideCounts;
+    Bits = Other.Bits;
+    NParticles = Other.NParticles;
+    Bs = bitstream();
+    if (!Bits.empty())
+      InitRead(&Bs, buffer(Bits.data(), (i64)Bits.size()));
+    return *this;
+  }
+  i64 Node(u64 I) const {
+    u64 J = I - First; // wraps around when I < First
+    if (!WideCounts.empty())
+      return J < WideCounts.size() ? WideCounts[J] : 0;
+    return J < Counts.size() ? Counts[J] : 0;
+  }
+  u64 Begin() const { return First; }
+  u64 End() const { return First + (WideCounts.empty() ? Counts.size() : WideCounts.size()); }
+  /* keep the non-zero range of Nodes[0, N) */
+  void Pack(const i64* Nodes, u64 N) {
+    u64 B = 0, E = N;
+    while (B < E && Nodes[B] == 0) ++B;
+    while (E > B && Nodes[E - 1] == 0) --E;
+    First = B;
+    Counts.clear();
+    WideCounts.clear();
+    bool Wide = std::any_of(Nodes + B, Nodes + E, [](i64 C) { return u64(C) > 0xFFFFFFFFull; });
+    if (Wide)
+      WideCounts.assign(Nodes + B, Nodes + E);
+    else
+      Counts.assign(Nodes + B, Nodes + E);
+  }
+  /* copy the Size(Src) bytes of a refinement block (plus a word of zeros for the reader) */
+  void SetBits(const bitstream& Src) {
+    Bits.assign(Src.Stream.Data, Src.Stream.Data + Size(Src));
+    Bits.resize(Bits.size() + sizeof(Bs.BitBuf), 0);
+    InitRead(&Bs, buffer(Bits.data(), (i64)Bits.size()));
   }
 };
-using block_table = std::vector<std::vector<block>>; // [level] -> [block id] -> block data
+using block_table = std::vector<std::unordered_map<u64, block>>; // [level] -> block id -> block data
 inline block_table Blocks;
 inline std::vector<particle> Particles;
 inline std::vector<particle_int> ParticlesInt;
+inline std::vector<i32> Attributes; // [particle][component], Params.NAttrs values per particle, same order as ParticlesInt
 inline std::vector<particle> ParticlesDecoded;
 inline std::vector<bitstream> BlockStreams; // [level] -> bitstream (of the current block)
 inline std::vector<bitstream> RefBlockStreams; // [height] -> bitstream (of the current block)
 inline std::vector<u64> CurrBlocks; // [level] -> current block id
 inline std::vector<ref_block> CurrRefBlocks; // [height] -> current refinement block
-inline std::vector<std::vector<block_meta>> BlockOffsets; // [level] -> [block id] -> block offset
+/* The index of a level file as loaded by the decoder, sorted by block id */
+struct block_index {
+  bool Loaded = false;
+  std::vector<u64> Ids;
+  std::vector<i64> Offsets; // [entry] -> byte offset in the file
+  std::vector<i64> Sizes; // [entry] -> bytes
+};
+inline std::vector<block_index> BlockIndex; // [level]
 inline int MaxBlockSize = 0; // max block size
-inline std::vector<byte> Padding;
 inline std::vector<std::vector<block_meta>> BlockBytes; // [level] -> [block id] -> block size
 inline i64 NBlocksWritten = 0;
 
@@ -2122,33 +2823,6 @@ WriteBlock(bitstream* Bs, i8 Level, u64 BlockIdx) {
   }
 }
 
-inline void
-WriteMetaFile(const params& Params, cstr FileName) {
-  FILE* Fp = fopen(FileName, "w");
-  fprintf(Fp, "(\n"); // begin (
-  fprintf(Fp, "  (common\n");
-  fprintf(Fp, "    (name \"%s\")\n", Params.Name);
-  fprintf(Fp, "    (particles %lld)\n", Params.NParticles);
-  fprintf(Fp, "    (dimensions %d)\n", Params.NDims);
-  fprintf(Fp, "    (grid %d %d %d)\n", EXPvec3(Params.Dims3));
-  fprintf(Fp, "    (w3 %d %d %d)\n", EXPvec3(Params.W3));
-  fprintf(Fp, "    (dims-string %s)\n", Params.DimsStr);
-  //fprintf(Fp, "    (bounding-box %.10f %.10f %.10f %.10f %.10f %.10f)\n", EXPvec3(Params.BBox.Min), EXPvec3(Params.BBox.Max));
-  fprintf(Fp, "    (bounding-box %d %d %d %d %d %d)\n", EXPvec3(Params.BBoxInt.Min), EXPvec3(Params.BBoxInt.Max));
-  fprintf(Fp, "  )\n"); // end common)
-  fprintf(Fp, "  (format\n");
-  fprintf(Fp, "    (version %d %d)\n", Params.Version[0], Params.Version[1]);
-  fprintf(Fp, "    (resolutions %d)\n", Params.NLevels);
-  fprintf(Fp, "    (start-depth %d)\n", Params.StartResolutionSplit);
-  fprintf(Fp, "    (block-bits %d)\n", Params.BlockBits);
-  fprintf(Fp, "    (accuracy %.10f)\n", Params.Accuracy);
-  fprintf(Fp, "    (refinement %d)\n", Params.RefinementMode);
-  fprintf(Fp, "    (height %d)\n", Params.MaxHeight);
-  fprintf(Fp, "  )\n"); // end format)
-  fprintf(Fp, ")\n"); // end )
-  fclose(Fp);
-}
-
 template <typename t> INLINE void WritePOD(FILE* Fp, const t Var) { fwrite(&Var, sizeof(Var), 1, Fp); }
 template <typename t> INLINE void WriteBuffer(FILE* Fp, const buffer& Buf) { fwrite(Buf.Data, Size(Buf), 1, Fp); }
 template <typename t> INLINE void WriteBuffer(FILE* Fp, const buffer& Buf, i64 Sz) { fwrite(Buf.Data, Sz, 1, Fp); }
@@ -2179,6 +2853,289 @@ ReadBackwardBuffer(FILE* Fp, buffer* Buf, i64 Sz) {
   FSEEK(Fp, Where, SEEK_SET);
 }
 
+/* ---------------- dataset container ----------------
+A dataset is a single file: a fixed header with the stream parameters and a table of contents of
+named sections, then the sections. Each section starts at a multiple of ContainerAlign (the page
+size) so it can be mapped on its own, and the header and every section carry a checksum. Opening a
+dataset takes one open and one read of the header. The sections are
+  "blocks", "coder"  the block stream and the arithmetic coder stream
+  "series", "steps"  the per time step segments of a series and their index (time_step_meta)
+  "chunks", "chunk-index"  the per chunk segments of a chunked tree and their index (see WriteChunkIndex)
+  "level-index", "levels"  the index of the per level sub-streams (level_stream_meta), then the sub-streams
+  "level-<L>"        the blocks of level L followed by their index (see WriteBlockIndex)
+  "float-runs"       the float_runs of the three axes (of each time step) for float positions */
+constexpr inline u32 ContainerMagic = 0x3154524d; // "MRT1"
+constexpr inline u32 ContainerVersion = 1;
+constexpr inline i64 ContainerAlign = 4096;
+constexpr inline int ContainerMaxSections = 48;
+
+struct container_section {
+  char Name[16];
+  i64 Offset; // from the start of the file
+  i64 Bytes;
+  u64 Checksum; // HashBytes of the section
+};
+
+/* the parameters the decoder needs (what used to be written to the .idx file), all plain data so
+that the whole header, padding included, can be zeroed before it is checksummed */
+struct container_params {
+  char Name[64];
+  char DimsStr[128];
+  i32 Version[2];
+  i64 NParticles;
+  i32 NDims;
+  i32 Dims3[3];
+  i32 W3[3];
+  i32 BBoxMin3[3], BBoxMax3[3];
+  i32 BlockBits;
+  f32 Accuracy;
+  i32 RefinementMode;
+  u32 AttrFloatMask;
+  i32 NTimeSteps;
+  i32 KeyframeInterval;
+  u64 ModelHash;
+  i64 FloatMin3[3];
+  i8 FloatShift3[3];
+  i8 NLevels;
+  i8 StartResolutionSplit;
+  i8 NAttrs;
+  i8 FloatBits;
+  u8 MaxHeight;
+  u8 TemporalLeaves;
+  u8 CarryContexts;
+  u8 Multiplicity;
+  /* the fields below were (zeroed) padding, so files written before them read 0 */
+  u8 LevelStreams;
+  i8 ChunkDepth;
+  i8 FloatLowBits3[3];
+};
+
+struct container_header {
+  u32 Magic;
+  u32 Version;
+  u32 HeaderBytes; // sizeof(container_header) when written
+  u32 NSections;
+  container_params Params;
+  container_section Sections[ContainerMaxSections];
+  u64 Checksum; // of the bytes before it
+};
+static_assert(sizeof(container_header) <= ContainerAlign, "the header must fit before the first section");
+
+struct container_writer {
+  FILE* Fp = nullptr; // null once the container is finished
+  char FileName[512];
+  container_header Header;
+  i64 End = ContainerAlign; // of the last section
+  container_section* Open = nullptr; // the section being written
+  bool Failed = false; // a seek or write came up short, so EndContainer fails
+};
+
+struct container {
+  int Fd = -1;
+  container_header Header;
+};
+
+inline container_params
+PackParams(const params& P) {
+  container_params C;
+  memset(&C, 0, sizeof(C)); // the padding is checksummed too
+  snprintf(C.Name, sizeof(C.Name), "%s", P.Name);
+  memcpy(C.DimsStr, P.DimsStr, sizeof(C.DimsStr));
+  C.Version[0] = P.Version[0];
+  C.Version[1] = P.Version[1];
+  C.NParticles = P.NParticles;
+  C.NDims = P.NDims;
+  C.BlockBits = P.BlockBits;
+  C.Accuracy = P.Accuracy;
+  C.RefinementMode = i32(P.RefinementMode);
+  C.AttrFloatMask = P.AttrFloatMask;
+  C.NTimeSteps = P.NTimeSteps;
+  C.KeyframeInterval = P.KeyframeInterval;
+  C.ModelHash = P.ModelHash;
+  FOR(int, D, 0, 3) {
+    C.Dims3[D] = P.Dims3[D];
+    C.W3[D] = P.W3[D];
+    C.BBoxMin3[D] = P.BBoxInt.Min[D];
+    C.BBoxMax3[D] = P.BBoxInt.Max[D];
+    C.FloatMin3[D] = P.FloatMin3[D];
+    C.FloatShift3[D] = P.FloatShift3[D];
+    C.FloatLowBits3[D] = P.FloatLowBits3[D];
+  }
+  C.NLevels = P.NLevels;
+  C.StartResolutionSplit = P.StartResolutionSplit;
+  C.NAttrs = P.NAttrs;
+  C.FloatBits = P.FloatBits;
+  C.ChunkDepth = P.ChunkDepth;
+  C.MaxHeight = P.MaxHeight;
+  C.TemporalLeaves = P.TemporalLeaves;
+  C.CarryContexts = P.CarryContexts;
+  C.Multiplicity = P.Multiplicity;
+  C.LevelStreams = P.LevelStreams;
+  return C;
+}
+
+inline void
+UnpackParams(const container_params& C, params* P) {
+  snprintf(P->Name, sizeof(P->Name), "%.*s", int(sizeof(C.Name)), C.Name);
+  memcpy(P->DimsStr, C.DimsStr, sizeof(P->DimsStr));
+  P->DimsStr[sizeof(P->DimsStr) - 1] = '\0';
+  P->Version = vec2i(C.Version[0], C.Version[1]);
+  P->NParticles = C.NParticles;
+  P->NDims = C.NDims;
+  P->BlockBits = C.BlockBits;
+  P->Accuracy = C.Accuracy;
+  P->RefinementMode = refinement_mode(C.RefinementMode);
+  P->AttrFloatMask = C.AttrFloatMask;
+  P->NTimeSteps = C.NTimeSteps;
+  P->KeyframeInterval = C.KeyframeInterval;
+  P->ModelHash = C.ModelHash;
+  FOR(int, D, 0, 3) {
+    P->Dims3[D] = C.Dims3[D];
+    P->W3[D] = C.W3[D];
+    P->BBoxInt.Min[D] = C.BBoxMin3[D];
+    P->BBoxInt.Max[D] = C.BBoxMax3[D];
+    P->FloatMin3[D] = C.FloatMin3[D];
+    P->FloatShift3[D] = C.FloatShift3[D];
+    P->FloatLowBits3[D] = C.FloatLowBits3[D];
+  }
+  P->NLevels = C.NLevels;
+  P->StartResolutionSplit = C.StartResolutionSplit;
+  P->NAttrs = C.NAttrs;
+  P->FloatBits = C.FloatBits;
+  P->ChunkDepth = C.ChunkDepth;
+  P->MaxHeight = C.MaxHeight;
+  P->TemporalLeaves = C.TemporalLeaves != 0;
+  P->CarryContexts = C.CarryContexts != 0;
+  P->Multiplicity = C.Multiplicity != 0;
+  P->LevelStreams = C.LevelStreams != 0;
+  P->LogDims3 = vec3i(LOG2_FLOOR(P->Dims3.x), LOG2_FLOOR(P->Dims3.y), LOG2_FLOOR(P->Dims3.z));
+  P->BaseHeight = P->LogDims3.x + P->LogDims3.y + P->LogDims3.z;
+}
+
+inline bool
+BeginContainer(container_writer* W, cstr FileName) {
+  memset(&W->Header, 0, sizeof(W->Header));
+  W->End = ContainerAlign;
+  W->Open = nullptr;
+  W->Failed = false;
+  snprintf(W->FileName, sizeof(W->FileName), "%s", FileName);
+  return (W->Fp = fopen(FileName, "wb")) != nullptr;
+}
+
+/* Close and delete a container that was not finished, so that a failed encode leaves no
+truncated dataset behind */
+inline void
+AbortContainer(container_writer* W) {
+  if (!W->Fp)
+    return;
+  fclose(W->Fp);
+  W->Fp = nullptr;
+  remove(W->FileName);
+}
+
+inline void
+BeginSection(container_writer* W, cstr Name) {
+  container_header& H = W->Header;
+  REQUIRE(!W->Open);
+  REQUIRE(H.NSections < ContainerMaxSections);
+  REQUIRE(strlen(Name) < sizeof(H.Sections[0].Name));
+  W->Open = &H.Sections[H.NSections++];
+  snprintf(W->Open->Name, sizeof(W->Open->Name), "%s", Name);
+  W->End = (W->End + ContainerAlign - 1) / ContainerAlign * ContainerAlign;
+  W->Open->Offset = W->End;
+  W->Open->Checksum = HashBasis;
+  if (FSEEK(W->Fp, W->End, SEEK_SET) != 0) // the gap reads as zeros
+    W->Failed = true;
+}
+
+inline void
+AppendSection(container_writer* W, const void* Data, i64 Bytes) {
+  assert(W->Open);
+  if (Bytes > 0 && fwrite(Data, Bytes, 1, W->Fp) != 1)
+    W->Failed = true;
+  W->Open->Bytes += Bytes;
+  W->Open->Checksum = HashBytes(Data, Bytes, W->Open->Checksum);
+  W->End += Bytes;
+}
+
+INLINE void EndSection(container_writer* W) { W->Open = nullptr; }
+
+inline void
+WriteSection(container_writer* W, cstr Name, const void* Data, i64 Bytes) {
+  BeginSection(W, Name);
+  AppendSection(W, Data, Bytes);
+  EndSection(W);
+}
+
+/* Move a file written during encoding into a section, then delete the file */
+inline bool
+WriteSectionFromFile(container_writer* W, cstr Name, cstr FileName) {
+  FILE* Fp = fopen(FileName, "rb");
+  if (!Fp) return false;
+  BeginSection(W, Name);
+  std::vector<byte> Buf(1 << 16);
+  size_t N = 0;
+  while ((N = fread(Buf.data(), 1, Buf.size(), Fp)) > 0)
+    AppendSection(W, Buf.data(), N);
+  EndSection(W);
+  bool Ok = !ferror(Fp);
+  fclose(Fp);
+  if (Ok)
+    remove(FileName);
+  return Ok;
+}
+
+/* The header goes in last since the encoder only knows some parameters (e.g. the number of time
+steps) at the end */
+inline bool
+EndContainer(container_writer* W, const params& P) {
+  container_header& H = W->Header;
+  REQUIRE(!W->Open);
+  H.Magic = ContainerMagic;
+  H.Version = ContainerVersion;
+  H.HeaderBytes = sizeof(H);
+  H.Params = PackParams(P);
+  H.Checksum = HashBytes(&H, offsetof(container_header, Checksum));
+  bool Ok = !W->Failed && FSEEK(W->Fp, 0, SEEK_SET) == 0 && fwrite(&H, sizeof(H), 1, W->Fp) == 1;
+  Ok = fclose(W->Fp) == 0 && Ok;
+  W->Fp = nullptr;
+  return Ok;
+}
+
+/* One read of the header; false if the file is not a dataset (or not of this version) */
+inline bool
+OpenContainer(container* C, cstr FileName) {
+  container_header& H = C->Header;
+  if ((C->Fd = OpenReadOnly(FileName)) < 0)
+    return false;
+  return ReadAt(C->Fd, &H, sizeof(H), 0) == i64(sizeof(H)) && H.Magic == ContainerMagic &&
+         H.Version == ContainerVersion && H.HeaderBytes == sizeof(H) && H.NSections <= u32(ContainerMaxSections) &&
+         H.Checksum == HashBytes(&H, offsetof(container_header, Checksum));
+}
+
+inline void
+CloseContainer(container* C) {
+  if (C->Fd >= 0)
+    CloseFd(C->Fd);
+  C->Fd = -1;
+}
+
+inline const container_section*
+FindSection(const container& C, cstr Name) {
+  FOR(u32, I, 0, C.Header.NSections) {
+    const container_section& S = C.Header.Sections[I];
+    if (strncmp(S.Name, Name, sizeof(S.Name)) == 0)
+      return &S;
+  }
+  return nullptr;
+}
+
+/* Read a whole section into Data (of at least S.Bytes) and check it */
+inline bool
+ReadSection(const container& C, const container_section& S, void* Data) {
+  return ReadAt(C.Fd, Data, S.Bytes, S.Offset) == S.Bytes && HashBytes(Data, S.Bytes) == S.Checksum;
+}
+
 struct q_item_new {
   i64 Begin, End;
   i64 Idx; // index in the tree
@@ -2197,25 +3154,219 @@ struct cosmo_header {
   float massp;
 };
 
+/* Map a float to an int such that the order of the ints is the same as the order of the floats
+(the mapping is its own inverse) */
+INLINE i32
+FloatToOrderedInt(f32 F) {
+  i32 I; memcpy(&I, &F, sizeof(I));
+  return I >= 0 ? I : I ^ 0x7FFFFFFF;
+}
+INLINE f32
+OrderedIntToFloat(i32 I) {
+  I = I >= 0 ? I : I ^ 0x7FFFFFFF;
+  f32 F; memcpy(&F, &I, sizeof(F));
+  return F;
+}
+
+INLINE u32 ZigZag(i32 V) { return (u32(V) << 1) ^ u32(V >> 31); }
+INLINE i32 UnZigZag(u32 V) { return i32(V >> 1) ^ -i32(V & 1); }
+INLINE u64 ZigZag64(i64 V) { return (u64(V) << 1) ^ u64(V >> 63); }
+INLINE i64 UnZigZag64(u64 V) { return i64(V >> 1) ^ -i64(V & 1); }
+
+/* The block index at the end of a level file: one entry per written (so non-empty) block, sorted by
+block id, each as three varbytes: the id delta, the size, and the zigzagged offset relative to the end
+of the previous entry (0 when the blocks were written in id order). It is followed by the number of
+entries and the size of the index in bytes (BlockIndexTrailer). */
+constexpr inline i64 BlockIndexTrailer = 2 * sizeof(u64);
+
+/* Written lists the blocks in the order they were appended to the file */
+inline void
+WriteBlockIndex(FILE* Fp, const std::vector<block_meta>& Written) {
+  struct entry { u64 Id; i64 Offset, Size; };
+  std::vector<entry> Entries;
+  Entries.reserve(Written.size());
+  i64 Offset = 0;
+  FOR_EACH(W, Written) {
+    Entries.push_back(entry{W->BlockId, Offset, W->Size});
+    Offset += W->Size;
+  }
+  std::sort(Entries.begin(), Entries.end(), [](const entry& A, const entry& B) { return A.Id < B.Id; });
+  bitstream Bs;
+  InitWrite(&Bs, 64 + (i64)Entries.size() * 8);
+  u64 PrevId = 0;
+  i64 PrevEnd = 0;
+  FOR_EACH(E, Entries) {
+    GrowToAccomodate(&Bs, 32);
+    WriteVarByte(&Bs, E->Id - PrevId);
+    WriteVarByte(&Bs, E->Size);
+    WriteVarByte(&Bs, ZigZag64(E->Offset - PrevEnd));
+    PrevId = E->Id;
+    PrevEnd = E->Offset + E->Size;
+  }
+  Flush(&Bs);
+  u64 NBlocks = Entries.size(), IndexBytes = Size(Bs);
+  fwrite(Bs.Stream.Data, IndexBytes, 1, Fp);
+  WritePOD(Fp, NBlocks);
+  WritePOD(Fp, IndexBytes);
+  Dealloc(&Bs);
+}
+
+/* Data must be readable for a word past Bytes */
+inline void
+ParseBlockIndex(const byte* Data, i64 Bytes, u64 NBlocks, block_index* Index) {
+  Index->Ids.resize(NBlocks);
+  Index->Offsets.resize(NBlocks);
+  Index->Sizes.resize(NBlocks);
+  bitstream Bs;
+  InitRead(&Bs, buffer(Data, Bytes));
+  u64 Id = 0;
+  i64 End = 0;
+  FOR(u64, I, 0, NBlocks) {
+    Id += ReadVarByte(&Bs);
+    Index->Ids[I] = Id;
+    Index->Sizes[I] = (i64)ReadVarByte(&Bs);
+    Index->Offsets[I] = End + UnZigZag64(ReadVarByte(&Bs));
+    End = Index->Offsets[I] + Index->Sizes[I];
+  }
+  Index->Loaded = true;
+}
+
+/* The chunk index (the "chunk-index" section) as varbytes: the number of chunks, then for each chunk, in
+coding order, the grid (From3 as zigzagged deltas from the previous chunk's, then Dims3 and Stride3), the
+particle count, the two stream sizes, the zigzagged offset relative to the end of the previous segment (0
+when the segments are contiguous) and the 64-bit checksum: about a third of sizeof(chunk_meta) a chunk. */
+inline void
+WriteChunkIndex(container_writer* W, const std::vector<chunk_meta>& Chunks) {
+  bitstream Bs;
+  InitWrite(&Bs, 64 + (i64)Chunks.size() * 32);
+  WriteVarByte(&Bs, Chunks.size());
+  vec3i PrevFrom(0);
+  i64 PrevEnd = 0;
+  FOR_EACH(C, Chunks) {
+    GrowToAccomodate(&Bs, 160);
+    FOR(int, D, 0, 3) { WriteVarByte(&Bs, ZigZag(C->Grid.From3[D] - PrevFrom[D])); }
+    FOR(int, D, 0, 3) { WriteVarByte(&Bs, u32(C->Grid.Dims3[D])); }
+    FOR(int, D, 0, 3) { WriteVarByte(&Bs, u32(C->Grid.Stride3[D])); }
+    WriteVarByte(&Bs, C->NParticles);
+    WriteVarByte(&Bs, C->BlockStreamSize);
+    WriteVarByte(&Bs, C->CoderStreamSize);
+    WriteVarByte(&Bs, ZigZag64(C->Offset - PrevEnd));
+    Write(&Bs, C->Checksum & 0xFFFFFFFF, 32);
+    Write(&Bs, C->Checksum >> 32, 32);
+    PrevFrom = C->Grid.From3;
+    PrevEnd = C->Offset + C->BlockStreamSize + C->CoderStreamSize;
+  }
+  Flush(&Bs);
+  WriteSection(W, "chunk-index", Bs.Stream.Data, Size(Bs));
+  Dealloc(&Bs);
+}
+
+/* Return false if the section is corrupt */
+inline bool
+ReadChunkIndex(const container& C, const container_section& S, std::vector<chunk_meta>* Chunks) {
+  std::vector<byte> Buf(S.Bytes + 256, 0); // an entry can be read past the end before the check
+  if (!ReadSection(C, S, Buf.data()))
+    return false;
+  bitstream Bs;
+  InitRead(&Bs, buffer(Buf.data(), S.Bytes));
+  u64 NChunks = ReadVarByte(&Bs);
+  if (NChunks > u64(S.Bytes))
+    return false;
+  Chunks->resize(NChunks);
+  vec3i From(0);
+  i64 End = 0;
+  FOR_EACH(Chunk, *Chunks) {
+    FOR(int, D, 0, 3) { From[D] += UnZigZag(u32(ReadVarByte(&Bs))); }
+    Chunk->Grid.From3 = From;
+    FOR(int, D, 0, 3) { Chunk->Grid.Dims3[D] = i32(ReadVarByte(&Bs)); }
+    FOR(int, D, 0, 3) { Chunk->Grid.Stride3[D] = i32(ReadVarByte(&Bs)); }
+    Chunk->NParticles = (i64)ReadVarByte(&Bs);
+    Chunk->BlockStreamSize = (i64)ReadVarByte(&Bs);
+    Chunk->CoderStreamSize = (i64)ReadVarByte(&Bs);
+    Chunk->Offset = End + UnZigZag64(ReadVarByte(&Bs));
+    Chunk->Checksum = Read(&Bs, 32);
+    Chunk->Checksum |= Read(&Bs, 32) << 32;
+    End = Chunk->Offset + Chunk->BlockStreamSize + Chunk->CoderStreamSize;
+    if (Size(Bs) > S.Bytes)
+      return false;
+  }
+  return true;
+}
+
+/* Vels (if not null) receives the velocities as ordered ints (3 components per particle) */
 inline std::vector<particle>
-ReadCosmo(cstr FileName) {
+ReadCosmo(cstr FileName, std::vector<i32>* Vels = nullptr) {
   auto Fp = fopen(FileName, "rb");
   cosmo_header Header;
   ReadPOD(Fp, &Header);
   printf("number of particles = %d\n", Header.np_local);
   std::vector<particle> Particles(Header.np_local);
+  if (Vels) Vels->resize(i64(Header.np_local) * 3);
   vec3f Vel; // velocity
-  FOR_EACH(P, Particles) {
-    ReadPOD(Fp, &P->Pos);
-    ReadPOD(Fp, &Vel); // dummy
+  FOR(i64, I, 0, Header.np_local) {
+    ReadPOD(Fp, &Particles[I].Pos);
+    ReadPOD(Fp, &Vel);
+    if (Vels) {
+      (*Vels)[I*3+0] = FloatToOrderedInt(Vel.x);
+      (*Vels)[I*3+1] = FloatToOrderedInt(Vel.y);
+      (*Vels)[I*3+2] = FloatToOrderedInt(Vel.z);
+    }
   }
   fclose(Fp);
   return Particles;
 }
 
+/* Attribute file: i64 number of particles, i32 number of components, u32 float mask, then the values
+(raw f32 bits for float components), one row per particle */
+inline void
+WriteAttributes(cstr FileName, int NAttrs, u32 FloatMask, const std::vector<i32>& Attrs) {
+  auto Fp = fopen(FileName, "wb");
+  i64 N = NAttrs>0 ? i64(Attrs.size()) / NAttrs : 0;
+  WritePOD(Fp, N);
+  WritePOD(Fp, i32(NAttrs));
+  WritePOD(Fp, FloatMask);
+  FOR(i64, I, 0, i64(Attrs.size())) {
+    i32 V = Attrs[I];
+    if (FloatMask & (1u << (I % NAttrs))) { // store floats as floats
+      f32 F = OrderedIntToFloat(V);
+      memcpy(&V, &F, sizeof(V));
+    }
+    WritePOD(Fp, V);
+  }
+  fclose(Fp);
+}
+
+inline bool
+ReadAttributes(cstr FileName, int* NAttrs, u32* FloatMask, std::vector<i32>* Attrs) {
+  TIME_STAGE(stage::FileRead);
+  auto Fp = fopen(FileName, "rb");
+  if (!Fp) return false;
+  i64 N = 0; i32 NComps = 0;
+  ReadPOD(Fp, &N);
+  ReadPOD(Fp, &NComps);
+  ReadPOD(Fp, FloatMask);
+  if (N < 0 || NComps < 0 || NComps > 32) { // the float mask has one bit per component
+    fclose(Fp);
+    return false;
+  }
+  *NAttrs = NComps;
+  Attrs->resize(N * NComps);
+  bool Ok = fread(Attrs->data(), sizeof(i32), Attrs->size(), Fp) == Attrs->size();
+  fclose(Fp);
+  if (!Ok) return false; // truncated
+  FOR(i64, I, 0, i64(Attrs->size())) { // floats are coded as ordered ints
+    if (*FloatMask & (1u << (I % NComps))) {
+      f32 F; memcpy(&F, &(*Attrs)[I], sizeof(F));
+      (*Attrs)[I] = FloatToOrderedInt(F);
+    }
+  }
+  return true;
+}
+
 inline std::vector<particle_int>
 ReadPlyInt(cstr FileName) {
   auto Fp = fopen(FileName, "rb");
+  if (!Fp) return std::vector<particle_int>();
   char Buf[512];
   fgets(Buf, sizeof Buf, Fp); // "ply"
   fgets(Buf, sizeof Buf, Fp); // "format ascii" or "format binary_little_endian 1.0"
@@ -2375,6 +3526,36 @@ WriteRawParticles(cstr FileName, const std::vector<particle>& Particles) {
   fclose(Fp);
 }
 
+/* raw doubles: i64 count followed by x y z for each particle, false if the file is missing or short */
+inline bool
+ReadRawParticlesF64(cstr FileName, std::vector<f64>* Pos3) {
+  auto Fp = fopen(FileName, "rb");
+  if (!Fp) return false;
+  i64 Size = 0;
+  bool Ok = fread(&Size, sizeof(Size), 1, Fp) == 1 && Size >= 0;
+  if (Ok) { // check the length first, so that a corrupt count does not allocate
+    i64 Begin = FTELL(Fp);
+    FSEEK(Fp, 0, SEEK_END);
+    Ok = (FTELL(Fp) - Begin) / i64(3 * sizeof(f64)) >= Size;
+    FSEEK(Fp, Begin, SEEK_SET);
+  }
+  if (Ok) {
+    Pos3->resize(Size * 3);
+    Ok = fread(Pos3->data(), sizeof(f64), Pos3->size(), Fp) == Pos3->size();
+  }
+  fclose(Fp);
+  return Ok;
+}
+
+inline void
+WriteRawParticlesF64(cstr FileName, const std::vector<f64>& Pos3) {
+  auto Fp = fopen(FileName, "wb");
+  i64 Size = Pos3.size() / 3;
+  fwrite(&Size, sizeof(Size), 1, Fp);
+  fwrite(Pos3.data(), sizeof(f64), Pos3.size(), Fp);
+  fclose(Fp);
+}
+
 inline std::vector<particle>
 ReadRawParticles(cstr FileName) {
   auto Fp = fopen(FileName, "rb");
@@ -2613,6 +3794,7 @@ template <>
 struct traits<f32> {
   using integral_t = i32;
   static constexpr int ExpBits = 8;
+  static constexpr int MantBits = 23;
   static constexpr int ExpBias = (1 << (ExpBits - 1)) - 1;
   static constexpr f32 Min = -FLT_MAX;
   static constexpr f32 Max = FLT_MAX;
@@ -2622,6 +3804,7 @@ template <>
 struct traits<f64> {
   using integral_t = i64;
   static constexpr int ExpBits = 11;
+  static constexpr int MantBits = 52;
   static constexpr int ExpBias = (1 << (ExpBits - 1)) - 1;
   static constexpr f64 Min = -DBL_MAX;
   static constexpr f64 Max = DBL_MAX;
@@ -2643,6 +3826,174 @@ Exponent(t Val) {
   return -traits<t>::ExpBias;
 }
 
+/* Order-preserving map between floats (f32 or f64) and ints, widened to i64 */
+template <typename t> INLINE i64
+OrderedInt(t F) {
+  using int_t = typename traits<t>::integral_t;
+  int_t I; memcpy(&I, &F, sizeof(I));
+  return i64(I >= 0 ? I : I ^ traits<int_t>::Max);
+}
+
+template <typename t> INLINE t
+FromOrderedInt(i64 V) {
+  using int_t = typename traits<t>::integral_t;
+  int_t I = int_t(V);
+  I = I >= 0 ? I : I ^ traits<int_t>::Max;
+  t F; memcpy(&F, &I, sizeof(F));
+  return F;
+}
+
+/* Order-preserving int of F with the S low bits of its magnitude dropped (they must be zero), and back */
+template <typename t> INLINE i64
+ShiftedOrderedInt(t F, int S) {
+  using int_t = typename traits<t>::integral_t;
+  int_t I; memcpy(&I, &F, sizeof(I));
+  i64 Q = i64(I & traits<int_t>::Max) >> S;
+  return I >= 0 ? Q : ~Q;
+}
+
+template <typename t> INLINE t
+FromShiftedOrderedInt(i64 Q, int S) {
+  using int_t = typename traits<t>::integral_t;
+  int_t I = Q >= 0 ? int_t(Q << S) : int_t(int_t(~Q << S) | traits<int_t>::Min);
+  t F; memcpy(&F, &I, sizeof(F));
+  return F;
+}
+
+/* The classes (Q >> ClassShift) of the ordered ints Qs, merged across the smallest gaps into at most
+FloatMaxRuns runs */
+inline float_runs
+ComputeFloatRuns(const std::vector<i64>& Qs, int ClassShift) {
+  std::vector<i64> Classes;
+  FOR_EACH(Q, Qs) {
+    if (Classes.empty() || Classes.back() != (*Q >> ClassShift)) Classes.push_back(*Q >> ClassShift);
+  }
+  std::sort(Classes.begin(), Classes.end());
+  Classes.erase(std::unique(Classes.begin(), Classes.end()), Classes.end());
+  std::vector<std::pair<i64, i64>> Runs; // first and last class
+  FOR_EACH(C, Classes) {
+    if (!Runs.empty() && Runs.back().second == *C - 1)
+      Runs.back().second = *C;
+    else
+      Runs.push_back({*C, *C});
+  }
+  while (Runs.size() > FloatMaxRuns) {
+    size_t J = 1;
+    FOR(size_t, K, 2, Runs.size()) {
+      if (Runs[K].first - Runs[K-1].second < Runs[J].first - Runs[J-1].second) J = K;
+    }
+    Runs[J-1].second = Runs[J].second;
+    Runs.erase(Runs.begin() + J);
+  }
+  float_runs R;
+  R.NRuns = i16(Runs.size());
+  FOR(int, K, 0, R.NRuns) {
+    R.First[K] = i16(Runs[K].first);
+    R.Count[K] = i16(Runs[K].second - Runs[K].first + 1);
+  }
+  return R;
+}
+
+/* Ordered int -> the same int with the classes outside the runs removed, and back */
+INLINE u64
+PackFloatRuns(const float_runs& R, int ClassShift, i64 Q) {
+  i64 C = Q >> ClassShift;
+  u64 Base = 0, Low = u64(Q) & ((u64(1) << ClassShift) - 1);
+  FOR(int, K, 0, R.NRuns) {
+    if (C < R.First[K] + R.Count[K])
+      return ((Base + u64(C - R.First[K])) << ClassShift) | Low;
+    Base += R.Count[K];
+  }
+  return u64(Q);
+}
+
+INLINE i64
+UnpackFloatRuns(const float_runs& R, int ClassShift, u64 V) {
+  u64 Rank = V >> ClassShift, Low = V & ((u64(1) << ClassShift) - 1);
+  FOR(int, K, 0, R.NRuns) {
+    if (Rank < u64(R.Count[K]))
+      return i64(((u64(i64(R.First[K])) + Rank) << ClassShift) | Low);
+    Rank -= R.Count[K];
+  }
+  return i64(V);
+}
+
+/* Lossless mapping of float positions (Pos3 holds N x 3 values) to the int grid of the tree codec. Per
+axis, the low bits that are zero in all magnitudes are dropped (so that, e.g., doubles that used to be
+floats cost no more than floats), the floats are mapped to order-preserving ints, the (sign, exponent)
+classes no particle uses are squeezed out (see float_runs) and the ints are offset by the smallest
+one. An axis that still spans 2^30 or more values (e.g. doubles with a full mantissa) keeps its high
+bits in the tree and its FloatLowBits3 low ones go to Low, one i32 per particle for each such axis (see
+FloatLowAttrs), to be coded as attributes. Fails if an axis needs more than 32 low bits. */
+template <typename t> inline bool
+MapFloatsToInts(const t* Pos3, i64 N, std::vector<particle_int>* ParticlesInt, std::vector<i32>* Low) {
+  using int_t = typename traits<t>::integral_t;
+  ParticlesInt->resize(N);
+  std::vector<i64> Qs(N);
+  std::vector<std::vector<i32>> LowAxes;
+  FOR(int, D, 0, 3) {
+    u64 Or = 0;
+    FOR(i64, I, 0, N) {
+      int_t Bits; memcpy(&Bits, &Pos3[I*3 + D], sizeof(Bits));
+      Or |= u64(Bits & traits<int_t>::Max);
+    }
+    i8 Shift = MIN(Lsb(Or, 0), i8(traits<t>::MantBits));
+    int ClassShift = traits<t>::MantBits - Shift;
+    FOR(i64, I, 0, N) Qs[I] = ShiftedOrderedInt(Pos3[I*3 + D], Shift);
+    const float_runs& R = Params.FloatRuns3[D] = ComputeFloatRuns(Qs, ClassShift);
+    u64 Min = traits<u64>::Max, Max = 0;
+    FOR(i64, I, 0, N) {
+      u64 V = PackFloatRuns(R, ClassShift, Qs[I]);
+      Min = MIN(Min, V);
+      Max = MAX(Max, V);
+    }
+    i8 LowBits = MAX(i8(Msb(Max - Min) + 1 - 30), i8(0));
+    if (LowBits > 32) {
+      fprintf(stderr, "axis %d spans %llu values, too many for lossless float coding\n", D, (unsigned long long)(Max - Min));
+      return false;
+    }
+    Params.FloatMin3[D] = i64(Min);
+    Params.FloatShift3[D] = Shift;
+    Params.FloatLowBits3[D] = LowBits;
+    if (LowBits > 0)
+      LowAxes.emplace_back(N);
+    u64 LowMask = (u64(1) << LowBits) - 1;
+    FOR(i64, I, 0, N) {
+      u64 V = PackFloatRuns(R, ClassShift, Qs[I]) - Min;
+      (*ParticlesInt)[I].Pos[D] = i32(V >> LowBits);
+      if (LowBits > 0)
+        LowAxes.back()[I] = i32(u32(V & LowMask));
+    }
+  }
+  int NLow = int(LowAxes.size());
+  Low->resize(N * NLow);
+  FOR(int, K, 0, NLow) {
+    FOR(i64, I, 0, N) (*Low)[I*NLow + K] = LowAxes[K][I];
+  }
+  Params.FloatBits = sizeof(t) * 8;
+  return true;
+}
+
+/* Number of attribute components that hold the low bits of float positions */
+INLINE int
+FloatLowAttrs(const i8 LowBits3[3]) {
+  return (LowBits3[0] > 0) + (LowBits3[1] > 0) + (LowBits3[2] > 0);
+}
+
+/* Low points to the particle's low bits (see MapFloatsToInts), it is not read if there are none */
+template <typename t> INLINE void
+MapIntToFloats(const vec3i& P3, const i32* Low, t* Pos3) {
+  FOR(int, D, 0, 3) {
+    const float_runs& R = Params.FloatRuns3[D];
+    i8 Shift = Params.FloatShift3[D], LowBits = Params.FloatLowBits3[D];
+    u64 V = u64(u32(P3[D])) << LowBits;
+    if (LowBits > 0)
+      V |= u64(u32(*Low++));
+    i64 Q = UnpackFloatRuns(R, traits<t>::MantBits - Shift, V + u64(Params.FloatMin3[D]));
+    Pos3[D] = FromShiftedOrderedInt<t>(Q, Shift);
+  }
+}
+
 template <typename t, typename u> int
 QuantizeF32(int Bits, const buffer_t<t>& SBuf, buffer_t<u>* DBuf) {
   //idx2_Assert(is_floating_point<t>::Value);
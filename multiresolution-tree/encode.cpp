@@ -18,8 +18,9 @@ WriteBlockNew(bitstream* Bs, u64 BlockIdx) {
   if (Size(*Bs) > 0) {
     Flush(Bs);
     FILE* Fp = fopen(PRINT("%s.bin", Params.OutFile), "ab");
-    fwrite(Bs->Stream.Data, Size(*Bs), 1, Fp);
-    fclose(Fp);
+    REQUIRE(Fp);
+    REQUIRE(fwrite(Bs->Stream.Data, Size(*Bs), 1, Fp) == 1);
+    REQUIRE(fclose(Fp) == 0);
 
     // book-keeping
     BlockBytesNew.push_back(block_meta{.Size = Size(*Bs), .BlockId = BlockIdx});
@@ -43,20 +44,19 @@ FlushBlocksToFilesNew() {
       WriteBlockNew(&RefBlockStreams[H], CurrRefBlocks[H].BlockId + (H + 1) * NBlocksAtLeaf);
     }
   }
-  // write an index consisting of all blocks in the file
-  // TODO: compress the index?
-  // TODO: if too many blocks have 0 bytes, maybe we can write a sparse index
+  // write an index of all blocks in the file (see WriteBlockIndex)
   FILE* Fp = fopen(PRINT("%s.bin", Params.OutFile), "ab");
-  Padding.resize(MaxBlockSize);
-  fwrite(Padding.data(), Padding.size(), 1, Fp); // we write a padding the size of one block at the end of the file (why?)
-  u64 NBlocks = BlockBytes.size();
-  fwrite(BlockBytes.data(), sizeof(block_meta) * NBlocks, 1, Fp);
-  fwrite(&NBlocks, sizeof(NBlocks), 1, Fp);
-  fwrite(&MaxBlockSize, sizeof(MaxBlockSize), 1, Fp);
+  REQUIRE(Fp);
+  WriteBlockIndex(Fp, BlockBytesNew);
   printf("max block size = %d\n", MaxBlockSize);
-  fclose(Fp);
-  /* write the meta-data file */
-  WriteMetaFile(Params, PRINT("%s.idx", Params.OutFile));
+  REQUIRE(fclose(Fp) == 0);
+  /* move the blocks into the dataset, after the parameters are final */
+  char FileName[512];
+  snprintf(FileName, sizeof(FileName), "%s.bin", Params.OutFile);
+  container_writer Out;
+  REQUIRE(BeginContainer(&Out, PRINT("%s.mrt", Params.OutFile)));
+  REQUIRE(WriteSectionFromFile(&Out, "level-0", FileName));
+  REQUIRE(EndContainer(&Out, Params));
 }
 
 
@@ -0,0 +1,305 @@
+/* Microbenchmarks of the coding primitives in common.h and rans64.h, in ns/symbol.
+
+The symbols come from a trace captured from a real encode: build the codec with CAPTURE_SYMBOLS defined
+(see common.h) and run encode ... --capture_symbols file.trace. Primitives whose symbols are missing from
+the trace, or too rare in it to time (or all of them, without --trace), use synthetic symbols with similar
+distributions.
+
+  microbenchmark [--trace file.trace] [--symbols 1000000] [--reps 5]
+
+Every benchmark decodes what it encoded and checks it, so a broken primitive cannot look fast. */
+
+#define DOCTEST_CONFIG_DISABLE // no test runner in this executable
+#include "common.h"
+#include "platform.h"
+#include "rans64.h"
+#include <functional>
+#include <string>
+
+#define EXIT_ERROR(Msg) { fprintf(stderr, "%s\n", Msg); exit(1); }
+
+static constexpr int NKinds = 5;
+using symbol_list = std::vector<symbol_record>;
+
+static std::array<symbol_list, NKinds>
+ReadTrace(cstr FileName) {
+  std::array<symbol_list, NKinds> Symbols;
+  FILE* Fp = fopen(FileName, "rb");
+  if (!Fp)
+    EXIT_ERROR("cannot open the trace");
+  symbol_record R;
+  while (fread(&R, sizeof(R), 1, Fp) == 1) {
+    if (u32(R.Kind) < NKinds)
+      Symbols[u32(R.Kind)].push_back(R);
+  }
+  fclose(Fp);
+  return Symbols;
+}
+
+/* Synthetic symbols, shaped like the ones the tree coder produces */
+static symbol_list
+MakeSymbols(symbol_kind Kind, i64 N, std::mt19937* Gen) {
+  symbol_list Symbols(N);
+  std::uniform_real_distribution<f64> U(0.0, 1.0);
+  std::geometric_distribution<u32> Geometric(0.35);
+  FOR_EACH (S, Symbols) {
+    S->Kind = Kind;
+    if (Kind == symbol_kind::Context) { // 0 = escape, else 1 + a small, skewed value
+      u32 G = Geometric(*Gen);
+      S->N = ContextMax;
+      S->V = U(*Gen) < 0.01 ? 0 : 1 + (MIN(G, ContextMax));
+    } else if (Kind == symbol_kind::Binomial) { // particles in the left child of a node with n particles
+      S->N = 1 + (*Gen)() % BinomialCutoff;
+      S->V = std::binomial_distribution<u32>(S->N, 0.5)(*Gen);
+    } else if (Kind == symbol_kind::Uniform) {
+      S->N = ContextMax;
+      S->V = (*Gen)() % (ContextMax+1);
+    } else if (Kind == symbol_kind::CenteredMinimal) { // n from 2 to 2^16, v near the middle
+      S->N = 2 + u32(pow(2.0, 16*U(*Gen)));
+      S->V = std::binomial_distribution<u32>(S->N-1, 0.5)(*Gen);
+    } else { // VarByte, mostly small counts
+      S->N = 0;
+      S->V = u32(pow(2.0, 24*U(*Gen)*U(*Gen)));
+    }
+  }
+  return Symbols;
+}
+
+struct result {
+  f64 EncodeNs = 0, DecodeNs = 0; // per symbol, best of the repetitions
+  f64 BitsPerSymbol = 0;
+};
+
+/* Time Encode() and Decode() (which returns false on a mismatch) NReps times each */
+static result
+Measure(i64 NSymbols, int NReps, const std::function<i64()>& Encode, const std::function<bool()>& Decode) {
+  result R{1e30, 1e30, 0};
+  FOR(int, I, 0, NReps) {
+    f64 Start = timer();
+    i64 Bytes = Encode();
+    R.EncodeNs = MIN(R.EncodeNs, (timer() - Start) * 1e9 / NSymbols);
+    R.BitsPerSymbol = 8.0 * Bytes / NSymbols;
+    if (!Decode) { R.DecodeNs = 0; continue; }
+    Start = timer();
+    if (!Decode())
+      EXIT_ERROR("decoded symbols do not match");
+    R.DecodeNs = MIN(R.DecodeNs, (timer() - Start) * 1e9 / NSymbols);
+  }
+  return R;
+}
+
+static void
+Report(cstr Name, i64 NSymbols, const result& R) {
+  if (R.DecodeNs > 0)
+    printf("%-44s %10lld symbols  encode %8.2f ns  decode %8.2f ns  %6.2f bits/symbol\n", Name, NSymbols,
+      R.EncodeNs, R.DecodeNs, R.BitsPerSymbol);
+  else
+    printf("%-44s %10lld symbols  encode %8.2f ns  %26s %6.2f bits/symbol\n", Name, NSymbols, R.EncodeNs, "",
+      R.BitsPerSymbol);
+}
+
+int
+main(int Argc, cstr* Argv) {
+  int NReps = 5, NSynthetic = 1000000;
+  OptVal(Argc, Argv, "--reps", &NReps);
+  OptVal(Argc, Argv, "--symbols", &NSynthetic);
+  NReps = MAX(NReps, 1);
+  std::array<symbol_list, NKinds> Symbols;
+  cstr TraceFile = nullptr;
+  if (OptVal(Argc, Argv, "--trace", &TraceFile))
+    Symbols = ReadTrace(TraceFile);
+  std::mt19937 Gen(1234);
+  FOR(int, K, 0, NKinds) {
+    bool Synthetic = Symbols[K].size() < 1000;
+    if (Synthetic)
+      Symbols[K] = MakeSymbols(symbol_kind(K), NSynthetic, &Gen);
+    printf("%s symbols: %zu (%s)\n", K==0 ? "context" : K==1 ? "binomial" : K==2 ? "uniform" :
+      K==3 ? "centered minimal" : "varbyte", Symbols[K].size(), Synthetic ? "synthetic" : "trace");
+  }
+  const symbol_list& Context = Symbols[int(symbol_kind::Context)];
+  const symbol_list& Binomial = Symbols[int(symbol_kind::Binomial)];
+  const symbol_list& Uniform = Symbols[int(symbol_kind::Uniform)];
+  const symbol_list& Centered = Symbols[int(symbol_kind::CenteredMinimal)];
+  const symbol_list& VarByte = Symbols[int(symbol_kind::VarByte)];
+  i64 MaxSymbols = 0;
+  FOR(int, K, 0, NKinds) { MaxSymbols = MAX(MaxSymbols, i64(Symbols[K].size())); }
+  arithmetic_coder<> Coder;
+  Coder.InitWrite(MaxSymbols * 16 + 1024);
+  bitstream Bs;
+  InitWrite(&Bs, MaxSymbols * 16 + 1024);
+  auto CoderBytes = [&]() { Coder.EncodeFinalize(); return Size(Coder.BitStream); };
+  auto StreamBytes = [&]() { Flush(&Bs); return Size(Bs); };
+
+  /* arithmetic coder with the static binomial cdf tables (cdf vectors) */
+  symbol_list SmallBinomial; // the tables stop at BinomialCutoff
+  FOR_EACH (S, Binomial) { if (S->N <= BinomialCutoff) SmallBinomial.push_back(*S); }
+  cdf_table CdfTable = CreateBinomialTable(BinomialCutoff);
+  Report("ArithmeticEncode/Decode binomial cdf", SmallBinomial.size(), Measure(SmallBinomial.size(), NReps,
+    [&]() {
+      Coder.RewindWrite();
+      FOR_EACH (S, SmallBinomial) { ArithmeticEncode(S->N, S->V, CdfTable[S->N][S->N], CdfTable[S->N].data(), &Coder); }
+      return CoderBytes();
+    },
+    [&]() {
+      Coder.InitRead();
+      bool Ok = true;
+      FOR_EACH (S, SmallBinomial) { Ok &= Coder.Decode(CdfTable[S->N]) == S->V; }
+      return Ok;
+    }));
+
+  /* adaptive count tables (one per symbol range), with the escape protocol of the tree coder (escape, then
+  EncodeUniform) */
+  std::vector<std::array<u32, ContextMax+2>> Counts;
+  auto ResetCounts = [&]() { Counts.assign(ContextMax+1, std::array<u32, ContextMax+2>{}); };
+  symbol_list ContextSymbols; // the value of each symbol, escapes are implied by the counts
+  FOR_EACH (S, Context) { if (S->N <= ContextMax && S->V > 0 && S->V <= S->N+1) ContextSymbols.push_back(*S); }
+  Report("EncodeWithContext/DecodeWithContext", ContextSymbols.size(), Measure(ContextSymbols.size(), NReps,
+    [&]() {
+      Coder.RewindWrite();
+      ResetCounts();
+      FOR_EACH (S, ContextSymbols) {
+        auto& C = Counts[S->N];
+        C[0] = 1;
+        if (C[S->V] == 0) {
+          EncodeWithContext(S->N, 0, C.data(), &Coder);
+          EncodeUniform(S->N, S->V-1, &Coder);
+        } else {
+          EncodeWithContext(S->N, S->V, C.data(), &Coder);
+        }
+        ++C[S->V];
+      }
+      return CoderBytes();
+    },
+    [&]() {
+      Coder.InitRead();
+      ResetCounts();
+      bool Ok = true;
+      FOR_EACH (S, ContextSymbols) {
+        auto& C = Counts[S->N];
+        C[0] = 1;
+        u32 V = DecodeWithContext(S->N, C.data(), &Coder);
+        if (V == 0)
+          V = DecodeUniform(S->N, &Coder) + 1;
+        Ok &= V == S->V;
+        ++C[V];
+      }
+      return Ok;
+    }));
+
+  Report("EncodeUniform/DecodeUniform", Uniform.size(), Measure(Uniform.size(), NReps,
+    [&]() {
+      Coder.RewindWrite();
+      FOR_EACH (S, Uniform) { EncodeUniform(S->N, S->V, &Coder); }
+      return CoderBytes();
+    },
+    [&]() {
+      Coder.InitRead();
+      bool Ok = true;
+      FOR_EACH (S, Uniform) { Ok &= DecodeUniform(S->N, &Coder) == S->V; }
+      return Ok;
+    }));
+
+  Report("EncodeCenteredMinimal/DecodeCenteredMinimal", Centered.size(), Measure(Centered.size(), NReps,
+    [&]() {
+      Rewind(&Bs);
+      FOR_EACH (S, Centered) { EncodeCenteredMinimal(S->V, S->N, &Bs); }
+      return StreamBytes();
+    },
+    [&]() {
+      InitRead(&Bs, Bs.Stream);
+      bool Ok = true;
+      FOR_EACH (S, Centered) { if (S->N > 1) Ok &= DecodeCenteredMinimal(S->N, &Bs) == S->V; }
+      return Ok;
+    }));
+
+  Report("WriteVarByte/ReadVarByte", VarByte.size(), Measure(VarByte.size(), NReps,
+    [&]() {
+      Rewind(&Bs);
+      FOR_EACH (S, VarByte) { WriteVarByte(&Bs, S->V); }
+      return StreamBytes();
+    },
+    [&]() {
+      InitRead(&Bs, Bs.Stream);
+      bool Ok = true;
+      FOR_EACH (S, VarByte) { Ok &= ReadVarByte(&Bs) == S->V; }
+      return Ok;
+    }));
+
+  /* bitstream: single bits (the parity of the binomial symbols) and the bit lengths of centered minimal codes */
+  Report("bitstream Write/Read 1 bit", Binomial.size(), Measure(Binomial.size(), NReps,
+    [&]() {
+      Rewind(&Bs);
+      FOR_EACH (S, Binomial) { Write(&Bs, S->V & 1); }
+      return StreamBytes();
+    },
+    [&]() {
+      InitRead(&Bs, Bs.Stream);
+      bool Ok = true;
+      FOR_EACH (S, Binomial) { Ok &= Read(&Bs) == (S->V & 1); }
+      return Ok;
+    }));
+  Report("bitstream Write/Read n bits", Centered.size(), Measure(Centered.size(), NReps,
+    [&]() {
+      Rewind(&Bs);
+      FOR_EACH (S, Centered) { Write(&Bs, S->V, Msb(S->N) + 1); }
+      return StreamBytes();
+    },
+    [&]() {
+      InitRead(&Bs, Bs.Stream);
+      bool Ok = true;
+      FOR_EACH (S, Centered) { Ok &= Read(&Bs, Msb(S->N) + 1) == S->V; }
+      return Ok;
+    }));
+  /* runs of equal bits, with lengths from the binomial symbols */
+  Report("RepeatedWrite", Binomial.size(), Measure(Binomial.size(), NReps,
+    [&]() {
+      Rewind(&Bs);
+      FOR_EACH (S, Binomial) { RepeatedWrite(&Bs, S->V & 1, S->N); }
+      return StreamBytes();
+    }, nullptr));
+
+  /* rANS with a static table built from the histogram of the context symbols */
+  constexpr u32 ScaleBits = 16;
+  std::array<u32, ContextMax+2> Freq{}, Start{};
+  FOR_EACH (S, ContextSymbols) { ++Freq[S->V]; }
+  u64 Total = ContextSymbols.size();
+  u32 Sum = 0;
+  FOR(u32, I, 0, ContextMax+2) { // normalize to 2^ScaleBits, keeping every frequency above 0
+    Freq[I] = MAX(1u, u32(u64(Freq[I]) * ((1u << ScaleBits) - (ContextMax+2)) / (MAX(Total, u64(1)))));
+    Sum += Freq[I];
+  }
+  Freq[std::max_element(Freq.begin(), Freq.end()) - Freq.begin()] += (1u << ScaleBits) - Sum;
+  FOR(u32, I, 1, ContextMax+2) { Start[I] = Start[I-1] + Freq[I-1]; }
+  std::vector<u8> CumToSymbol(1 << ScaleBits);
+  FOR(u32, I, 0, ContextMax+2) { FOR(u32, J, Start[I], Start[I] + Freq[I]) { CumToSymbol[J] = u8(I); } }
+  std::vector<u32> RansBuf(ContextSymbols.size() * 2 + 16);
+  u32* RansPtr = nullptr;
+  Report("Rans64EncPut/Rans64DecGet", ContextSymbols.size(), Measure(ContextSymbols.size(), NReps,
+    [&]() {
+      Rans64State R;
+      Rans64EncInit(&R);
+      RansPtr = RansBuf.data() + RansBuf.size();
+      for (i64 I = i64(ContextSymbols.size()) - 1; I >= 0; --I) { // rANS encodes backwards
+        u32 V = ContextSymbols[I].V;
+        Rans64EncPut(&R, &RansPtr, Start[V], Freq[V], ScaleBits);
+      }
+      Rans64EncFlush(&R, &RansPtr);
+      return i64(RansBuf.data() + RansBuf.size() - RansPtr) * i64(sizeof(u32));
+    },
+    [&]() {
+      Rans64State R;
+      u32* Ptr = RansPtr;
+      Rans64DecInit(&R, &Ptr);
+      bool Ok = true;
+      FOR_EACH (S, ContextSymbols) {
+        u32 V = CumToSymbol[Rans64DecGet(&R, ScaleBits)];
+        Ok &= V == S->V;
+        Rans64DecAdvance(&R, &Ptr, Start[V], Freq[V], ScaleBits);
+      }
+      return Ok;
+    }));
+
+  DeallocBuf(&Coder.BitStream.Stream);
+  DeallocBuf(&Bs.Stream);
+  return 0;
+}
@@ -8,15 +8,97 @@
 #define NO_ZFP
 #define DOCTEST_CONFIG_IMPLEMENT
 #define DOCTEST_CONFIG_SUPER_FAST_ASSERTS
-#define SEXPR_IMPLEMENTATION
 #include "common.h"
 #include "zfp.h"
 #include "rans64.h"
 #include "platform.h"
 #include <algorithm>
+#include <cstdarg>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+/* Call Func(Thread, Begin, End) on NThreads equal slices of [0, N) */
+template <typename func>
+static void
+ParallelFor(i64 N, int NThreads, const func& Func) {
+  std::vector<std::thread> Threads;
+  FOR(int, T, 0, NThreads) {
+    i64 Begin = N * T / NThreads, End = N * (T+1) / NThreads;
+    Threads.emplace_back([&Func, T, Begin, End]() { Func(T, Begin, End); });
+  }
+  FOR_EACH(Thread, Threads) { Thread->join(); }
+}
+
+using index_range = std::pair<i64, i64>; // [first, last)
+
+/* Swap the K-th index of the ranges As with the K-th index of the ranges Bs (they cover as many indices),
+with the swaps split evenly among the threads. Swap(I, J) swaps the elements at I and J. */
+template <typename func>
+static void
+SwapAcrossRanges(const std::vector<index_range>& As, const std::vector<index_range>& Bs, int NThreads, const func& Swap) {
+  auto PrefixSums = [](const std::vector<index_range>& Ranges) {
+    std::vector<i64> Sums(Ranges.size() + 1, 0);
+    FOR(size_t, R, 0, Ranges.size()) { Sums[R+1] = Sums[R] + Ranges[R].second - Ranges[R].first; }
+    return Sums;
+  };
+  std::vector<i64> SumsA = PrefixSums(As), SumsB = PrefixSums(Bs);
+  REQUIRE(SumsA.back() == SumsB.back());
+  ParallelFor(SumsA.back(), NThreads, [&](int, i64 Begin, i64 End) {
+    if (Begin == End) return;
+    size_t RA = std::upper_bound(SumsA.begin(), SumsA.end(), Begin) - SumsA.begin() - 1;
+    size_t RB = std::upper_bound(SumsB.begin(), SumsB.end(), Begin) - SumsB.begin() - 1;
+    i64 IA = As[RA].first + Begin - SumsA[RA], IB = Bs[RB].first + Begin - SumsB[RB];
+    FOR(i64, K, Begin, End) {
+      while (IA == As[RA].second) IA = As[++RA].first;
+      while (IB == Bs[RB].second) IB = Bs[++RB].first;
+      Swap(IA++, IB++);
+    }
+  });
+}
+
+/* Move the indices I of [Lo, Hi) with !Right(I) in front of the ones with Right(I), in place, and return
+where the second group starts. Each thread partitions a slice, then the misplaced indices on either side
+of the split are swapped with each other. */
+template <typename pred, typename func>
+static i64
+ParallelPartition(i64 Lo, i64 Hi, int NThreads, const pred& Right, const func& Swap) {
+  std::vector<i64> Mids(NThreads);
+  ParallelFor(Hi - Lo, NThreads, [&](int T, i64 Begin, i64 End) {
+    i64 I = Lo + Begin, J = Lo + End;
+    while (true) {
+      while (I < J && !Right(I)) ++I;
+      while (I < J && Right(J-1)) --J;
+      if (I >= J) break;
+      Swap(I++, --J);
+    }
+    Mids[T] = I;
+  });
+  i64 Split = Lo;
+  FOR(int, T, 0, NThreads) { Split += Mids[T] - (Lo + (Hi-Lo)*T/NThreads); }
+  std::vector<index_range> RightsBefore, LeftsAfter; // of the split
+  FOR(int, T, 0, NThreads) {
+    i64 Begin = Lo + (Hi-Lo)*T/NThreads, End = Lo + (Hi-Lo)*(T+1)/NThreads;
+    i64 RightsEnd = (MIN(End, Split)), LeftsBegin = (MAX(Begin, Split));
+    if (Mids[T] < RightsEnd) RightsBefore.push_back({Mids[T], RightsEnd});
+    if (LeftsBegin < Mids[T]) LeftsAfter.push_back({LeftsBegin, Mids[T]});
+  }
+  SwapAcrossRanges(RightsBefore, LeftsAfter, NThreads, Swap);
+  return Split;
+}
+
+static int
+DefaultNumThreads() {
+  return MAX(int(std::thread::hardware_concurrency()), 1);
+}
 
 static bbox
 ComputeBoundingBox(const std::vector<particle>& Particles) {
+  TIME_STAGE(stage::BoundingBox);
   REQUIRE(!Particles.empty());
   bbox BBox;
   BBox.Min = BBox.Max = Particles[0].Pos;
@@ -33,6 +115,7 @@ ComputeBoundingBox(const std::vector<particle>& Particles) {
 
 static bbox_int
 ComputeBoundingBox(const std::vector<particle_int>& Particles) {
+  TIME_STAGE(stage::BoundingBox);
   REQUIRE(!Particles.empty());
   bbox_int BBox;
   BBox.Min = BBox.Max = Particles[0].Pos;
@@ -43,6 +126,26 @@ ComputeBoundingBox(const std::vector<particle_int>& Particles) {
   return BBox;
 }
 
+/* std::partition that moves the attribute rows together with the particles, so the attributes end up in
+tree order without a separate sort */
+template <typename pred_t> static i64
+PartitionParticles(std::vector<particle_int>& Particles, i64 Begin, i64 End, pred_t Pred) {
+  if (Params.NAttrs == 0)
+    return std::partition(RANGE(Particles, Begin, End), Pred) - Particles.begin();
+  int NC = Params.NAttrs;
+  i32* A = Attributes.data();
+  i64 I = Begin, J = End - 1;
+  while (true) {
+    while (I <= J &&  Pred(Particles[I])) ++I;
+    while (I <= J && !Pred(Particles[J])) --J;
+    if (I > J) break;
+    std::swap(Particles[I], Particles[J]);
+    std::swap_ranges(A + I*NC, A + (I+1)*NC, A + J*NC);
+    ++I; --J;
+  }
+  return I;
+}
+
 // First 4 bits = Level
 // Last 60 bits = block id of particle
 #define BLOCK_ID(Level, ParticleId, BlockBits) ((u64(Level) << 60) + ((ParticleId) >> ((Level) + (BlockBits))))
@@ -81,207 +184,153 @@ INLINE static i64 BOffset(i64 B) { return B & WORD_MASK; }
 //  free(BitSet);
 //}
 
+static container Dataset; // the file being decoded
+static std::vector<float_runs> FloatRuns; // [time step * 3 + axis], the "float-runs" section
+
+/* Open a dataset and read its parameters */
 static bool
-ReadMetaFile(cstr FileName) {
-  buffer Buf;
-  ReadFile(FileName, &Buf);
-  CLEANUP(0, DeallocBuf(&Buf));
-  SExprResult Result = ParseSExpr((cstr)Buf.Data, Size(Buf), nullptr);
-  if(Result.type == SE_SYNTAX_ERROR) {
-    fprintf(stderr, "Error(%d): %s.\n", Result.syntaxError.lineNumber, Result.syntaxError.message);
+OpenDataset(cstr FileName) {
+  TIME_STAGE(stage::FileRead);
+  if (!OpenContainer(&Dataset, FileName))
     return false;
-  } else { // no syntax error
-    SExpr* Data = (SExpr*)malloc(sizeof(SExpr) * Result.count);
-    CLEANUP(1, free(Data));
-    std::vector<SExpr*> Stack; Stack.reserve(Result.count);
-    // This time we supply the pool
-    SExprPool Pool = { Result.count, Data };
-    Result = ParseSExpr((cstr)Buf.Data, Size(Buf), &Pool);
-    // result.expr contains the successfully parsed SExpr
-//    printf("parse .idx file successfully\n");
-    Stack.push_back(Result.expr);
-    bool GotId = false;
-    SExpr* LastExpr = nullptr;
-    while (Stack.size() > 0) {
-      SExpr* Expr = Stack.back();
-      Stack.pop_back();
-      if (Expr->next)
-        Stack.push_back(Expr->next);
-      if (GotId) {
-        if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "version")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.Version[0] = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          REQUIRE(Expr->type == SE_INT);
-          Params.Version[1] = Expr->i;
-          printf("Version = %d.%d\n", Params.Version[0], Params.Version[1]);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "name")) {
-          REQUIRE(Expr->type == SE_STRING);
-          snprintf((str)Params.Name, Expr->s.len + 1, "%s", (cstr)Buf.Data + Expr->s.start);
-          printf("Name = %s\n", Params.Name);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "dimensions")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.NDims = Expr->i;
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "dims-string")) {
-          strncpy(Params.DimsStr, (cstr)Buf.Data + Expr->s.start, Expr->s.len);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "grid")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.Dims3.x = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          REQUIRE(Expr->type == SE_INT);
-          Params.Dims3.y = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          REQUIRE(Expr->type == SE_INT);
-          Params.Dims3.z = Expr->i;
-          printf("Dims = %d %d %d\n", EXPvec3(Params.Dims3));
-          Params.LogDims3.x = LOG2_FLOOR(Params.Dims3.x);
-          Params.LogDims3.y = LOG2_FLOOR(Params.Dims3.y);
-          Params.LogDims3.z = LOG2_FLOOR(Params.Dims3.z);
-          Params.BaseHeight = Params.LogDims3.x + Params.LogDims3.y + Params.LogDims3.z;
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "w3")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.W3.x = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          REQUIRE(Expr->type == SE_INT);
-          Params.W3.y = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          REQUIRE(Expr->type == SE_INT);
-          Params.W3.z = Expr->i;
-          printf("W3 = %d %d %d\n", EXPvec3(Params.W3));
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "accuracy")) {
-          REQUIRE(Expr->type == SE_FLOAT);
-          Params.Accuracy = Expr->f;
-          printf("Accuracy = %.8g\n", Params.Accuracy);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "refinement")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.RefinementMode = (refinement_mode)Expr->i;
-          printf("Refinement = %d\n", Params.RefinementMode);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "height")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.MaxHeight = Expr->i;
-          printf("Max height = %d\n", Params.MaxHeight);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "bounding-box")) {
-          assert(Expr->type == SE_FLOAT || Expr->type == SE_INT);
-          Params.BBoxInt.Min.x = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          assert(Expr->type == SE_FLOAT || Expr->type == SE_INT);
-          Params.BBoxInt.Min.y = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          assert(Expr->type == SE_FLOAT || Expr->type == SE_INT);
-          Params.BBoxInt.Min.z = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          assert(Expr->type == SE_FLOAT || Expr->type == SE_INT);
-          Params.BBoxInt.Max.x = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          assert(Expr->type == SE_FLOAT || Expr->type == SE_INT);
-          Params.BBoxInt.Max.y = Expr->i;
-          REQUIRE(Expr->next);
-          Expr = Expr->next;
-          assert(Expr->type == SE_FLOAT || Expr->type == SE_INT);
-          Params.BBoxInt.Max.z = Expr->i;
-          //printf("bounding-box %f %f %f %f %f %f\n", EXPvec3(Params.BBox.Min), EXPvec3(Params.BBox.Max));
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "particles")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.NParticles = Expr->i;
-          printf("particles = %lld\n", Params.NParticles);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "resolutions")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.NLevels = Expr->i;
-          printf("resolutions = %d\n", Params.NLevels);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "start-depth")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.StartResolutionSplit = Expr->i;
-          printf("start-depth = %d\n", Params.StartResolutionSplit);
-        } else if (SExprStringEqual((cstr)Buf.Data, &(LastExpr->s), "block-bits")) {
-          REQUIRE(Expr->type == SE_INT);
-          Params.BlockBits = Expr->i;
-          printf("block-bits = %d\n", Params.BlockBits);
-        }
-      }
-      if (Expr->type == SE_ID) {
-        LastExpr = Expr;
-        GotId = true;
-      } else if (Expr->type == SE_LIST) {
-        Stack.push_back(Expr->head);
-        GotId = false;
-      } else {
-        GotId = false;
-      }
+  UnpackParams(Dataset.Header.Params, &Params);
+  if (const container_section* S = FindSection(Dataset, "float-runs")) {
+    FloatRuns.resize(S->Bytes / sizeof(float_runs));
+    if (S->Bytes % sizeof(float_runs) != 0 || FloatRuns.size() < 3 || !ReadSection(Dataset, *S, FloatRuns.data()))
+      return false;
+    FOR_EACH(R, FloatRuns) {
+      if (R->NRuns < 0 || R->NRuns > FloatMaxRuns)
+        return false;
     }
+    std::copy(FloatRuns.begin(), FloatRuns.begin() + 3, Params.FloatRuns3);
+  } else if (Params.FloatBits > 0) {
+    return false;
   }
+  printf("Version = %d.%d\n", Params.Version[0], Params.Version[1]);
+  printf("Name = %s\n", Params.Name);
+  printf("particles = %lld\n", Params.NParticles);
+  printf("Dims = %d %d %d\n", EXPvec3(Params.Dims3));
+  printf("W3 = %d %d %d\n", EXPvec3(Params.W3));
+  printf("resolutions = %d\n", Params.NLevels);
+  printf("Max height = %d\n", Params.MaxHeight);
+  if (Params.NAttrs > 0)
+    printf("attributes = %d (float mask %u)\n", Params.NAttrs, Params.AttrFloatMask);
+  if (Params.FloatBits > 0)
+    printf("float positions = %d bits\n", Params.FloatBits);
+  if (Params.NTimeSteps > 0)
+    printf("Time steps = %d\n", Params.NTimeSteps);
   return true;
 }
 
+static std::vector<const container_section*> LevelSections; // [level] -> "level-<L>", nullptr if absent
+
+static const container_section*
+LevelSection(i8 Level) {
+  if (LevelSections.empty()) {
+    LevelSections.resize(Params.NLevels + 1);
+    FOR(i8, L, 0, Params.NLevels + 1) { LevelSections[L] = FindSection(Dataset, PRINT("level-%d", L)); }
+  }
+  return LevelSections[Level];
+}
 
 static bool
 ReadResBlock() {
-  FILE* Fp = fopen(PRINT("%s-%d.bin", Params.Name, Params.NLevels), "rb");
-  FSEEK(Fp, 0, SEEK_END);
-  auto Size = FTELL(Fp);
-  FSEEK(Fp, 0, SEEK_SET);
-  GrowToAccomodate(&BlockStreams[Params.NLevels], Size);
-  fread(BlockStreams[Params.NLevels].Stream.Data, Size, 1, Fp);
-  fclose(Fp);
+  TIME_STAGE(stage::FileRead);
+  const container_section* S = LevelSection(Params.NLevels);
+  if (!S)
+    return false;
+  bitstream& Bs = BlockStreams[Params.NLevels];
+  GrowToAccomodate(&Bs, S->Bytes);
+  REQUIRE(ReadSection(Dataset, *S, Bs.Stream.Data));
   return true;
 }
 
 static i64 BlockBytesRead = 0;
 
+/* Descriptor to read the blocks of a level from, -1 if the dataset has none */
+static int
+BlockFile(i8 Level) { return LevelSection(Level) ? Dataset.Fd : -1; }
+
+/* Read the block index at the end of the level's section (see WriteBlockIndex), if not done so. The
+index is stored sorted, so it is ready to search once parsed, and the tail read to find the trailer
+usually holds the whole index too. */
+static bool
+LoadBlockIndex(i8 Level) {
+  if ((int)BlockIndex.size() <= Level)
+    BlockIndex.resize(Params.NLevels + 1);
+  block_index& Index = BlockIndex[Level];
+  if (Index.Loaded)
+    return true;
+  const container_section* S = LevelSection(Level);
+  if (!S || S->Bytes < BlockIndexTrailer)
+    return false;
+  i64 Tail = MIN(S->Bytes, i64(1) << 16);
+  std::vector<byte> Buf(Tail + sizeof(u64), 0); // a word of slack for the bit reader
+  if (ReadAt(Dataset.Fd, Buf.data(), Tail, S->Offset + S->Bytes - Tail) != Tail)
+    return false;
+  u64 NBlocks = 0, IndexBytes = 0;
+  memcpy(&NBlocks, &Buf[Tail - BlockIndexTrailer], sizeof(NBlocks));
+  memcpy(&IndexBytes, &Buf[Tail - BlockIndexTrailer + sizeof(NBlocks)], sizeof(IndexBytes));
+  i64 Need = (i64)IndexBytes + BlockIndexTrailer;
+  if (Need > S->Bytes)
+    return false;
+  const byte* Data = Buf.data() + Tail - Need;
+  if (Need > Tail) { // a big index, read the rest of it
+    Buf.assign(IndexBytes + sizeof(u64), 0);
+    if (ReadAt(Dataset.Fd, Buf.data(), IndexBytes, S->Offset + S->Bytes - Need) != (i64)IndexBytes)
+      return false;
+    Data = Buf.data();
+  }
+  ParseBlockIndex(Data, (i64)IndexBytes, NBlocks, &Index);
+  FOR_EACH(O, Index.Offsets) { *O += S->Offset; } // from the start of the file
+  return true;
+}
+
+/* Byte range of a block in the dataset file, false if the block was not written */
+static bool
+FindBlockRange(i8 Level, u64 BlockId, i64* Offset, i64* NBytes) {
+  if (!LoadBlockIndex(Level))
+    return false;
+  const block_index& Index = BlockIndex[Level];
+  auto It = std::lower_bound(Index.Ids.begin(), Index.Ids.end(), BlockId);
+  if (It == Index.Ids.end() || *It != BlockId)
+    return false;
+  size_t I = It - Index.Ids.begin();
+  *Offset = Index.Offsets[I];
+  *NBytes = Index.Sizes[I];
+  return true;
+}
+
+INLINE static bitstream&
+BlockStreamAt(i8 Level, u8 Height) {
+  return (Height <= Params.BaseHeight) ? BlockStreams[Level] : RefBlockStreams[Height - Params.BaseHeight - 1];
+}
+
+/* Read exactly the bytes of one block (pread on the level's persistent descriptor) into the stream of
+its level / height */
 static bool
 ReadBlock(i8 Level, u64 BlockId, u8 Height) {
+  TIME_STAGE(stage::FileRead);
   REQUIRE(Level < Params.NLevels);
 //  printf("--------- reading level %d block %llu height %d\n", Level, BlockId, Height);
 
-  FILE* Fp = nullptr;
-  /* read the block offsets if not done so */
-  if (BlockOffsets[Level].empty()) {
-    // read the block bytes
-    Fp = fopen(PRINT("%s-%d.bin", Params.Name, Level), "rb");
-    if (!Fp)
-      return false;
-    FSEEK(Fp, 0, SEEK_END);
-    ReadBackwardPOD(Fp, &MaxBlockSize);
-    u64 NBlocks = 0;
-    ReadBackwardPOD(Fp, &NBlocks);
-    REQUIRE(BlockId < NBlocks);
-    BlockOffsets[Level].resize(NBlocks);
-    buffer Buf((byte*)BlockOffsets[Level].data(), (i64)sizeof(block_meta) * NBlocks);
-    ReadBackwardBuffer(Fp, &Buf);
-    BlockBytes[Level] = BlockOffsets[Level];
-    u64 S = 0;
-    FOR(u64, I, 0, NBlocks) {
-      u64 Temp = BlockOffsets[Level][I].Size;
-      BlockOffsets[Level][I].Size = S;
-      S += Temp;
-    }
-    std::sort(BlockOffsets[Level].begin(), BlockOffsets[Level].end());
-    std::sort(BlockBytes[Level].begin(), BlockBytes[Level].end());
-  }
-  auto It = std::lower_bound(BlockOffsets[Level].begin(), BlockOffsets[Level].end(), block_meta{.Size = 0, .BlockId = BlockId});
-  if (It == BlockOffsets[Level].end() || It->BlockId != BlockId) {
+  i64 Offset = 0, NBytes = 0;
+  if (!FindBlockRange(Level, BlockId, &Offset, &NBytes)) {
     printf("    NOT FOUND !!!!\n");
     return false;
   }
-
-  if (!Fp) 
-    Fp = fopen(PRINT("%s-%d.bin", Params.Name, Level), "rb");
-  FSEEK(Fp, It->Size, SEEK_SET);
-  bitstream& Bs = (Height <= Params.BaseHeight) ? BlockStreams[Level] : RefBlockStreams[Height - Params.BaseHeight - 1];
-  Rewind(&Bs);
-  GrowToAccomodate(&Bs, MaxBlockSize);
-  It = std::lower_bound(BlockBytes[Level].begin(), BlockBytes[Level].end(), block_meta{.Size = 0, .BlockId = BlockId});
-  BlockBytesRead += It->Size;
-  fread(Bs.Stream.Data, MaxBlockSize, 1, Fp);
-  fclose(Fp);
+  int Fd = BlockFile(Level);
+  if (Fd < 0)
+    return false;
+  bitstream* Bs = &BlockStreamAt(Level, Height);
+  Rewind(Bs);
+  GrowToAccomodate(Bs, NBytes);
+  if (ReadAt(Fd, Bs->Stream.Data, NBytes, Offset) != NBytes)
+    return false;
+  // the reader refills a whole word at a time, so clear what lies past the block
+  memset(Bs->Stream.Data + NBytes, 0, sizeof(Bs->BitBuf));
+  Bs->BitPtr = Bs->Stream.Data + NBytes; // as if just written: Size(*Bs) is the block size
+  BlockBytesRead += NBytes;
 
   return true;
 }
@@ -301,18 +350,26 @@ DecodeNode(bitstream* Bs, i64 M) {
 static void
 DecodeResBlock(bitstream* Bs, block* Block) {
   int NNodes = Params.NLevels * 2 - 1;
-  Block->Nodes.resize(NNodes);
+  std::vector<i64> Nodes(NNodes, 0);
   InitRead(Bs, Bs->Stream);
   // TODO: use binomial coding
-  Block->Nodes[0] = ReadVarByte(Bs);
+  Nodes[0] = ReadVarByte(Bs);
   for (int I = 2; I < NNodes; I += 2) {
-    i64 M = Block->Nodes[RES_PARENT(I)];
-    Block->Nodes[I    ] = DecodeNode(Bs, M);
-    Block->Nodes[I - 1] = M - Block->Nodes[I];
+    i64 M = Nodes[RES_PARENT(I)];
+    Nodes[I    ] = DecodeNode(Bs, M);
+    Nodes[I - 1] = M - Nodes[I];
     Block->NParticles += (int)M;
-//    printf("%lld %lld\n", Block->Nodes[I], Block->Nodes[I - 1]);
+//    printf("%lld %lld\n", Nodes[I], Nodes[I - 1]);
     assert(RES_PARENT(I) == RES_PARENT(I - 1));
   }
+  Block->Pack(Nodes.data(), NNodes);
+}
+
+/* The entry of a block in its level table, inserted if it is not there yet */
+INLINE static block&
+BlockEntry(std::unordered_map<u64, block>& LvlBlocks, u64 BlockIdx) {
+  auto It = LvlBlocks.find(BlockIdx);
+  return It != LvlBlocks.end() ? It->second : LvlBlocks[BlockIdx];
 }
 
 // TODO: and from tree depth to bounding box
@@ -320,12 +377,9 @@ static void
 DecodeRefBlock(bitstream* Bs, i8 Level, u64 BlockIdx, block_table* AllBlocks) {
   //InitRead(Bs, Bs->Stream);
   REQUIRE(AllBlocks->size() > Level);
-  auto& Blocks = (*AllBlocks)[Level];
-  if (Blocks.size() <= BlockIdx) {
-    Blocks.resize(BlockIdx * 3 / 2 + 1);
-  }
-  Blocks[BlockIdx] = block(Bs);
-//  const block& CurrBlock = Blocks[BlockIdx];
+  block& Block = BlockEntry((*AllBlocks)[Level], BlockIdx);
+  Block = block();
+  Block.SetBits(*Bs);
 //  i64 NumBlocksAtLeaf = NUM_BLOCKS_AT_LEAF(Level);
 //  u64 ParentBlockIdx = BlockIdx - NumBlocksAtLeaf;
 //  const auto& ParentBlock = (*AllBlocks)[Level][ParentBlockIdx];
@@ -345,37 +399,40 @@ DecodeRefBlock(bitstream* Bs, i8 Level, u64 BlockIdx, block_table* AllBlocks) {
 
 static void
 DecodeBlock(bitstream* Bs, i8 Level, u64 BlockIdx, block_table* AllBlocks) {
-  const block& ResBlock = (*AllBlocks)[Params.NLevels][0];
+  const block& ResBlock = (*AllBlocks)[Params.NLevels].find(0)->second;
   InitRead(Bs, Bs->Stream);
   REQUIRE(AllBlocks->size() > Level);
   auto& Blocks = (*AllBlocks)[Level];
-  if (Blocks.size() <= BlockIdx) {
-    Blocks.resize(BlockIdx * 3 / 2 + 1);
-  }
-  block& Block = (*AllBlocks)[Level][BlockIdx];
+  thread_local std::vector<i64> Nodes; // the whole block, packed once decoded
   i64 NNodes = 1ll << Params.BlockBits;
-  Block.Nodes.resize(NNodes, 0);
+  Nodes.assign(NNodes, 0);
   u64 FirstNodeIdx = MAX(BlockIdx << Params.BlockBits, 2); // NOTE: node index always starts at 2
   u64 LastNodeIdx = (BlockIdx + 1) << Params.BlockBits;
   if (BlockIdx == 0) { // the parent block is the res block
     REQUIRE(Level < Params.NLevels);
-    Block.Nodes[1] = ResBlock.Nodes[LEVEL_TO_NODE(Level)];
+    Nodes[1] = ResBlock.Node(LEVEL_TO_NODE(Level));
+  }
+  const block* Parent = nullptr; // parents outside this block all lie in the same block
+  if (BlockIdx > 0) {
+    auto It = Blocks.find(NODE_TO_BLOCK_INDEX(FirstNodeIdx / 2));
+    Parent = It != Blocks.end() ? &It->second : nullptr;
   }
   for (u64 K = FirstNodeIdx; K < LastNodeIdx; K += 2) {
     u64 I = NODE_INDEX_IN_BLOCK(K);
     u64 J = K / 2; // (global) parent index
-    i64 M = Blocks[NODE_TO_BLOCK_INDEX(J)].Nodes[NODE_INDEX_IN_BLOCK(J)];
+    i64 M = NODE_TO_BLOCK_INDEX(J) == BlockIdx ? Nodes[NODE_INDEX_IN_BLOCK(J)]
+                                               : (Parent ? Parent->Node(NODE_INDEX_IN_BLOCK(J)) : 0);
     if (M > 0) {
-      Block.Nodes[I    ] = DecodeNode(Bs, M); // left child
-      Block.Nodes[I + 1] = M - Block.Nodes[I]; // right child
-      assert(Block.Nodes[I] >= 0 && Block.Nodes[I] <= Params.NParticles);
-      assert(Block.Nodes[I + 1] >= 0 && Block.Nodes[I + 1] <= Params.NParticles);
-//      printf("%lld %lld\n", Block.Nodes[I], Block.Nodes[I+1]);
+      Nodes[I    ] = DecodeNode(Bs, M); // left child
+      Nodes[I + 1] = M - Nodes[I]; // right child
+      assert(Nodes[I] >= 0 && Nodes[I] <= Params.NParticles);
+      assert(Nodes[I + 1] >= 0 && Nodes[I + 1] <= Params.NParticles);
+//      printf("%lld %lld\n", Nodes[I], Nodes[I+1]);
     }
   }
+  BlockEntry(Blocks, BlockIdx).Pack(Nodes.data(), NNodes);
 }
 
-
 struct block_data {
   i8 Level = 0;
   u8 Height = 0;
@@ -532,42 +589,20 @@ static DynamicHeap<tree_node, tree_node_priority> NodeHeap;
 //}
 
 
-/* Read the next most important block and add its two children (if existed) to the heap
- * Return false if there is no more block to load */
-static bool
-RefineByError() {
-  block_data     TopBlock;
-  block_priority TopPriority;
-  bool BlockExists = false;
-  while (!BlockExists) {
-    if (Heap.empty()) break;
-    Heap.top(TopBlock, TopPriority);
-    Heap.pop();
-    if (TopBlock.Level == Params.NLevels)
-      BlockExists = ReadResBlock();
-    else
-      BlockExists = ReadBlock(TopBlock.Level, TopBlock.BlockId, TopBlock.Height);
-  }
-  if (!BlockExists)
-    return false;
-
-  if (TopBlock.Level == Params.NLevels)
-    DecodeResBlock(&BlockStreams[TopBlock.Level], &Blocks[TopBlock.Level][0]);
-  else if (TopBlock.Height <= Params.BaseHeight)
-    DecodeBlock(&BlockStreams[TopBlock.Level], TopBlock.Level, TopBlock.BlockId, &Blocks);
-  else
-    DecodeRefBlock(&RefBlockStreams[TopBlock.Height - Params.BaseHeight - 1], TopBlock.Level, TopBlock.BlockId, &Blocks);
+/* Push the children of a decoded block, with their estimated errors */
+static void
+EnqueueChildrenByError(const block_data& TopBlock, const block_priority& TopPriority) {
 //  REQUIRE(LvlBlocks[TopBlock.Level].size() > TopBlock.BlockId);
   block_data LeftChild, RightChild;
   float LeftError = 0, RightError = 0;
   float LeftVol = 0, RightVol = 0;
   i64 LeftN = 0, RightN = 0;
-  auto& Nodes = Blocks[TopBlock.Level][TopBlock.BlockId].Nodes;
+  const block& Block = Blocks[TopBlock.Level].at(TopBlock.BlockId);
   if (TopBlock.Level == Params.NLevels) { // resolution block
     int NNodes = Params.NLevels * 2 - 1;
-    REQUIRE(NNodes == Nodes.size());
+    REQUIRE(Block.End() <= u64(NNodes));
     FOR(int, NodeIdx, 0, NNodes) {
-      if (Nodes[NodeIdx] == 0) continue;
+      if (Block.Node(NodeIdx) == 0) continue;
       if (NodeIdx + 1 != NNodes && IS_EVEN(NodeIdx))
         continue;
       i8 Level = (2 * (Params.NLevels - 1) - (NodeIdx - 1)) / 2;
@@ -578,7 +613,7 @@ RefineByError() {
         .BlockId = 0
       };
       if (LeftChild.Height <= Params.MaxHeight) {
-        LeftError = NodeVolume(LEVEL_TO_HEIGHT(Level)) / Nodes[NodeIdx];
+        LeftError = NodeVolume(LEVEL_TO_HEIGHT(Level)) / Block.Node(NodeIdx);
         Heap.insert(LeftChild, block_priority{.Level = Level, .BlockId = 0, .Error = LeftError});
       }
     }
@@ -595,17 +630,17 @@ RefineByError() {
     };
     int H = TopBlock.BlockId == 0 ? TopBlock.Height + Params.BlockBits - 1 : TopBlock.Height;
     float Vol = NodeVolume(H);
-    FOR(int, NodeIdx, 0, (int)Nodes.size()) {
-      if (Nodes[NodeIdx] == 0) continue;
+    FOR(u64, NodeIdx, Block.Begin(), Block.End()) {
+      if (Block.Node(NodeIdx) == 0) continue;
       u64 GlobalNodeIdx = TopBlock.BlockId * POW2(Params.BlockBits) + NodeIdx;
       u64 ChildrenBlockIdx = NODE_TO_BLOCK_INDEX(GlobalNodeIdx * 2);
       if (ChildrenBlockIdx == TopBlock.BlockId) continue;
       assert(ChildrenBlockIdx == LeftChild.BlockId || ChildrenBlockIdx == RightChild.BlockId);
       if (ChildrenBlockIdx == LeftChild.BlockId) {
-        LeftN += Nodes[NodeIdx];
+        LeftN += Block.Node(NodeIdx);
         LeftVol += Vol;
       } else {
-        RightN += Nodes[NodeIdx];
+        RightN += Block.Node(NodeIdx);
         RightVol += Vol;
       }
     }
@@ -627,6 +662,35 @@ RefineByError() {
       Heap.insert(LeftChild, block_priority{.Level = LeftChild.Level, .BlockId = LeftChild.BlockId, .Error = LeftError});
     }
   }
+}
+
+/* Read the next most important block and add its two children (if existed) to the heap
+ * Return false if there is no more block to load */
+static bool
+RefineByError() {
+  block_data     TopBlock;
+  block_priority TopPriority;
+  bool BlockExists = false;
+  while (!BlockExists) {
+    if (Heap.empty()) break;
+    Heap.top(TopBlock, TopPriority);
+    Heap.pop();
+    TRACE_SCOPE("fetch block", "block", i64(TopBlock.BlockId));
+    if (TopBlock.Level == Params.NLevels)
+      BlockExists = ReadResBlock();
+    else
+      BlockExists = ReadBlock(TopBlock.Level, TopBlock.BlockId, TopBlock.Height);
+  }
+  if (!BlockExists)
+    return false;
+
+  if (TopBlock.Level == Params.NLevels)
+    DecodeResBlock(&BlockStreams[TopBlock.Level], &Blocks[TopBlock.Level][0]);
+  else if (TopBlock.Height <= Params.BaseHeight)
+    DecodeBlock(&BlockStreams[TopBlock.Level], TopBlock.Level, TopBlock.BlockId, &Blocks);
+  else
+    DecodeRefBlock(&RefBlockStreams[TopBlock.Height - Params.BaseHeight - 1], TopBlock.Level, TopBlock.BlockId, &Blocks);
+  EnqueueChildrenByError(TopBlock, TopPriority);
   return true;
 }
 
@@ -644,6 +708,7 @@ RefineByLevel() {
     if (Heap.empty()) break;
     Heap.top(TopBlock, TopPriority);
     Heap.pop();
+    TRACE_SCOPE("fetch block", "block", i64(TopBlock.BlockId));
     if (TopBlock.Level == Params.NLevels)
       BlockExists = ReadResBlock();
     else
@@ -664,12 +729,12 @@ RefineByLevel() {
   /* enqueue children blocks */
   block_data LeftChild, RightChild;
   float LeftError = 0, RightError = 0;
-  auto& Nodes = Blocks[TopBlock.Level][TopBlock.BlockId].Nodes;
+  const block& Block = Blocks[TopBlock.Level].at(TopBlock.BlockId);
   if (TopBlock.Level == Params.NLevels) { // resolution block, one child for each non-even node
     int NNodes = Params.NLevels * 2 - 1;
-    REQUIRE(NNodes == Nodes.size());
+    REQUIRE(Block.End() <= u64(NNodes));
     FOR(int, NodeIdx, 0, NNodes) {
-      if (Nodes[NodeIdx] == 0) continue;
+      if (Block.Node(NodeIdx) == 0) continue;
       if (NodeIdx + 1 != NNodes && IS_EVEN(NodeIdx))
         continue;
       i8 Level = (2 * (Params.NLevels - 1) - (NodeIdx - 1)) / 2;
@@ -695,8 +760,8 @@ RefineByLevel() {
       .Height  = TopBlock.BlockId == 0 ? u8(TopBlock.Height + Params.BlockBits) : u8(TopBlock.Height + 1),
       .BlockId = TopBlock.BlockId * 2 + 1
     };
-    FOR(int, NodeIdx, 0, (int)Nodes.size()) {
-      if (Nodes[NodeIdx] == 0) continue;
+    FOR(u64, NodeIdx, Block.Begin(), Block.End()) {
+      if (Block.Node(NodeIdx) == 0) continue;
       u64 GlobalNodeIdx = TopBlock.BlockId * POW2(Params.BlockBits) + NodeIdx;
       u64 ChildrenBlockIdx = NODE_TO_BLOCK_INDEX(GlobalNodeIdx * 2);
       if (ChildrenBlockIdx == TopBlock.BlockId) continue; // NOTE: to avoid parent block 0 and child block 0
@@ -793,10 +858,12 @@ GetNode(const tree_node& Node, i64* N) {
   //  printf("---------------something is wrong!!!!!!\n");
   REQUIRE(Node.Height <= Params.BaseHeight);
   u64 BlockId = NODE_TO_BLOCK_INDEX(Node.NodeId);
-  if (Blocks.size() <= Node.Level || Blocks[Node.Level].size() <= BlockId || Blocks[Node.Level][BlockId].Nodes.empty())
+  if (Blocks.size() <= size_t(Node.Level))
+    return false;
+  auto It = Blocks[Node.Level].find(BlockId);
+  if (It == Blocks[Node.Level].end())
     return false;
-  const block& Block = Blocks[Node.Level][BlockId];
-  *N = Block.Nodes[NODE_INDEX_IN_BLOCK(Node.NodeId)];
+  *N = It->second.Node(NODE_INDEX_IN_BLOCK(Node.NodeId));
   return true;
 }
 
@@ -804,10 +871,12 @@ INLINE static bool
 GetRefNode(const tree_node& Node, u8* Bit) {
   REQUIRE(Node.Height > Params.BaseHeight);
   u64 BlockId = NODE_TO_BLOCK_INDEX(Node.NodeId);
-  if (Blocks.size() <= Node.Level || Blocks[Node.Level].size() <= BlockId || Size(Blocks[Node.Level][BlockId].Bs.Stream) == 0)
+  if (Blocks.size() <= size_t(Node.Level))
     return false;
-  block& Block = Blocks[Node.Level][BlockId];
-  *Bit = (u8)Read(&Block.Bs);
+  auto It = Blocks[Node.Level].find(BlockId);
+  if (It == Blocks[Node.Level].end() || It->second.Bits.empty())
+    return false;
+  *Bit = (u8)Read(&It->second.Bs);
   return true;
 }
 
@@ -898,6 +967,7 @@ GenerateParticles(const tree_node& Node) {
 /* Write each level to a different file */
 static void
 FlushBlocksToFiles() {
+  TIME_STAGE(stage::FileWrite);
   printf("--------- flushing blocks\n");
   /* write the resolution tree */
   FILE* Fp = fopen(PRINT("%s-%d.bin", Params.OutFile, Params.NLevels), "wb");
@@ -917,21 +987,22 @@ FlushBlocksToFiles() {
           WriteBlock(&RefBlockStreams[H], L, CurrRefBlocks[H].BlockId + (H + 1) * NBlocksAtLeaf);
       }
     }
-    // write an index consisting of all blocks in the file
-    // TODO: compress the index?
-    // TODO: if too many blocks have 0 bytes, maybe we can write a sparse index
+    // write an index of all blocks in the file (no padding: the decoder reads exact block ranges)
     FILE* Fp = fopen(PRINT("%s-%d.bin", Params.OutFile, L), "ab");
-    Padding.resize(MaxBlockSize);
-    fwrite(Padding.data(), Padding.size(), 1, Fp);
-    u64 NBlocks = BlockBytes[L].size();
-    fwrite(BlockBytes[L].data(), sizeof(block_meta) * NBlocks, 1, Fp);
-    fwrite(&NBlocks, sizeof(NBlocks), 1, Fp);
-    fwrite(&MaxBlockSize, sizeof(MaxBlockSize), 1, Fp);
+    WriteBlockIndex(Fp, BlockBytes[L]);
     printf("max block size = %d\n", MaxBlockSize);
     fclose(Fp);
   }
-  /* write the meta-data file */
-  WriteMetaFile(Params, PRINT("%s.idx", Params.OutFile));
+  /* move the level files into the dataset, after the parameters are final */
+  container_writer Out;
+  REQUIRE(BeginContainer(&Out, PRINT("%s.mrt", Params.OutFile)));
+  FOR(i8, L, 0, Params.NLevels + 1) {
+    char Section[16], FileName[512];
+    snprintf(Section, sizeof(Section), "level-%d", L);
+    snprintf(FileName, sizeof(FileName), "%s-%d.bin", Params.OutFile, L);
+    REQUIRE(WriteSectionFromFile(&Out, Section, FileName));
+  }
+  REQUIRE(EndContainer(&Out, Params));
 }
 
 //bitstream* Bs = Height <= Params.BaseHeight ? &BlockStreams[Level] : &RefBlockStreams[Height - Params.BaseHeight - 1].Bs;
@@ -1158,6 +1229,13 @@ ComputeGrid(vec3i BBoxExt3, str DimsStr)
   }
 }
 
+/* Whether all particles in [Begin, End) are at the same position (a leaf cell with --multiplicity) */
+static bool
+SamePosition(const std::vector<particle_int>& Particles, i64 Begin, i64 End) {
+  FOR(i64, I, Begin+1, End) { if (Particles[I].Pos != Particles[Begin].Pos) return false; }
+  return true;
+}
+
 static vec3i
 ComputeGrid(
   std::vector<particle_int>* Particles, const bbox_int& BBox, 
@@ -1174,14 +1252,14 @@ ComputeGrid(
   assert((BBoxExt3[D]&1) == 0);
   i32 Middle = (BBox.Min[D]+BBox.Max[D]) >> 1;
   auto Pred = [D, Middle](const particle_int& P) { return P.Pos[D] <= Middle; };
-  i64 Mid = std::partition(RANGE(*Particles, Begin, End), Pred) - Particles->begin();
+  i64 Mid = PartitionParticles(*Particles, Begin, End, Pred);
   vec3i LogDims3Left  = MCOPY(vec3i(0), [D]=1);
   vec3i LogDims3Right = MCOPY(vec3i(0), [D]=1);
-  if (Begin+1 < Mid) {
+  if (Begin+1 < Mid && !(Params.Multiplicity && SamePosition(*Particles, Begin, Mid))) {
     LogDims3Left = ComputeGrid(Particles, MCOPY(BBox, .Max[D]=Middle), Begin, Mid, Depth+1, DimsStr);
     ++LogDims3Left[D];
   }
-  if (Mid+1 < End) {
+  if (Mid+1 < End && !(Params.Multiplicity && SamePosition(*Particles, Mid, End))) {
     LogDims3Right = ComputeGrid(Particles, MCOPY(BBox, .Min[D]=Middle+1), Mid, End, Depth+1, DimsStr);
     ++LogDims3Right[D];
   }
@@ -1267,82 +1345,114 @@ Handler(const doctest::AssertData& ad) {
 
 #define EXIT_ERROR(Msg) { fprintf(stderr, Msg); exit(1); }
 
-#include "kdtree.h"
+INLINE u64
+HashPosition(const vec3i& P, u64 Seed) {
+  return Mix64(Mix64(Mix64(Seed ^ u32(P.x)) ^ u32(P.y)) ^ u32(P.z));
+}
+
+INLINE bool
+LessZYX(const vec3i& A, const vec3i& B) {
+  return A.z != B.z ? A.z < B.z : A.y != B.y ? A.y < B.y : A.x < B.x;
+}
 
+/* An order-independent hash of a multiset of positions: the sums (mod 2^64) of two differently seeded
+hashes of each position. Permuting the particles does not change it, and a repeated position counts
+as many times as it occurs. */
+struct multiset_hash {
+  i64 Count = 0;
+  u64 Sum1 = 0, Sum2 = 0;
+  bool operator==(const multiset_hash& Other) const {
+    return Count == Other.Count && Sum1 == Other.Sum1 && Sum2 == Other.Sum2;
+  }
+};
 
-static bool
-CheckSame( 
-  std::vector<particle_int>& Particles1, std::vector<particle_int>& Particles2)
-{
-  if (Particles2.size() != Particles1.size())
-    return false;
-  std::sort(Particles1.begin(), Particles1.end(), [](const auto& P1, const auto& P2) {
-    return Pack3i64(P1.Pos) < Pack3i64(P2.Pos);
-  });
-  std::sort(Particles2.begin(), Particles2.end(), [](const auto& P1, const auto& P2) {
-    return Pack3i64(P1.Pos) < Pack3i64(P2.Pos);
+static multiset_hash
+HashPositions(const std::vector<particle_int>& Particles, int NThreads) {
+  std::vector<multiset_hash> Partial(NThreads);
+  ParallelFor(i64(Particles.size()), NThreads, [&](int T, i64 Begin, i64 End) {
+    multiset_hash H;
+    FOR(i64, I, Begin, End) {
+      H.Sum1 += HashPosition(Particles[I].Pos, 0x243f6a8885a308d3ull);
+      H.Sum2 += HashPosition(Particles[I].Pos, 0x13198a2e03707344ull);
+    }
+    H.Count = End - Begin;
+    Partial[T] = H;
   });
-  for (size_t I = 0; I < Particles1.size(); ++I) {
-    vec3i Diff = Particles1[I].Pos - Particles2[I].Pos;
-    if (Diff.x!=0 || Diff.y!=0 || Diff.z!=0)
-      return false;
+  multiset_hash Hash;
+  FOR_EACH(H, Partial) {
+    Hash.Count += H->Count;
+    Hash.Sum1 += H->Sum1;
+    Hash.Sum2 += H->Sum2;
   }
-  return true;
+  return Hash;
 }
 
-static f32
-Error3( 
-  const std::vector<particle_int>& Particles1, const std::vector<particle_int>& Particles2, const vec3i& Dims3)
-{
-  printf("error3\n");
-  std::vector<point<int, 3>> Pos(Particles1.size());
-  FOR(i64, I, 0, Particles1.size()) {
-    Pos[I].coords_[0] = Particles1[I].Pos[0];
-    Pos[I].coords_[1] = Particles1[I].Pos[1];
-    Pos[I].coords_[2] = Particles1[I].Pos[2];
-  }
-  kdtree<int, 3> Tree(Pos.begin(), Pos.end());
-  f64 Err = 0;
-  FOR_EACH(P, Particles2) {
-    point<int, 3> Point;
-    Point.coords_[0] = P->Pos.x;
-    Point.coords_[1] = P->Pos.y;
-    Point.coords_[2] = P->Pos.z;
-    auto Nearest = Tree.nearest(Point);
-    vec3i Q(Nearest.coords_[0], Nearest.coords_[1], Nearest.coords_[2]);
-    vec3i Diff = Q - P->Pos;
-    Err += Diff.x * Diff.x + Diff.y * Diff.y + Diff.z * Diff.z;
-  }
-  int NDims = Dims3.z == 1 ? 2 : 3;
-  Err = std::sqrt(Err / (NDims * Particles2.size()));
-  return Err;
-}
-
-static f32
-Error3( 
-  const std::vector<particle>& Particles1, const std::vector<particle>& Particles2, const vec3i& Dims3)
+/* Sort the particles by (z, y, x) with an LSD radix sort of 8-bit digits. Each pass counts the digits
+of every thread's slice, then the threads scatter their slices to disjoint (stable) ranges. Passes in
+which all particles share the digit are skipped, so small coordinate ranges take few passes. */
+static void
+RadixSortParticles(std::vector<particle_int>* Particles, int NThreads) {
+  i64 N = Particles->size();
+  std::vector<particle_int> Temp(N);
+  std::vector<particle_int>* In = Particles, *Out = &Temp;
+  std::vector<std::array<i64, 256>> Counts(NThreads);
+  auto Digit = [](const particle_int& P, int Pass) {
+    u32 Coord = u32(P.Pos[Pass / 4]) ^ 0x80000000u; // order the signed coordinates
+    return (Coord >> (8 * (Pass % 4))) & 0xFF;
+  };
+  FOR(int, Pass, 0, 12) {
+    ParallelFor(N, NThreads, [&](int T, i64 Begin, i64 End) {
+      Counts[T].fill(0);
+      FOR(i64, I, Begin, End) { ++Counts[T][Digit((*In)[I], Pass)]; }
+    });
+    bool Trivial = false;
+    FOR(int, B, 0, 256) {
+      i64 Total = 0;
+      FOR(int, T, 0, NThreads) { Total += Counts[T][B]; }
+      if (Total == N) Trivial = true;
+    }
+    if (Trivial) continue;
+    i64 Offset = 0;
+    FOR(int, B, 0, 256) {
+      FOR(int, T, 0, NThreads) {
+        i64 C = Counts[T][B];
+        Counts[T][B] = Offset;
+        Offset += C;
+      }
+    }
+    ParallelFor(N, NThreads, [&](int T, i64 Begin, i64 End) {
+      FOR(i64, I, Begin, End) { (*Out)[Counts[T][Digit((*In)[I], Pass)]++] = (*In)[I]; }
+    });
+    std::swap(In, Out);
+  }
+  if (In != Particles)
+    *Particles = std::move(*In);
+}
+
+/* Sort both sets and print the positions only one of them has (as many times as the difference in
+multiplicity), up to MaxPrint of each */
+static void
+PrintPositionDiff(
+  std::vector<particle_int>& Particles1, std::vector<particle_int>& Particles2, int NThreads, int MaxPrint)
 {
-  std::vector<point<float, 3>> Pos(Particles1.size());
-  FOR(i64, I, 0, Particles1.size()) {
-    Pos[I].coords_[0] = Particles1[I].Pos[0];
-    Pos[I].coords_[1] = Particles1[I].Pos[1];
-    Pos[I].coords_[2] = Particles1[I].Pos[2];
-  }
-  kdtree<float, 3> Tree(Pos.begin(), Pos.end());
-  float Err = 0;
-  FOR_EACH(P, Particles2) {
-    point<float, 3> Point;
-    Point.coords_[0] = P->Pos.x;
-    Point.coords_[1] = P->Pos.y;
-    Point.coords_[2] = P->Pos.z;
-    auto Nearest = Tree.nearest(Point);
-    vec3f Q(Nearest.coords_[0], Nearest.coords_[1], Nearest.coords_[2]);
-    vec3f Diff = Q - P->Pos;
-    Err += Diff.x * Diff.x + Diff.y * Diff.y + Diff.z * Diff.z;
-  }
-  int NDims = Dims3.z == 1 ? 2 : 3;
-  Err = std::sqrt(Err / (NDims * Particles2.size()));
-  return Err;
+  RadixSortParticles(&Particles1, NThreads);
+  RadixSortParticles(&Particles2, NThreads);
+  i64 I1 = 0, I2 = 0, NOnly1 = 0, NOnly2 = 0;
+  i64 N1 = Particles1.size(), N2 = Particles2.size();
+  while (I1 < N1 || I2 < N2) {
+    if (I2 == N2 || (I1 < N1 && LessZYX(Particles1[I1].Pos, Particles2[I2].Pos))) {
+      if (NOnly1++ < MaxPrint)
+        printf("  only in --in:  " PRIvec3i "\n", EXPvec3(Particles1[I1].Pos));
+      ++I1;
+    } else if (I1 == N1 || LessZYX(Particles2[I2].Pos, Particles1[I1].Pos)) {
+      if (NOnly2++ < MaxPrint)
+        printf("  only in --out: " PRIvec3i "\n", EXPvec3(Particles2[I2].Pos));
+      ++I2;
+    } else {
+      ++I1; ++I2;
+    }
+  }
+  printf("%lld positions only in --in, %lld only in --out\n", NOnly1, NOnly2);
 }
 
 //static f32
@@ -1413,69 +1523,6 @@ Error3(
 //  Err = std::sqrt(Err / (NDims * Particles2.size()));
 //  return Err;
 //}
-/* NOTE: Particles2 should be the reference */
-static f32
-Error(
-  const bbox& BBox, 
-  const std::vector<particle>& Particles1, const std::vector<particle>& Particles2, const vec3i& Dims3)
-{
-  //bbox BBox = ComputeBoundingBox(Particles1);
-  vec3f W3 = (BBox.Max - BBox.Min) / vec3f(Dims3);
-  std::vector<vec3f> Grid(Dims3.x * Dims3.y * Dims3.z, vec3f(NAN));
-  FOR_EACH(P, Particles1) {
-    vec3i Coord{
-      MIN(int((P->Pos.x - BBox.Min.x) / W3.x), Dims3.x - 1), 
-      MIN(int((P->Pos.y - BBox.Min.y) / W3.y), Dims3.y - 1), 
-      MIN(int((P->Pos.z - BBox.Min.z) / W3.z), Dims3.z - 1)};
-    i32 Idx = Coord.z * (Dims3.x * Dims3.y) + Coord.y * (Dims3.x) + Coord.x;
-    assert(Grid[Idx].x != Grid[Idx].x);
-    Grid[Idx] = P->Pos;
-  }
-  float Err = 0;
-  FOR_EACH(P, Particles2) {
-    vec3i Coord{
-      MIN(int((P->Pos.x - BBox.Min.x) / W3.x), Dims3.x - 1), 
-      MIN(int((P->Pos.y - BBox.Min.y) / W3.y), Dims3.y - 1), 
-      MIN(int((P->Pos.z - BBox.Min.z) / W3.z), Dims3.z - 1)};
-    i32 MaxD = MAX(Dims3.z, MAX(Dims3.x, Dims3.y)) / 2;
-    for (i32 D = 0; D < MaxD; ++D) {
-      f32 MinDiff = INFINITY;
-      bool Found = false;
-      for (i32 Dz = -D; Dz <= D; ++Dz) {
-        i32 Z = Coord.z + Dz;
-        if (Z < 0 || Z >= Dims3.z) continue;
-        bool EdgeZ = (Dz == -D) || (Dz == D) || (Z == 0) || (Z == Dims3.z - 1);
-        for (i32 Dy = -D; Dy <= D; ++Dy) {
-          i32 Y = Dy + Coord.y;
-          if (Y < 0 || Y >= Dims3.y) continue;
-          bool EdgeY = (Dy == -D) || (Dy == D) || (Y == 0) || (Y == Dims3.y - 1);
-          bool Edge = EdgeZ || EdgeY;
-          for (i32 Dx = -D; Dx <= D; ++Dx) {
-            i32 X = Dx + Coord.x;
-            if (X < 0 || X >= Dims3.x) continue;
-            bool EdgeX = (Dx == -D) || (Dx == D) || (X == 0) || (X == Dims3.x - 1);
-            if (!(Edge || EdgeX)) continue;
-            i32 Idx = Z * (Dims3.x * Dims3.y) + Y * (Dims3.x) + X;
-            if (Grid[Idx].x == Grid[Idx].x) { // not NAN
-              vec3f Diff = Grid[Idx] - P->Pos;
-              MinDiff = MIN(MinDiff, Diff.x * Diff.x + Diff.y * Diff.y + Diff.z * Diff.z);
-              Found = true;
-            }
-          }
-        }
-      }
-      if (Found) {
-        Err += MinDiff;
-        break;
-      } else {
-        //assert(false);
-      }
-    }
-  }
-  int NDims = Dims3.z == 1 ? 2 : 3;
-  Err = std::sqrt(Err / (NDims * Particles2.size()));
-  return Err;
-}
 
 void WriteBlockNew(bitstream* Bs, u64 BlockIdx);
 void FlushBlocksToFilesNew();
@@ -2294,8 +2341,23 @@ BuildTreeIntTryBoth(std::vector<particle_int>& ParticlesInt, i64 Begin, i64 End,
   }
 }
 
-static tree* TreePtr = nullptr, *TreePtrBackup = nullptr;
-static tree* PrevFramePtr = nullptr, *PrevFramePtrBackup = nullptr;
+static tree* TreePtr = nullptr;
+
+/* Node storage for one frame. Series mode keeps two of these: the frame being coded and the
+previous frame (its predictor), and reuses them in turns. */
+struct tree_pool {
+  tree* Nodes = nullptr;
+  i64 Size = 0;
+};
+
+static void
+Reserve(tree_pool* Pool, i64 Size) {
+  if (Pool->Size >= Size) return;
+  TIME_STAGE(stage::Allocation);
+  delete[] Pool->Nodes;
+  Pool->Nodes = new tree[Size];
+  Pool->Size = Size;
+}
 
 /* Node and RefNode should be at the same relative position on the trees 
 * FirstBranch = the first split
@@ -2478,10 +2540,14 @@ static u32* RansPtr = nullptr;
 //#define NORMAL 1
 //#define SOTA 1
 //#define LIGHT_PREDICT 1
+/* only the TIME_PREDICT tree outlives the coding of its frame (PREDICTION compacts the subtree of each
+block into one node), so only it can predict the tree of the next frame of a series */
+#if defined(TIME_PREDICT) && !defined(PREDICTION)
+#define FRAME_PREDICT 1
+#endif
 static std::vector<i32> Residuals;
 static std::vector<std::vector<particle_int>> ParticleLevels;
 
-static constexpr u32 ContextMax = 32;
 static u32 ContextTSResolution[ContextMax][ContextMax] = {};
 // [T][MM][KK][S]
 //struct one_context_type {
@@ -2504,139 +2570,760 @@ static context_type_1 ContextTS;
 static context_type_1 ContextTS2;
 static context_type_2 ContextR;
 //static u32 ContextR[ContextMax][ContextMax][ContextMax] = {};
+static context_type_1 ContextL; // [axis][bit length of the previous residual on this axis]
+static context_type_1 ContextM; // [0][bit length of the number of particles in a leaf cell]
+static i8 LeafPrevK[3] = {};
+static i8 StreamLevel = 0; // with level streams, the level of the node being coded (see SwitchStreamLevel)
+
+/* The tree contexts are per ResLvl and depth. With level streams they are per level and depth instead
+(within a level the depth determines ResLvl), so that no context is shared by two levels. */
+INLINE static u32
+ContextIndex(i8 ResLvl, i8 Depth) {
+  if (Params.LevelStreams)
+    return StreamLevel*(Params.MaxDepth+1) + Depth;
+  return ResLvl*Params.NLevels + Depth;
+}
 
-static std::vector<bool> PredBuf; // prediction grid // TODO: replace with a more compact array
-static std::vector<i8> CountGrid; // count grid should be half of PredGrid
-static grid_int PredGrid;
-std::vector<vec2i> SRList;
+/* A context model (--model) holds trained counts for ContextS, ContextTS and ContextR, which are used as
+the starting counts of every stream instead of all zeros, so that symbols seen in training are not
+escaped. Contexts are indexed by ContextIndex(), so a model is only valid for the same number of levels
+(and with or without level streams); contexts past the current MaxDepth are ignored. */
+struct context_prior_entry {
+  u8 Table; // 0 = ContextS, 1 = ContextTS, 2 = ContextR
+  u32 CIdx;
+  u32 Offset; // of the count, in u32s, within the context element
+  u32 Count;
+};
+static std::vector<context_prior_entry> ContextPrior;
+static constexpr u32 ContextModelMagic = 0x4d54524d; // "MRTM"
+static constexpr u32 ContextPriorMaxTotal = 1 << 12; // so that a prior (or carried counts) can still adapt
 
-static i64 BlockCount = -1;
-/* At certain depth, we split the node using the Resolution split into a number of levels, then use the
-low-resolution nodes to predict the values for finer-resolution nodes */
-static tree*
-DecodeTreeIntPredict(
-  const tree* PredNode, std::vector<particle_int>& Particles, i64 Begin, i64 End, i8 T, const grid_int& Grid, 
-  split_type Split, i8 ResLvl, i8 Depth) 
-{
-  assert(ResLvl < Params.NLevels);
-  assert(Depth <= Params.MaxDepth);
-  i64 CellCount = i64(Grid.Dims3.x) * i64(Grid.Dims3.y) * i64(Grid.Dims3.z);
-  i8 D = Params.DimsStr[Depth] - 'x';
+template <typename t> static u32*
+ContextCounts(std::vector<t>& Context, u32 CIdx) { return reinterpret_cast<u32*>(Context[CIdx].data()); }
 
-  auto GridLeft  = SplitGrid(Grid, D, Split, side::Left );
-  auto GridRight = SplitGrid(Grid, D, Split, side::Right);
-  i64 CellCountRight = i64(GridRight.Dims3.x) * i64(GridRight.Dims3.y) * i64(GridRight.Dims3.z);
-  i64 CellCountLeft  = i64(GridLeft .Dims3.x) * i64(GridLeft .Dims3.y) * i64(GridLeft .Dims3.z);
-  assert(CellCountLeft+CellCountRight == CellCount);
+template <typename t> static i64
+ContextCountsSize(const std::vector<t>&) { return sizeof(t) / sizeof(u32); }
 
-  /* decode to find Mid */
-#if defined(BINOMIAL)
-  i64 N = End - Begin;
-  i64 P = DecodeCenteredMinimal(u32(N+1), &BlockStream);
-  i64 Mid = P + Begin;
-  i8 S = 0, R = 0;
-#elif defined(SOTA)
-  i64 N = End - Begin;
-  i64 P = DecodeCenteredMinimal(u32(N+1), &BlockStream);
-  i64 Mid = P + Begin;
-  i8 S = 0, R = 0;
-#elif defined(NORMAL)
-  i64 N = End - Begin;
-  i64 Mid = Begin;
-  i64 P = 0;
-  bool Flip = false;
-  if (CellCount-N < N) {
-    Flip = true;
-    N = CellCount - N;
-  }
-  //N = MIN(N, CellCountRight);
-  P = DecodeCenteredMinimal(u32(N+1), &BlockStream);
-  if (Flip) {
-    P = CellCountLeft - P;
+/* Clear all counts (or reset them to the prior), so that a new stream does not depend on the previous ones */
+static void
+ResetContexts() {
+  TIME_STAGE(stage::Allocation); // the tables are large, and assign touches every page
+  ContextS  .assign((Params.MaxDepth+1)*Params.NLevels, context_elem_type_3{});
+  ContextTS .assign((Params.MaxDepth+1)*Params.NLevels, context_elem_type_1{});
+  ContextTS2.assign((Params.MaxDepth+1)*Params.NLevels, context_elem_type_1{});
+  ContextR  .assign((Params.MaxDepth+1)*Params.NLevels, context_elem_type_2{});
+  ContextL  .assign(3, context_elem_type_1{});
+  ContextM  .assign(1, context_elem_type_1{});
+  memset(LeafPrevK, 0, sizeof(LeafPrevK));
+  FOR_EACH (E, ContextPrior) {
+    if (E->CIdx >= ContextS.size()) continue;
+    if (E->Table == 0) ContextCounts(ContextS , E->CIdx)[E->Offset] = E->Count;
+    if (E->Table == 1) ContextCounts(ContextTS, E->CIdx)[E->Offset] = E->Count;
+    if (E->Table == 2) ContextCounts(ContextR , E->CIdx)[E->Offset] = E->Count;
   }
-  Mid = P + Begin;
-  i8 S = 0, R = 0;
-#elif defined(LIGHT_PREDICT)
-  i64 Mid = Begin;
-  bool FullGrid = (T>0) && (1<<(T-1))==CellCount;
-  bool EncodeEmptyCells = false;
-  u32 CIdx = ResLvl*Params.NLevels + Depth;    
-  i8 S = 0, R = 0;
-  if (!FullGrid && T>0) { // no prediction, try 1-context
-    ContextTS[CIdx][T][0] = 1;
-    S = DecodeWithContext(T, ContextTS[CIdx][T].data(), &Coder);
-    S = (S==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : S-1;
-    ++ContextTS[CIdx][T][S+1];
-  } else if (FullGrid) {
-    S = T - 1;
-  } else { // if S == 0
-    S = 0;
-    //++ContextTS[CIdx][T][S+1];
+}
+
+/* Halve the counts of every context whose total exceeds MaxTotal (a non-zero count stays non-zero) */
+template <typename t> static void
+RescaleContext(std::vector<t>& Context, u32 MaxTotal) {
+  FOR(u32, CIdx, 0, Context.size()) {
+    u32* Counts = ContextCounts(Context, CIdx);
+    for (i64 I = 0; I < ContextCountsSize(Context); I += ContextMax+2) {
+      u32* C = Counts + I; // one context, C[0] is the escape count
+      u64 Total = 0;
+      FOR(u32, S, 1, ContextMax+2) { Total += C[S]; }
+      while (Total > MaxTotal) {
+        Total = 0;
+        FOR(u32, S, 1, ContextMax+2) { C[S] = (C[S]+1) / 2; Total += C[S]; }
+      }
+    }
   }
+}
 
-  if (FullGrid) {
-    R = T - 1;
-  } else if (T==1 && S==1) {
-    R = 0;
-  } else if (S == 0) {
-    R = T;
-  } else {
-    u32 CR = T*(ContextMax+2) + S;
-    ContextR[CIdx][CR][0] = 1;
-    R = DecodeWithContext(T, ContextR[CIdx][CR].data(), &Coder);
-    R = (R==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : R-1;
-    ++ContextR[CIdx][CR][R+1];
+static void
+RescaleContexts(u32 MaxTotal) {
+  RescaleContext(ContextS , MaxTotal);
+  RescaleContext(ContextTS, MaxTotal);
+  RescaleContext(ContextR , MaxTotal);
+  RescaleContext(ContextM , MaxTotal);
+}
+
+template <typename t> static void
+CollectContextModel(std::vector<t>& Context, u8 Table, std::vector<context_prior_entry>* Entries) {
+  FOR(u32, CIdx, 0, Context.size()) {
+    const u32* Counts = ContextCounts(Context, CIdx);
+    FOR(i64, I, 0, ContextCountsSize(Context)) {
+      if (Counts[I] > 0 && I%(ContextMax+2) != 0) // escape counts are set before coding anyway
+        Entries->push_back(context_prior_entry{Table, CIdx, u32(I), Counts[I]});
+    }
+  }
+}
+
+/* Model file: u32 magic, i32 number of levels, i64 number of entries, then the entries */
+static void
+SaveContextModel(cstr FileName) {
+  RescaleContexts(ContextPriorMaxTotal);
+  std::vector<context_prior_entry> Entries;
+  CollectContextModel(ContextS , 0, &Entries);
+  CollectContextModel(ContextTS, 1, &Entries);
+  CollectContextModel(ContextR , 2, &Entries);
+  FILE* Fp = fopen(FileName, "wb");
+  if (!Fp)
+    EXIT_ERROR("cannot write the context model");
+  WritePOD(Fp, ContextModelMagic);
+  WritePOD(Fp, i32(Params.NLevels));
+  WritePOD(Fp, i64(Entries.size()));
+  FOR_EACH (E, Entries) {
+    WritePOD(Fp, E->Table);
+    WritePOD(Fp, E->CIdx);
+    WritePOD(Fp, E->Offset);
+    WritePOD(Fp, E->Count);
+  }
+  fclose(Fp);
+  printf("context model %s: %zu counts\n", FileName, Entries.size());
+}
+
+/* Load a model as the prior of ResetContexts() and return its hash */
+static u64
+LoadContextModel(cstr FileName) {
+  FILE* Fp = fopen(FileName, "rb");
+  if (!Fp)
+    EXIT_ERROR("cannot open the context model");
+  u32 Magic = 0; i32 NLevels = 0; i64 N = 0;
+  ReadPOD(Fp, &Magic);
+  ReadPOD(Fp, &NLevels);
+  ReadPOD(Fp, &N);
+  if (Magic != ContextModelMagic)
+    EXIT_ERROR("not a context model file");
+  if (NLevels != Params.NLevels)
+    EXIT_ERROR("the context model was trained with a different --nlevels");
+  u64 Hash = HashBytes(&NLevels, sizeof(NLevels));
+  ContextPrior.resize(N);
+  FOR_EACH (E, ContextPrior) {
+    ReadPOD(Fp, &E->Table);
+    ReadPOD(Fp, &E->CIdx);
+    ReadPOD(Fp, &E->Offset);
+    ReadPOD(Fp, &E->Count);
+    if (E->Table > 2 || E->Offset >= (E->Table==0 ? ContextCountsSize(ContextS) : E->Table==1 ?
+        ContextCountsSize(ContextTS) : ContextCountsSize(ContextR)))
+      EXIT_ERROR("corrupt context model");
+    Hash = HashBytes(&E->Table, sizeof(E->Table), Hash);
+    Hash = HashBytes(&E->CIdx, sizeof(E->CIdx), Hash);
+    Hash = HashBytes(&E->Offset, sizeof(E->Offset), Hash);
+    Hash = HashBytes(&E->Count, sizeof(E->Count), Hash);
+  }
+  fclose(Fp);
+  printf("context model %s: %zu counts\n", FileName, ContextPrior.size());
+  return Hash;
+}
+
+/* Attributes are coded at the leaves, in the order the particles are emitted by the tree. Each value is
+predicted from the previously coded leaf in the same block (a spatial neighbor), or from the block mean
+for the first leaf of a block. The residual is coded as its bit length (adaptive context, conditioned
+on the bit length of the previous residual) followed by the low bits */
+static context_type_1 ContextA; // [component][bit length of the previous residual]
+static std::vector<i32> AttrPred; // [component] current prediction
+static std::vector<i32> AttrMean; // [component] mean of the last block
+static std::vector<i8 > AttrPrevK; // [component] bit length of the last residual
+
+/* Carry keeps the counts of the previous time step (--carry_contexts), if it had the same attributes */
+static void
+InitAttributeCoder(bool Carry = false) {
+  if (Carry && i64(ContextA.size()) == Params.NAttrs)
+    RescaleContext(ContextA, ContextPriorMaxTotal);
+  else
+    ContextA.assign(Params.NAttrs, context_elem_type_1{});
+  AttrPred .assign(Params.NAttrs, 0);
+  AttrMean .assign(Params.NAttrs, 0);
+  AttrPrevK.assign(Params.NAttrs, 0);
+}
+
+static void
+EncodeAttribute(int C, i32 Val) {
+  u32 Res = ZigZag(i32(u32(Val) - u32(AttrPred[C])));
+  i8 K = Msb(Res) + 1; // 0 to 32
+  auto& Context = ContextA[C][AttrPrevK[C]];
+  Context[0] = 1;
+  STAT_SYMBOL(stat_class::Attribute, stat_table::A, C, AttrPrevK[C]);
+  if (Context[K+1] == 0) { // escape
+    STAT_ESCAPE();
+    EncodeWithContext(ContextMax, 0, Context.data(), &Coder);
+    EncodeUniform(ContextMax, K, &Coder);
+  } else {
+    EncodeWithContext(ContextMax, K+1, Context.data(), &Coder);
+  }
+  ++Context[K+1];
+  if (K > 1) { // the leading 1 bit is implicit
+    Write(&BlockStream, Res, K-1);
+    STAT_RAW_BITS(stat_class::Attribute, K-1);
+  }
+  AttrPrevK[C] = K;
+  AttrPred[C] = Val;
+}
+
+static i32
+DecodeAttribute(int C) {
+  auto& Context = ContextA[C][AttrPrevK[C]];
+  Context[0] = 1;
+  i8 K = DecodeWithContext(ContextMax, Context.data(), &Coder);
+  K = (K==0) ? DecodeUniform(ContextMax, &Coder) : K-1;
+  ++Context[K+1];
+  u32 Res = K==0 ? 0 : (1u << (K-1));
+  if (K > 1)
+    Res |= u32(Read(&BlockStream, K-1));
+  i32 Val = i32(u32(AttrPred[C]) + u32(UnZigZag(Res)));
+  AttrPrevK[C] = K;
+  AttrPred[C] = Val;
+  return Val;
+}
+
+/* at the beginning of a block, code the mean of the block against the mean of the last block (a block
+is never empty, and the decoder always reads a mean) */
+static void
+EncodeBlockAttributeMean(i64 Begin, i64 End) {
+  assert(Begin < End);
+  FOR(int, C, 0, Params.NAttrs) {
+    i64 Sum = 0;
+    FOR(i64, I, Begin, End) Sum += Attributes[I*Params.NAttrs + C];
+    AttrPred[C] = AttrMean[C];
+    EncodeAttribute(C, i32(Sum / (End-Begin)));
+    AttrMean[C] = AttrPred[C];
+  }
+}
+
+static void
+DecodeBlockAttributeMean() {
+  FOR(int, C, 0, Params.NAttrs) {
+    AttrPred[C] = AttrMean[C];
+    AttrMean[C] = DecodeAttribute(C);
+  }
+}
+
+INLINE static void
+EncodeParticleAttributes(i64 I) {
+  FOR(int, C, 0, Params.NAttrs) EncodeAttribute(C, Attributes[I*Params.NAttrs + C]);
+}
+
+INLINE static void
+DecodeParticleAttributes() {
+  FOR(int, C, 0, Params.NAttrs) Attributes.push_back(DecodeAttribute(C));
+}
+
+/* With level streams (encode --level_streams) the right child of each resolution split starts a new
+level (see level_stream_meta), which has its own streams and leaf and attribute contexts. The state of
+the current level is in the globals and the others are parked here. A level's first attribute of a
+block is predicted from the block mean, which is coded in level 0. */
+struct level_state {
+  bitstream BlockStream;
+  arithmetic_coder<> Coder;
+  context_type_1 ContextL;
+  context_type_1 ContextM;
+  i8 LeafPrevK[3] = {};
+  context_type_1 ContextA;
+  std::vector<i32> AttrPred;
+  std::vector<i8 > AttrPrevK;
+  i64 NParticles = 0; // in the level's subtrees, counted by the encoder (not swapped)
+};
+static std::vector<level_state> LevelStates; // [level]
+
+static void
+SwapLevelState(level_state* S) {
+  std::swap(BlockStream, S->BlockStream);
+  std::swap(Coder, S->Coder);
+  ContextL.swap(S->ContextL);
+  ContextM.swap(S->ContextM);
+  FOR(int, D, 0, 3) { std::swap(LeafPrevK[D], S->LeafPrevK[D]); }
+  ContextA.swap(S->ContextA);
+  AttrPred.swap(S->AttrPred);
+  AttrPrevK.swap(S->AttrPrevK);
+}
+
+static void
+SwitchStreamLevel(i8 Level) {
+  if (Level == StreamLevel) return;
+  SwapLevelState(&LevelStates[StreamLevel]); // park the current level
+  SwapLevelState(&LevelStates[Level]);
+  StreamLevel = Level;
+}
+
+/* Called after ResetContexts() and InitAttributeCoder(), which leave level 0 in the globals. The other
+levels start from the same fresh contexts; their streams are set up by the caller. */
+static void
+InitLevelStates() {
+  LevelStates.assign(Params.NLevels, level_state{});
+  StreamLevel = 0;
+  FOR(i8, L, 1, Params.NLevels) {
+    level_state& S = LevelStates[L];
+    S.ContextL = ContextL;
+    S.ContextM = ContextM;
+    S.ContextA = ContextA;
+    S.AttrPred = AttrPred;
+    S.AttrPrevK = AttrPrevK;
+  }
+}
+
+/* The level of the right child of a resolution split at ResLvl, or -1 if it is in the current level */
+INLINE static i8
+RightChildLevel(split_type Split, i8 ResLvl) {
+  return (Params.LevelStreams && Split == ResolutionSplit) ? Params.NLevels-1-ResLvl : -1;
+}
+
+static std::vector<bool> PredBuf; // prediction grid // TODO: replace with a more compact array
+static std::vector<i8> CountGrid; // count grid should be half of PredGrid
+static grid_int PredGrid;
+std::vector<vec2i> SRList;
+
+/* In error-based mode, an axis needs more refinement bits only while its center is farther than
+Params.Accuracy from one of its ends (the decoder places particles at the center) */
+INLINE bool
+NeedsRefinement(i32 Min, i32 Max) {
+  if (Max <= Min) return false;
+  if (Params.RefinementMode != refinement_mode::ERROR_BASED) return true;
+  return (Max-Min+1)/2 > Params.Accuracy;
+}
+
+/* The bounding box of all cells of a (possibly strided) grid */
+static bbox_int
+GridBBox(const grid_int& Grid) {
+  bbox_int BBox;
+  BBox.Min = Params.BBoxInt.Min + Grid.From3*Params.W3;
+  BBox.Max = Params.BBoxInt.Min + (Grid.From3 + (Grid.Dims3-1)*Grid.Stride3)*Params.W3 + Params.W3 - 1;
+  return BBox;
+}
+
+/* Temporal prediction of leaves (series mode, --temporal_leaves). The previous frame's particles are
+indexed by their cell; a single-cell leaf whose cell was occupied in the previous frame codes its
+position as a residual against that particle (bit length with an adaptive context per axis, then the
+low bits) instead of the raw refinement bits. The index is built from the particles, not the tree, so it
+works in every build (see FRAME_PREDICT) */
+static std::unordered_map<u64, vec3i> PrevFrameLeaves; // cell -> position of the particle in the previous frame
+static bool UseTemporalLeaves = false; // false on key frames
+static i64 NTemporalLeaves = 0;
+
+INLINE u64
+CellKey(const vec3i& Cell3) {
+  return (u64(Cell3.z)*u64(Params.Dims3.y) + u64(Cell3.y))*u64(Params.Dims3.x) + u64(Cell3.x);
+}
+
+static void
+IndexFrameLeaves(const std::vector<particle_int>& Particles) {
+  PrevFrameLeaves.clear();
+  PrevFrameLeaves.reserve(Particles.size());
+  FOR_EACH (P, Particles) {
+    PrevFrameLeaves[CellKey((P->Pos-Params.BBoxInt.Min) / Params.W3)] = P->Pos;
+  }
+}
+
+static const vec3i*
+FindPrevFrameLeaf(const grid_int& Grid) {
+  if (!UseTemporalLeaves || Params.RefinementMode==refinement_mode::ERROR_BASED) return nullptr;
+  if (Grid.Dims3 != vec3i(1) || Params.W3 == vec3i(1)) return nullptr; // W3 == 1 means no refinement bits (the encoder rejects both)
+  auto It = PrevFrameLeaves.find(CellKey(Grid.From3));
+  return It == PrevFrameLeaves.end() ? nullptr : &It->second;
+}
+
+static void
+EncodeLeafResidual(int D, i32 Diff) {
+  u32 Res = ZigZag(Diff);
+  i8 K = Msb(Res) + 1;
+  auto& Context = ContextL[D][LeafPrevK[D]];
+  Context[0] = 1;
+  STAT_SYMBOL(stat_class::Refinement, stat_table::L, D, LeafPrevK[D]);
+  if (Context[K+1] == 0) { // escape
+    STAT_ESCAPE();
+    EncodeWithContext(ContextMax, 0, Context.data(), &Coder);
+    EncodeUniform(ContextMax, K, &Coder);
+  } else {
+    EncodeWithContext(ContextMax, K+1, Context.data(), &Coder);
+  }
+  ++Context[K+1];
+  if (K > 1) { // the leading 1 bit is implicit
+    Write(&BlockStream, Res, K-1);
+    STAT_RAW_BITS(stat_class::Refinement, K-1);
+  }
+  LeafPrevK[D] = K;
+}
+
+static i32
+DecodeLeafResidual(int D) {
+  auto& Context = ContextL[D][LeafPrevK[D]];
+  Context[0] = 1;
+  i8 K = DecodeWithContext(ContextMax, Context.data(), &Coder);
+  K = (K==0) ? DecodeUniform(ContextMax, &Coder) : K-1;
+  ++Context[K+1];
+  u32 Res = K==0 ? 0 : (1u << (K-1));
+  if (K > 1)
+    Res |= u32(Read(&BlockStream, K-1));
+  LeafPrevK[D] = K;
+  return UnZigZag(Res);
+}
+
+/* With --multiplicity a leaf cell holds K >= 1 particles at the same position. Its parent already coded
+the bit length S of K, so only K - 2^(S-1) is left: with an adaptive context per S while that has at
+most ContextMax values, and in raw bits after that. A cell with one particle (S == 1) costs nothing. */
+static void
+EncodeMultiplicity(i64 K, i8 S) {
+  if (S <= 1) return;
+  u32 Offset = u32(K - (i64(1) << (S-1)));
+  u32 NValues = u32(1) << (S-1);
+  if (NValues > ContextMax) {
+    Write(&BlockStream, Offset, S-1);
+    STAT_RAW_BITS(stat_class::Other, S-1);
+    return;
+  }
+  auto& Context = ContextM[0][S];
+  Context[0] = 1;
+  STAT_SYMBOL(stat_class::Other, stat_table::M, 0, S);
+  if (Context[Offset+1] == 0) {
+    STAT_ESCAPE();
+    EncodeWithContext(NValues-1, 0, Context.data(), &Coder);
+    EncodeUniform(NValues-1, Offset, &Coder);
+  } else {
+    EncodeWithContext(NValues-1, Offset+1, Context.data(), &Coder);
+  }
+  ++Context[Offset+1];
+}
+
+static i64
+DecodeMultiplicity(i8 S) {
+  if (S <= 1) return 1;
+  u32 NValues = u32(1) << (S-1);
+  if (NValues > ContextMax)
+    return NValues + i64(Read(&BlockStream, S-1));
+  auto& Context = ContextM[0][S];
+  Context[0] = 1;
+  u32 Offset = DecodeWithContext(NValues-1, Context.data(), &Coder);
+  Offset = (Offset==0) ? DecodeUniform(NValues-1, &Coder) : Offset-1;
+  ++Context[Offset+1];
+  return NValues + Offset;
+}
+
+/* Code the position of the only particle in a leaf */
+static void
+EncodeLeaf(const vec3i& Pos, const grid_int& Grid) {
+  stage_scope RefinementScope(stage::Refinement, StageTimer.Sampling);
+  if (const vec3i* Prev = FindPrevFrameLeaf(Grid)) {
+    FOR(int, D, 0, 3) { if (Params.W3[D] > 1) EncodeLeafResidual(D, Pos[D] - (*Prev)[D]); }
+    ++NTemporalLeaves;
+    return;
+  }
+  bbox_int BBox;
+  BBox.Min = Params.BBoxInt.Min + Grid.From3*Params.W3;
+  BBox.Max = BBox.Min + Grid.Dims3*Params.W3 - 1;
+  for (int DD = 0; DD < 3; ++DD) {
+    while (NeedsRefinement(BBox.Min[DD], BBox.Max[DD])) {
+      //REQUIRE(BBox.Min[DD] <= Pos[DD]);
+      //REQUIRE(BBox.Max[DD] >= Pos[DD]);
+      i32 M = (BBox.Max[DD]+BBox.Min[DD]) >> 1;
+      bool Left = Pos[DD] <= M;
+      if (Left) BBox.Max[DD] = M; else BBox.Min[DD] = M+1;
+      Write(&BlockStream, Left);
+      STAT_RAW_BITS(stat_class::Refinement, 1);
+    }
+    f64 Diff = Pos[DD] - (BBox.Min[DD]+BBox.Max[DD]) / 2;
+    RMSE += Diff * Diff;
+  }
+}
+
+static vec3i
+DecodeLeaf(const grid_int& Grid) {
+  stage_scope RefinementScope(stage::Refinement, StageTimer.Sampling);
+  if (const vec3i* Prev = FindPrevFrameLeaf(Grid)) {
+    vec3i Pos = Params.BBoxInt.Min + Grid.From3*Params.W3;
+    FOR(int, D, 0, 3) { if (Params.W3[D] > 1) Pos[D] = (*Prev)[D] + DecodeLeafResidual(D); }
+    ++NTemporalLeaves;
+    return Pos;
+  }
+  bbox_int BBox;
+  BBox.Min = Params.BBoxInt.Min + Grid.From3*Params.W3;
+  BBox.Max = BBox.Min + Grid.Dims3*Params.W3 - 1;
+  for (int DD = 0; DD < 3; ++DD) {
+    while (NeedsRefinement(BBox.Min[DD], BBox.Max[DD])) {
+      i32 M = (BBox.Max[DD]+BBox.Min[DD]) >> 1;
+      bool Left = Read(&BlockStream);
+      if (Left) BBox.Max[DD] = M; else BBox.Min[DD] = M+1;
+    }
+  }
+  return (BBox.Min+BBox.Max) / 2;
+}
+
+/* In error-based mode, a node whose cells are all within Params.Accuracy of its center is not split further */
+static bool
+CanCollapse(const grid_int& Grid) {
+  if (Params.RefinementMode != refinement_mode::ERROR_BASED) return false;
+  bbox_int BBox = GridBBox(Grid);
+  FOR(int, D, 0, 3) { if (NeedsRefinement(BBox.Min[D], BBox.Max[D])) return false; }
+  return true;
+}
+
+/* A collapsed node only stores its exact count (T already gives the count's msb) */
+static tree*
+EncodeCollapsedNode(const std::vector<particle_int>& Particles, i64 Begin, i64 End, i8 T, const grid_int& Grid) {
+  i64 N = End - Begin;
+  assert(T > 0 && Msb(u64(N))+1 == T);
+  if (T > 1) Write(&BlockStream, u64(N - (i64(1)<<(T-1))), T-1);
+  STAT_RAW_BITS(stat_class::Other, T-1);
+  bbox_int BBox = GridBBox(Grid);
+  vec3i Center = (BBox.Min+BBox.Max) / 2;
+  FOR(i64, I, Begin, End) {
+    FOR(int, D, 0, 3) {
+      f64 Diff = Particles[I].Pos[D] - Center[D];
+      RMSE += Diff * Diff;
+    }
+    if (Params.NAttrs > 0)
+      EncodeParticleAttributes(I);
+  }
+  NParticlesDecoded += N;
+  tree* Node = new (TreePtr++) tree;
+  Node->Count = N;
+  return Node;
+}
+
+static tree*
+DecodeCollapsedNode(std::vector<particle_int>& Particles, i8 T, const grid_int& Grid) {
+  assert(T > 0);
+  i64 N = i64(1) << (T-1);
+  if (T > 1) N += Read(&BlockStream, T-1);
+  bbox_int BBox = GridBBox(Grid);
+  vec3i Center = (BBox.Min+BBox.Max) / 2;
+  FOR(i64, I, 0, N) {
+    Particles.push_back(particle_int{.Pos = Center});
+    if (Params.NAttrs > 0)
+      DecodeParticleAttributes();
+  }
+  NParticlesDecoded += N;
+  tree* Node = new (TreePtr++) tree;
+  Node->Count = N;
+  return Node;
+}
+
+/* Budgeted decoding (decode --max_bytes B, --max_time S). The embedded order is the one of the level
+streams: the levels are read coarsest first while they fit in B bytes, and while the time lasts the
+tree is decoded as usual. Once the deadline has passed, no more subtree of a finer level is started,
+and the blocks not started yet (and the nodes above them) are not decoded either. A subtree that is
+not decoded is filled in with generated particles, spread as the prediction from the coarser levels
+(or evenly without one), since only the bit length of its count is known. The fill is clamped so
+that the output never has more particles than were encoded (see FillCount). */
+struct decode_budget {
+  i64 MaxBytes = 0; // of the level sub-streams read, 0 = no limit
+  f64 MaxTime = 0; // in seconds, 0 = no limit
+  f64 Deadline = 0; // on timer(), 0 = none
+  bool Expired = false;
+  bool Fill = false; // generate particles for the subtrees that are not decoded
+  std::vector<i64> LevelFill; // [level] particles left to generate in a level that is not read
+  i64 TreeEnd = 0; // NParticlesDecoded + NParticlesGenerated once the tree (or chunk) is done
+};
+static decode_budget Budget;
+
+/* The time counts from the start of the tree decoding, since the setup before (the contexts, reading
+the streams) does not depend on how much is decoded */
+static void
+StartBudgetClock() {
+  if (Budget.MaxTime > 0)
+    Budget.Deadline = timer() + Budget.MaxTime;
+}
+
+INLINE static bool
+BudgetExpired() {
+  if (!Budget.Expired && Budget.Deadline > 0 && timer() > Budget.Deadline)
+    Budget.Expired = true;
+  return Budget.Expired;
+}
+
+/* The count of a subtree that is not decoded: within the range given by its bit length T, as close to
+the predicted count as possible */
+static i64
+EstimateCount(const tree* PredNode, i8 T) {
+  if (T == 0) return 0;
+  i64 Lo = i64(1) << (T-1), Hi = (i64(1) << T) - 1;
+  if (!PredNode) return (Lo+Hi) / 2;
+  return (MIN((MAX(PredNode->Count, Lo)), Hi));
+}
+
+/* Clamp the estimated count of a subtree that is not decoded. A level that is not read has its exact
+count in the level index, which its subtrees share. Once the time is out nothing more is decoded, so
+the subtrees left share what the tree (or chunk) has not output yet. */
+static i64
+FillCount(i64 Estimate, i8 Level) {
+  i64 N = MIN(Estimate, Budget.TreeEnd - NParticlesDecoded - NParticlesGenerated);
+  if (Level > Params.MaxLevel) {
+    N = MIN(N, Budget.LevelFill[Level]);
+    Budget.LevelFill[Level] -= MAX(N, i64(0));
+  }
+  return MAX(N, i64(0));
+}
+
+/* Put N generated particles in Grid (whose splits are spatial), in proportion to the counts of the
+prediction tree, or to the number of cells below a node without a prediction (down to one particle
+per node, then at its center) */
+static void
+GenerateParticlesInt(const tree* PredNode, std::vector<particle_int>& Particles, i64 N, const grid_int& Grid, i8 Depth) {
+  if (N == 0) return;
+  i64 CellCount = i64(Grid.Dims3.x) * i64(Grid.Dims3.y) * i64(Grid.Dims3.z);
+  if (CellCount == 1 || Depth >= Params.MaxDepth || (N == 1 && !PredNode)) { // at the center of the node
+    bbox_int BBox = GridBBox(Grid);
+    vec3i Center = (BBox.Min+BBox.Max) / 2;
+    FOR(i64, I, 0, N) {
+      Particles.push_back(particle_int{.Pos = Center});
+      FOR(int, C, 0, Params.NAttrs) { Attributes.push_back(AttrMean[C]); }
+    }
+    NParticlesGenerated += N;
+    return;
+  }
+  i8 D = Params.DimsStr[Depth] - 'x';
+  auto GridLeft  = SplitGrid(Grid, D, SpatialSplit, side::Left );
+  auto GridRight = SplitGrid(Grid, D, SpatialSplit, side::Right);
+  if (PredNode && !PredNode->Left && !PredNode->Right) // below the prediction
+    PredNode = nullptr;
+  f64 Share = 0; // of the left child
+  if (PredNode && PredNode->Count > 0)
+    Share = f64(PredNode->Left ? PredNode->Left->Count : 0) / f64(PredNode->Count);
+  else
+    Share = f64(GridLeft.Dims3.x) * f64(GridLeft.Dims3.y) * f64(GridLeft.Dims3.z) / f64(CellCount);
+  i64 NLeft = i64(f64(N)*Share + 0.5);
+  GenerateParticlesInt(PredNode ? PredNode->Left  : nullptr, Particles, NLeft  , GridLeft , Depth+1);
+  GenerateParticlesInt(PredNode ? PredNode->Right : nullptr, Particles, N-NLeft, GridRight, Depth+1);
+}
+
+static i64 BlockCount = -1;
+/* At certain depth, we split the node using the Resolution split into a number of levels, then use the
+low-resolution nodes to predict the values for finer-resolution nodes */
+static tree*
+DecodeTreeIntPredict(
+  const tree* PredNode, std::vector<particle_int>& Particles, i64 Begin, i64 End, i8 T, const grid_int& Grid, 
+  split_type Split, i8 ResLvl, i8 Depth) 
+{
+  assert(ResLvl < Params.NLevels);
+  assert(Depth <= Params.MaxDepth);
+  if (Depth == Params.ChunkDepth) // the root of the tree or of a chunk, whose count the caller read
+    Budget.TreeEnd = NParticlesDecoded + NParticlesGenerated + End - Begin;
+  if (Depth <= Params.StartResolutionSplit && Budget.Deadline > 0 && BudgetExpired()) { // only fill in the rest
+    /* below the root only the bit length T of the count is known */
+    i64 N = FillCount(Depth == Params.ChunkDepth ? End - Begin : EstimateCount(PredNode, T), -1);
+    GenerateParticlesInt(PredNode, Particles, N, Grid, Depth);
+    return nullptr;
+  }
+  if (CanCollapse(Grid))
+    return DecodeCollapsedNode(Particles, T, Grid);
+  i64 CellCount = i64(Grid.Dims3.x) * i64(Grid.Dims3.y) * i64(Grid.Dims3.z);
+  i8 D = Params.DimsStr[Depth] - 'x';
+
+  auto GridLeft  = SplitGrid(Grid, D, Split, side::Left );
+  auto GridRight = SplitGrid(Grid, D, Split, side::Right);
+  i64 CellCountRight = i64(GridRight.Dims3.x) * i64(GridRight.Dims3.y) * i64(GridRight.Dims3.z);
+  i64 CellCountLeft  = i64(GridLeft .Dims3.x) * i64(GridLeft .Dims3.y) * i64(GridLeft .Dims3.z);
+  assert(CellCountLeft+CellCountRight == CellCount);
+
+  /* decode to find Mid */
+  stage_scope ContextScope(stage::ContextModel, StageTimer.Sampling);
+#if defined(BINOMIAL)
+  i64 N = End - Begin;
+  i64 P = DecodeCenteredMinimal(u32(N+1), &BlockStream);
+  i64 Mid = P + Begin;
+  i8 S = 0, R = 0;
+#elif defined(SOTA)
+  i64 N = End - Begin;
+  i64 P = DecodeCenteredMinimal(u32(N+1), &BlockStream);
+  i64 Mid = P + Begin;
+  i8 S = 0, R = 0;
+#elif defined(NORMAL)
+  i64 N = End - Begin;
+  i64 Mid = Begin;
+  i64 P = 0;
+  bool Flip = false;
+  if (CellCount-N < N) {
+    Flip = true;
+    N = CellCount - N;
+  }
+  //N = MIN(N, CellCountRight);
+  P = DecodeCenteredMinimal(u32(N+1), &BlockStream);
+  if (Flip) {
+    P = CellCountLeft - P;
+  }
+  Mid = P + Begin;
+  i8 S = 0, R = 0;
+#elif defined(LIGHT_PREDICT)
+  i64 Mid = Begin;
+  bool FullGrid = (T>0) && (1<<(T-1))==CellCount;
+  bool EncodeEmptyCells = false;
+  u32 CIdx = ContextIndex(ResLvl, Depth);
+  i8 S = 0, R = 0;
+  if (!FullGrid && T>0) { // no prediction, try 1-context
+    ContextTS[CIdx][T][0] = 1;
+    S = DecodeWithContext(T, ContextTS[CIdx][T].data(), &Coder);
+    S = (S==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : S-1;
+    ++ContextTS[CIdx][T][S+1];
+  } else if (FullGrid) {
+    S = T - 1;
+  } else { // if S == 0
+    S = 0;
+    //++ContextTS[CIdx][T][S+1];
+  }
+
+  if (FullGrid) {
+    R = T - 1;
+  } else if (T==1 && S==1) {
+    R = 0;
+  } else if (S == 0) {
+    R = T;
+  } else {
+    u32 CR = T*(ContextMax+2) + S;
+    ContextR[CIdx][CR][0] = 1;
+    R = DecodeWithContext(T, ContextR[CIdx][CR].data(), &Coder);
+    R = (R==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : R-1;
+    ++ContextR[CIdx][CR][R+1];
   }
 #elif defined(PREDICTION) || defined(TIME_PREDICT)
   //static int SRCounter = 0;
   i64 Mid = Begin;
-  bool FullGrid = (T>0) && (1<<(T-1))==CellCount;
+  bool FullGrid = !Params.Multiplicity && (T>0) && (1<<(T-1))==CellCount;
   bool EncodeEmptyCells = false;
-  u32 CIdx = ResLvl*Params.NLevels + Depth;    
+  u32 CIdx = ContextIndex(ResLvl, Depth);
   i8 S = 0, R = 0;
-  //if (!FullGrid && T>0 && PredNode) { // predict P
-  //  i64 M = PredNode->Count;
-  //  i64 K = PredNode->Left?PredNode->Left->Count : M - PredNode->Right->Count;
-  //  if (EncodeEmptyCells)  { K= CellCountLeft - K; M = CellCount - M; }
-  //  i8 MM = Msb(u64(M)) + 1;
-  //  i8 KK = Msb(u64(K)) + 1;
-  //  u32 C = T*(ContextMax+2)*(ContextMax+2) + MM*(ContextMax+2) + KK;
-  //  ContextS[CIdx][C][0] = 1;
-  //  S = DecodeWithContext(T, ContextS[CIdx][C].data(), &Coder);
-  //  S = (S==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : S-1;
-  //  ++ContextS[CIdx][C][S+1];
-  //  //++ContextTS[CIdx][T][S+1];
-  //} else if (!FullGrid && T>0) { // no prediction, try 1-context
-  //  ContextTS[CIdx][T][0] = 1;
-  //  S = DecodeWithContext(T, ContextTS[CIdx][T].data(), &Coder);
-  //  S = (S==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : S-1;
-  //  ++ContextTS[CIdx][T][S+1];
-  //} else if (FullGrid) {
-  //  S = T - 1;
-  //} else { // if S == 0
-  //  S = 0;
-  //  //++ContextTS[CIdx][T][S+1];
-  //}
+  if (!FullGrid && T>0 && PredNode && (PredNode->Left || PredNode->Right)) { // predict S
+    i64 M = PredNode->Count;
+    i64 K = PredNode->Left?PredNode->Left->Count : M - PredNode->Right->Count;
+    if (EncodeEmptyCells)  { K= CellCountLeft - K; M = CellCount - M; }
+    i8 MM = Msb(u64(M)) + 1;
+    i8 KK = Msb(u64(K)) + 1;
+    ContextS[CIdx][T][MM][KK][0] = 1;
+    S = DecodeWithContext(T, ContextS[CIdx][T][MM][KK].data(), &Coder);
+    S = (S==0) ? DecodeUniform(T, &Coder) : S-1;
+    ++ContextS[CIdx][T][MM][KK][S+1];
+  } else if (!FullGrid && T>0) { // no prediction, try 1-context
+    ContextTS[CIdx][T][0] = 1;
+    S = DecodeWithContext(T, ContextTS[CIdx][T].data(), &Coder);
+    S = (S==0) ? DecodeUniform(T, &Coder) : S-1;
+    ++ContextTS[CIdx][T][S+1];
+  } else if (FullGrid) {
+    S = T - 1;
+  }
 
-  //if (FullGrid) {
-  //  R = T - 1;
-  //} else if (T==1 && S==1) {
-  //  R = 0;
-  //} else if (S == 0) {
-  //  R = T;
-  //} else {
-  //  u32 CR = T*(ContextMax+2) + S;
-  //  ContextR[CIdx][CR][0] = 1;
-  //  R = DecodeWithContext(T, ContextR[CIdx][CR].data(), &Coder);
-  //  R = (R==0) ? DecodeCenteredMinimal(T+1, &BlockStream) : R-1;
-  //  ++ContextR[CIdx][CR][R+1];
-  //}
+  if (T > 0) {
+    if (FullGrid) {
+      R = T - 1;
+    } else if (T==1 && S==1) {
+      R = 0;
+    } else if (S == 0) {
+      R = T;
+    } else {
+      ContextR[CIdx][T][S][0] = 1;
+      R = DecodeWithContext(T, ContextR[CIdx][T][S].data(), &Coder);
+      R = (R==0) ? DecodeUniform(T, &Coder) : R-1;
+      ++ContextR[CIdx][T][S][R+1];
+    }
+  }
 #endif
+  ContextScope.End();
 
   tree* SaveTreePtr = nullptr;
+  trace_scope BlockTrace(Depth == Params.StartResolutionSplit, "block", "block", BlockCount+1);
+  stage_scope BlockScope(stage::BlockCoding, Depth == Params.StartResolutionSplit);
   if (Depth == Params.StartResolutionSplit) { // beginning of block
     SaveTreePtr = TreePtr;
     ++BlockCount;
+    if (Params.NAttrs > 0)
+      DecodeBlockAttributeMean();
     //REQUIRE(Split == ResolutionSplit);
     //FOR_EACH(Context, ContextS ) { Context->clear(); }
     //FOR_EACH(Context, ContextTS) { Context->clear(); }
@@ -2656,23 +3343,20 @@ DecodeTreeIntPredict(
 #if defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   if (S == 1) {
 #elif defined(PREDICTION)
-  if (S==1 && CellCountLeft==1) {
+  if (S>=1 && CellCountLeft==1) {
+    assert(Depth+1 == Params.MaxDepth);
 #elif defined(NORMAL) || defined(SOTA) || defined(BINOMIAL)
   if (Begin+1 == Mid) {
 #endif
-    assert(Depth+1 == Params.MaxDepth);
+    i64 K = DecodeMultiplicity(S);
     Left = new (TreePtr++) tree;
-    Left->Count = 1;
-    ++NParticlesDecoded;
-    bbox_int BBox;
-    BBox.Min = Params.BBoxInt.Min + GridLeft.From3*Params.W3;
-    BBox.Max = BBox.Min + GridLeft.Dims3*Params.W3 - 1;
-    for (int DD = 0; DD < 3; ++DD) {
-      while (BBox.Max[DD] > BBox.Min[DD]) {
-        i32 M = (BBox.Max[DD]+BBox.Min[DD]) >> 1;
-        bool Left = Read(&BlockStream);
-        if (Left) BBox.Max[DD] = M; else BBox.Min[DD] = M+1;
-      }
+    Left->Count = K;
+    NParticlesDecoded += K;
+    vec3i Pos = DecodeLeaf(GridLeft);
+    FOR(i64, I, 0, K) {
+      Particles.push_back(particle_int{.Pos = Pos});
+      if (Params.NAttrs > 0)
+        DecodeParticleAttributes();
     }
 #if defined(PREDICTION) || defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   } else if (S >= 1) { //recurse
@@ -2686,31 +3370,41 @@ DecodeTreeIntPredict(
     if (Split == SpatialSplit)
       Left = DecodeTreeIntPredict(PredNode?PredNode->Left:nullptr, Particles, Begin, Mid, S, GridLeft, NextSplit, ResLvl, Depth+1);
     else if (Split == ResolutionSplit)
+#if defined(TIME_PREDICT)
+      Left = DecodeTreeIntPredict(PredNode?PredNode->Left:nullptr, Particles, Begin, Mid, S, GridLeft, NextSplit, ResLvl+1, Depth+1);
+#else
       Left = DecodeTreeIntPredict(nullptr, Particles, Begin, Mid, S, GridLeft, NextSplit, ResLvl+1, Depth+1);
+#endif
   }
 
   /* recurse on the right */
   tree* Right = nullptr;
+  i8 ParentLevel = StreamLevel, RightLevel = RightChildLevel(Split, ResLvl);
+  if (RightLevel > Params.MaxLevel || (RightLevel > 0 && Budget.Deadline > 0 && BudgetExpired())) {
+    if (Budget.Fill)
+      GenerateParticlesInt(Left, Particles, FillCount(EstimateCount(Left, R), RightLevel), GridRight, Depth+1);
+    R = 0; // the level is not decoded, as if the right child were empty
+  } else if (RightLevel >= 0 && R >= 1) {
+    SwitchStreamLevel(RightLevel);
+    AttrPred = AttrMean;
+  }
 #if defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   if (R == 1) {
 #elif defined(PREDICTION)
-  if (R==1 && CellCountRight==1) {
+  if (R>=1 && CellCountRight==1) {
+    assert(Depth+1 == Params.MaxDepth);
 #elif defined(NORMAL) || defined(SOTA) || defined(BINOMIAL)
   if (Mid+1 == End) {
 #endif
-    assert(Depth+1 == Params.MaxDepth);
+    i64 K = DecodeMultiplicity(R);
     Right = new (TreePtr++) tree;
-    Right->Count = 1;
-    ++NParticlesDecoded;
-    bbox_int BBox;
-    BBox.Min = Params.BBoxInt.Min + GridRight.From3*Params.W3; 
-    BBox.Max = BBox.Min + GridRight.Dims3*Params.W3 - 1;
-    for (int DD = 0; DD < 3; ++DD) {
-      while (BBox.Max[DD] > BBox.Min[DD]) {
-        i32 M = (BBox.Max[DD]+BBox.Min[DD]) >> 1;
-        bool Left = Read(&BlockStream);
-        if (Left) BBox.Max[DD] = M; else BBox.Min[DD] = M+1;
-      }
+    Right->Count = K;
+    NParticlesDecoded += K;
+    vec3i Pos = DecodeLeaf(GridRight);
+    FOR(i64, I, 0, K) {
+      Particles.push_back(particle_int{.Pos = Pos});
+      if (Params.NAttrs > 0)
+        DecodeParticleAttributes();
     }
 #if defined(PREDICTION) || defined(LIGHT_PREDICT) ||defined(TIME_PREDICT)
   } else if (R >= 1) { //recurse
@@ -2722,15 +3416,20 @@ DecodeTreeIntPredict(
     if (Split == SpatialSplit)
       Right = DecodeTreeIntPredict(PredNode?PredNode->Right:nullptr, Particles, Mid, End, R, GridRight, NextSplit, ResLvl, Depth+1);
     else if (Split == ResolutionSplit)
+#if defined(TIME_PREDICT)
+      Right = DecodeTreeIntPredict(PredNode?PredNode->Right:nullptr, Particles, Mid, End, R, GridRight, NextSplit, ResLvl+1, Depth+1);
+#else
       Right = DecodeTreeIntPredict(Left, Particles, Mid, End, R, GridRight, NextSplit, ResLvl+1, Depth+1);
+#endif
   }
+  SwitchStreamLevel(ParentLevel);
 
   /* construct the prediction tree */
   tree* Node = nullptr;
 #if defined(PREDICTION)
   if (Split == ResolutionSplit) {
     Node = BuildPredTree(Left, Right, Depth, D);
-    assert(Node && Node->Count>0);
+    assert(Node);
   } else if (Split == SpatialSplit) {
     if (Depth > Params.StartResolutionSplit) {
       Node = new (TreePtr++) tree;
@@ -2745,6 +3444,14 @@ DecodeTreeIntPredict(
     *TreePtr = *Node;
     Node = TreePtr++;
   }
+#elif defined(TIME_PREDICT)
+  if (Left || Right) {
+    Node = new (TreePtr++) tree;
+    Node->Left = Left;
+    Node->Right = Right;
+    if (Left ) Node->Count = Left->Count; else Node->Count = 0;
+    if (Right) Node->Count += Right->Count;
+  }
 #endif
 
   return Node;
@@ -2762,6 +3469,9 @@ BuildTreeIntPredict(
   assert(Depth <= Params.MaxDepth);
   i64 N = End - Begin; // total number of particles
   assert(Msb(u64(N))+1 == T);
+  STAT_NODE(Depth, ResLvl);
+  if (CanCollapse(Grid))
+    return EncodeCollapsedNode(Particles, Begin, End, T, Grid);
   i64 CellCount = i64(Grid.Dims3.x) * i64(Grid.Dims3.y) * i64(Grid.Dims3.z);
   //if (CellCount == N) return nullptr;
   i8 D = Params.DimsStr[Depth] - 'x';
@@ -2769,21 +3479,23 @@ BuildTreeIntPredict(
   /* split in either resolution or precision */
   i64 Mid = Begin;
   i32 MM = Grid.From3[D]; // the beginning of the right child
+  stage_scope PartitionScope(stage::Partition, StageTimer.Sampling);
   if (Split == ResolutionSplit) {
     auto RPred = [D, &Grid](const particle_int& P) {
       i32 Bin = (P.Pos[D]-Params.BBoxInt.Min[D]) / Params.W3[D];
       Bin = (Bin-Grid.From3[D]) / Grid.Stride3[D];
       return IS_EVEN(Bin);
     };
-    Mid = std::partition(RANGE(Particles, Begin, End), RPred) - Particles.begin();
+    Mid = PartitionParticles(Particles, Begin, End, RPred);
   } else if (Split == SpatialSplit) {
     MM = Grid.From3[D] + (((Grid.Dims3[D]+1)>>1)-1) * Grid.Stride3[D];
     auto SPred = [MM, D, &Grid](const particle_int& P) {
       i32 Bin = (P.Pos[D]-Params.BBoxInt.Min[D]) / Params.W3[D];
       return Bin <= MM;
     };
-    Mid = std::partition(RANGE(Particles, Begin, End), SPred) - Particles.begin();
+    Mid = PartitionParticles(Particles, Begin, End, SPred);
   }
+  PartitionScope.End();
 
   /* encode */
   auto GridLeft  = SplitGrid(Grid, D, Split, side::Left );
@@ -2794,6 +3506,7 @@ BuildTreeIntPredict(
   i64 P = Mid - Begin;
   i8 S = Msb(u32(P)) + 1;
   i8 R = Msb(u32(N-P)) + 1;
+  stage_scope ContextScope(stage::ContextModel, StageTimer.Sampling);
 #if defined(BINOMIAL)
   f64 Mean = f64(N) / 2; // mean
   f64 StdDev = sqrt(f64(N)) / 2; // standard deviation
@@ -2812,7 +3525,7 @@ BuildTreeIntPredict(
 #elif defined(LIGHT_PREDICT)
   bool FullGrid = (T>0) && (1<<(T-1))==CellCount;
   bool EncodeEmptyCells = false;
-  u32 CIdx = ResLvl*Params.NLevels + Depth;    
+  u32 CIdx = ContextIndex(ResLvl, Depth);
   //u32 CIdx = Depth;
   if (!FullGrid && T>0) { // no prediction, try 1-context
     if (ContextTS[CIdx][T][S+1] == 0) {
@@ -2852,7 +3565,7 @@ BuildTreeIntPredict(
   }
 #elif defined(PREDICTION) || defined(TIME_PREDICT)
   //static int SRCounter = 0;
-  bool FullGrid = (T>0) && (1<<(T-1))==CellCount;
+  bool FullGrid = !Params.Multiplicity && (T>0) && (1<<(T-1))==CellCount; // with repeated positions N can exceed CellCount
   bool EncodeEmptyCells = false;
   //if ((1<<T) >= CellCount) { // more particles than empty cells
   //  EncodeEmptyCells= true;
@@ -2863,17 +3576,19 @@ BuildTreeIntPredict(
   //  REQUIRE(T >= S);
   //  REQUIRE(T >= R);
   //}
-  u32 CIdx = ResLvl*Params.NLevels + Depth;    
+  u32 CIdx = ContextIndex(ResLvl, Depth);
   //u32 CIdx = Depth;
-  if (!FullGrid && T>0 && PredNode /*&& (PredNode->Count > 1)*/) { // predict P
+  if (!FullGrid && T>0 && PredNode && (PredNode->Left || PredNode->Right)) { // predict P (collapsed nodes have no children)
     i64 M = PredNode->Count;
     i64 K = PredNode->Left?PredNode->Left->Count : M - PredNode->Right->Count;
     if (EncodeEmptyCells)  { K= CellCountLeft - K; M = CellCount - M; }
     i8 MM = Msb(u64(M)) + 1;
     i8 KK = Msb(u64(K)) + 1;
     u32 C = T*(ContextMax+2)*(ContextMax+2) + MM*(ContextMax+2) + KK;
+    STAT_SYMBOL(stat_class::S, stat_table::S, CIdx, T, MM, KK);
     if (ContextS[CIdx][T][MM][KK][S+1] == 0) { // no 2-context
       //ContextS[CIdx][C][0] = 1;
+      STAT_ESCAPE();
       ContextS[CIdx][T][MM][KK][0] = 1;
       EncodeWithContext(T, 0, ContextS[CIdx][T][MM][KK].data(), &Coder);
       //EncodeCenteredMinimal(S, T+1, &BlockStream);
@@ -2887,7 +3602,9 @@ BuildTreeIntPredict(
     //++ContextTS[CIdx][T][S+1];
   } else 
   if (!FullGrid && T>0) { // no prediction, try 1-context
+    STAT_SYMBOL(stat_class::S, stat_table::TS, CIdx, T);
     if (ContextTS[CIdx][T][S+1] == 0) {
+      STAT_ESCAPE();
       ContextTS[CIdx][T][0] = 1;
       EncodeWithContext(T, 0, ContextTS[CIdx][T].data(), &Coder); // TODO: make faster
       //EncodeCenteredMinimal(S, T+1, &BlockStream);  // TODO: try the binomial one
@@ -2909,11 +3626,13 @@ BuildTreeIntPredict(
     } else if (S == 0) {
       assert(R == T);
     } else {
+      STAT_SYMBOL(stat_class::R, stat_table::R, CIdx, T, S);
       if (ContextR[CIdx][T][S][R+1] == 0) {
+        STAT_ESCAPE();
         ContextR[CIdx][T][S][0] = 1;
         EncodeWithContext(T, 0, ContextR[CIdx][T][S].data(), &Coder); // TODO: make faster
         //EncodeCenteredMinimal(R, T+1, &BlockStream);
-        EncodeUniform(T, S, &Coder);
+        EncodeUniform(T, R, &Coder);
         //EncodeGeometric(T, R, &Coder);
       } else { // there is a context
         ContextR[CIdx][T][S][0] = 1;
@@ -2923,13 +3642,18 @@ BuildTreeIntPredict(
     }    
   }
 #endif
+  ContextScope.End();
   //SRList.push_back(vec2i{S, R});
   //++SRCounter;
 
   tree* SaveTreePtr = nullptr;
+  trace_scope BlockTrace(Depth == Params.StartResolutionSplit, "block", "block", BlockCount+1);
+  stage_scope BlockScope(stage::BlockCoding, Depth == Params.StartResolutionSplit);
   if (Depth == Params.StartResolutionSplit) { // beginning of block
     SaveTreePtr = TreePtr;
     ++BlockCount;
+    if (Params.NAttrs > 0)
+      EncodeBlockAttributeMean(Begin, End);
     //REQUIRE(Split == ResolutionSplit);
     //FOR_EACH(Context, ContextS ) { Context->clear(); }
     //FOR_EACH(Context, ContextTS) { Context->clear(); }
@@ -2946,31 +3670,24 @@ BuildTreeIntPredict(
 #if defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   if (S == 1) {
 #elif defined(PREDICTION)
-  if (S==1 && CellCountLeft==1) {
+  if (S>=1 && CellCountLeft==1) {
     assert(Depth+1 == Params.MaxDepth);
 #elif defined(NORMAL) || defined(SOTA) || defined(BINOMIAL)
   if (Begin+1 == Mid) {
 #endif
-    assert(Begin+1 == Mid);
+    i64 K = Mid - Begin; // more than one only for repeated positions
+    assert(K == 1 || Params.Multiplicity);
 #if defined(PREDICTION) || defined(TIME_PREDICT)
     Left = new (TreePtr++) tree;
-    Left->Count = 1;
+    Left->Count = K;
     ++NumNodeAllocated;
 #endif
-    ++NParticlesDecoded;
-    bbox_int BBox;
-    BBox.Min = Params.BBoxInt.Min + GridLeft.From3*Params.W3;
-    BBox.Max = BBox.Min + GridLeft.Dims3*Params.W3 - 1;
-    for (int DD = 0; DD < 3; ++DD) {
-      while (BBox.Max[DD] > BBox.Min[DD]) {
-        //REQUIRE(BBox.Min[DD] <= Particles[Begin].Pos[DD]);
-        //REQUIRE(BBox.Max[DD] >= Particles[Begin].Pos[DD]);
-        i32 M = (BBox.Max[DD]+BBox.Min[DD]) >> 1;
-        bool Left = Particles[Begin].Pos[DD] <= M;
-        if (Left) BBox.Max[DD] = M; else BBox.Min[DD] = M+1;
-        Write(&BlockStream, Left);
-      }
-    }
+    NParticlesDecoded += K;
+    STAT_NODE(Depth+1, ResLvl);
+    EncodeMultiplicity(K, S);
+    EncodeLeaf(Particles[Begin].Pos, GridLeft);
+    if (Params.NAttrs > 0)
+      FOR(i64, I, Begin, Mid) { EncodeParticleAttributes(I); }
 #if defined(PREDICTION) || defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   } else if (S >= 1) { //recurse
 #elif defined(NORMAL) || defined(SOTA) || defined(BINOMIAL)
@@ -2999,34 +3716,33 @@ BuildTreeIntPredict(
 
   /* recurse on the right */
   tree* Right = nullptr;
+  i8 ParentLevel = StreamLevel, RightLevel = RightChildLevel(Split, ResLvl);
+  if (RightLevel >= 0 && R >= 1) {
+    SwitchStreamLevel(RightLevel);
+    AttrPred = AttrMean;
+    LevelStates[RightLevel].NParticles += End - Mid;
+  }
 #if defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   if (R == 1) {
 #elif defined(PREDICTION)
-  if (R==1 && CellCountRight==1) {
+  if (R>=1 && CellCountRight==1) {
     assert(Depth+1 == Params.MaxDepth);
 #elif defined(NORMAL) || defined(SOTA) || defined(BINOMIAL)
   if (Mid+1 == End) {
 #endif
-    assert(Mid+1 == End);
+    i64 K = End - Mid; // more than one only for repeated positions
+    assert(K == 1 || Params.Multiplicity);
 #if defined(PREDICTION) || defined(TIME_PREDICT)
     Right = new (TreePtr++) tree;
-    Right->Count = 1;
+    Right->Count = K;
     ++NumNodeAllocated;
 #endif
-    ++NParticlesDecoded;
-    bbox_int BBox;
-    BBox.Min = Params.BBoxInt.Min + GridRight.From3*Params.W3; 
-    BBox.Max = BBox.Min + GridRight.Dims3*Params.W3 - 1;
-    for (int DD = 0; DD < 3; ++DD) {
-      while (BBox.Max[DD] > BBox.Min[DD]) {
-        //REQUIRE(BBox.Min[DD] <= Particles[Mid].Pos[DD]);
-        //REQUIRE(BBox.Max[DD] >= Particles[Mid].Pos[DD]);
-        i32 M = (BBox.Max[DD]+BBox.Min[DD]) >> 1;
-        bool Left = Particles[Mid].Pos[DD] <= M;
-        if (Left) BBox.Max[DD] = M; else BBox.Min[DD] = M+1;
-        Write(&BlockStream, Left);
-      }
-    }
+    NParticlesDecoded += K;
+    STAT_NODE(Depth+1, ResLvl);
+    EncodeMultiplicity(K, R);
+    EncodeLeaf(Particles[Mid].Pos, GridRight);
+    if (Params.NAttrs > 0)
+      FOR(i64, I, Mid, End) { EncodeParticleAttributes(I); }
 #if defined(PREDICTION) || defined(LIGHT_PREDICT) || defined(TIME_PREDICT)
   } else if (R >= 1) { //recurse
 #elif defined(NORMAL) || defined(SOTA) || defined(BINOMIAL)
@@ -3050,6 +3766,7 @@ BuildTreeIntPredict(
       Right = BuildTreeIntPredict(Left, Particles, Mid, End, R, GridRight, NextSplit, ResLvl+1, Depth+1);
 #endif
   }
+  SwitchStreamLevel(ParentLevel);
 
   /* construct the prediction tree */
   tree* Node = nullptr; // TODO: try to move this to the beginning and see if that improves performance?
@@ -3084,6 +3801,408 @@ BuildTreeIntPredict(
   return Node;
 }
 
+/* The split of a chunk's root: the same as in the unchunked tree, whose splits above Params.ChunkDepth
+are all spatial */
+INLINE static split_type
+ChunkSplit() { return Params.ChunkDepth==Params.StartResolutionSplit ? ResolutionSplit : SpatialSplit; }
+
+/* Chunked coding (encode --chunk_depth): partition the particles spatially down to Params.ChunkDepth,
+coding nothing on the way, then code each non-empty subtree there on its own (see chunk_meta). The
+segments are appended to the open "chunks" section of Out. */
+static void
+BuildTreeChunks(std::vector<particle_int>& Particles, i64 Begin, i64 End, const grid_int& Grid, i8 Depth,
+                container_writer* Out, std::vector<chunk_meta>* Chunks) {
+  if (Begin == End)
+    return;
+  if (Depth == Params.ChunkDepth) {
+    TRACE_SCOPE("chunk", "chunk", i64(Chunks->size()));
+    ResetContexts();
+    InitAttributeCoder();
+    tree* SaveTreePtr = TreePtr; // nothing outside the chunk predicts from its tree
+    BuildTreeIntPredict(nullptr, Particles, Begin, End, Msb(u64(End-Begin))+1, Grid, ChunkSplit(), 0, Depth);
+    TreePtr = SaveTreePtr;
+    Coder.EncodeFinalize();
+    Flush(&BlockStream);
+    chunk_meta Chunk;
+    Chunk.Grid = Grid;
+    Chunk.NParticles = End - Begin;
+    Chunk.Offset = Out->Open->Bytes;
+    Chunk.BlockStreamSize = Size(BlockStream);
+    Chunk.CoderStreamSize = Size(Coder.BitStream);
+    Chunk.Checksum = HashBytes(Coder.BitStream.Stream.Data, Chunk.CoderStreamSize,
+                               HashBytes(BlockStream.Stream.Data, Chunk.BlockStreamSize));
+    {
+      TIME_STAGE(stage::FileWrite);
+      AppendSection(Out, BlockStream.Stream.Data, Chunk.BlockStreamSize);
+      AppendSection(Out, Coder.BitStream.Stream.Data, Chunk.CoderStreamSize);
+    }
+    Chunks->push_back(Chunk);
+    Rewind(&BlockStream);
+    Coder.RewindWrite();
+    return;
+  }
+  i8 D = Params.DimsStr[Depth] - 'x';
+  i32 MM = Grid.From3[D] + (((Grid.Dims3[D]+1)>>1)-1) * Grid.Stride3[D];
+  auto SPred = [MM, D](const particle_int& P) {
+    i32 Bin = (P.Pos[D]-Params.BBoxInt.Min[D]) / Params.W3[D];
+    return Bin <= MM;
+  };
+  i64 Mid = PartitionParticles(Particles, Begin, End, SPred);
+  BuildTreeChunks(Particles, Begin, Mid, SplitGrid(Grid, D, SpatialSplit, side::Left ), Depth+1, Out, Chunks);
+  BuildTreeChunks(Particles, Mid  , End, SplitGrid(Grid, D, SpatialSplit, side::Right), Depth+1, Out, Chunks);
+}
+
+/* LRU cache of decoded chunks (decode --chunk_cache MB), so that the regions of one decode (several
+--roi) that share a chunk read and decode it only once. A chunk whose box spans at most 2^16 on every
+axis keeps its positions as u16 offsets from the box's corner, half the bytes of particle_int, so more
+chunks fit in the budget. */
+struct chunk_cache {
+  i64 Budget = i64(256) << 20; // bytes; 0 disables the cache
+  i64 Used = 0;
+  i64 Hits = 0, Misses = 0;
+  i64 NCompact = 0; // of the chunks cached
+  struct entry {
+    i64 Chunk = 0; // index in the chunk index
+    vec3i Origin = vec3i(0); // the min corner of the chunk's box
+    std::vector<u16> Offsets; // x y z per particle, from Origin, if the box is small enough
+    std::vector<particle_int> Particles; // otherwise
+    std::vector<i32> Attributes;
+  };
+  std::list<entry> Lru; // most recently used first
+  std::unordered_map<i64, std::list<entry>::iterator> Index;
+};
+static chunk_cache ChunkCache;
+
+static i64
+ChunkFootprint(const chunk_cache::entry& E) {
+  return (i64)sizeof(E) + (i64)E.Offsets.size()*sizeof(u16) + (i64)E.Particles.size()*sizeof(particle_int) +
+         (i64)E.Attributes.size()*sizeof(i32) + 64;
+}
+
+/* Append a cached chunk to ParticlesInt and Attributes, return false on a miss */
+static bool
+FetchCachedChunk(i64 Chunk) {
+  auto It = ChunkCache.Index.find(Chunk);
+  if (It == ChunkCache.Index.end()) {
+    ++ChunkCache.Misses;
+    return false;
+  }
+  ++ChunkCache.Hits;
+  ChunkCache.Lru.splice(ChunkCache.Lru.begin(), ChunkCache.Lru, It->second);
+  const chunk_cache::entry& E = *It->second;
+  ParticlesInt.insert(ParticlesInt.end(), E.Particles.begin(), E.Particles.end());
+  for (size_t I = 0; I < E.Offsets.size(); I += 3)
+    ParticlesInt.push_back(particle_int{E.Origin + vec3i(E.Offsets[I], E.Offsets[I+1], E.Offsets[I+2])});
+  Attributes.insert(Attributes.end(), E.Attributes.begin(), E.Attributes.end());
+  return true;
+}
+
+/* Remember the chunk just decoded (the particles from Begin on), evicting the least recently used ones */
+static void
+CacheChunk(i64 Chunk, const bbox_int& Box, i64 Begin) {
+  chunk_cache::entry E;
+  E.Chunk = Chunk;
+  E.Origin = Box.Min;
+  vec3i Span = Box.Max - Box.Min;
+  if (Span.x <= 0xFFFF && Span.y <= 0xFFFF && Span.z <= 0xFFFF) {
+    E.Offsets.reserve((ParticlesInt.size() - Begin) * 3);
+    FOR(i64, I, Begin, i64(ParticlesInt.size())) {
+      vec3i O = ParticlesInt[I].Pos - Box.Min;
+      E.Offsets.insert(E.Offsets.end(), { u16(O.x), u16(O.y), u16(O.z) });
+    }
+  } else {
+    E.Particles.assign(ParticlesInt.begin() + Begin, ParticlesInt.end());
+  }
+  E.Attributes.assign(Attributes.begin() + Begin*Params.NAttrs, Attributes.end());
+  i64 Bytes = ChunkFootprint(E);
+  if (Bytes > ChunkCache.Budget || ChunkCache.Index.count(Chunk))
+    return;
+  while (ChunkCache.Used + Bytes > ChunkCache.Budget) {
+    ChunkCache.Used -= ChunkFootprint(ChunkCache.Lru.back());
+    ChunkCache.Index.erase(ChunkCache.Lru.back().Chunk);
+    ChunkCache.Lru.pop_back();
+  }
+  ChunkCache.Lru.push_front(std::move(E));
+  ChunkCache.Index[Chunk] = ChunkCache.Lru.begin();
+  ChunkCache.Used += Bytes;
+  ChunkCache.NCompact += !ChunkCache.Lru.front().Offsets.empty();
+}
+
+/* Background reads of the next chunks a region decode needs (decode --prefetch D reads D chunks ahead),
+so that the file latency overlaps with decoding. The I/O threads only pread into their own buffers; a
+chunk still queued when it is needed is taken back and read by the caller. */
+struct prefetch_job {
+  enum state : u8 { Queued, Running, Done, Failed };
+  state State = Queued;
+  i64 Offset = 0, NBytes = 0;
+  std::vector<byte> Bytes;
+};
+struct chunk_prefetcher {
+  int Depth = 0; // number of chunks read ahead, 0 disables prefetching
+  int NThreads = 4;
+  i64 Issued = 0, Used = 0;
+  i64 Ready = 0; // of the used reads, those done before the decoder needed them (overlapped with decoding)
+  std::vector<std::thread> Workers;
+  std::mutex Mutex;
+  std::condition_variable Wake, Finished;
+  bool Stop = false;
+  std::deque<i64> Queue;
+  std::unordered_map<i64, std::unique_ptr<prefetch_job>> Jobs; // by chunk index
+  ~chunk_prefetcher() {
+    { std::lock_guard<std::mutex> Lock(Mutex); Stop = true; }
+    Wake.notify_all();
+    for (auto& W : Workers) W.join();
+  }
+};
+static chunk_prefetcher Prefetcher;
+
+static void
+PrefetchWorker() {
+  chunk_prefetcher& P = Prefetcher;
+  std::unique_lock<std::mutex> Lock(P.Mutex);
+  while (true) {
+    P.Wake.wait(Lock, [&P] { return P.Stop || !P.Queue.empty(); });
+    if (P.Stop)
+      return;
+    i64 Chunk = P.Queue.front();
+    P.Queue.pop_front();
+    auto It = P.Jobs.find(Chunk);
+    if (It == P.Jobs.end() || It->second->State != prefetch_job::Queued)
+      continue; // taken back by the caller
+    prefetch_job* J = It->second.get();
+    J->State = prefetch_job::Running;
+    Lock.unlock();
+    J->Bytes.resize(J->NBytes);
+    bool Ok = ReadAt(Dataset.Fd, J->Bytes.data(), J->NBytes, J->Offset) == J->NBytes;
+    Lock.lock();
+    J->State = Ok ? prefetch_job::Done : prefetch_job::Failed;
+    P.Finished.notify_all();
+  }
+}
+
+/* Queue the reads of the segments of Next (chunk indices) that are not in flight yet */
+static void
+PrefetchChunks(const std::vector<chunk_meta>& Chunks, i64 SegmentsOffset, const i64* Next, i64 NNext) {
+  chunk_prefetcher& P = Prefetcher;
+  if (P.Depth <= 0 || NNext <= 0)
+    return;
+  TRACE_SCOPE("prefetch");
+  std::unique_lock<std::mutex> Lock(P.Mutex);
+  bool Added = false;
+  FOR(i64, I, 0, NNext) {
+    if (P.Jobs.count(Next[I]))
+      continue;
+    const chunk_meta& C = Chunks[Next[I]];
+    auto J = std::make_unique<prefetch_job>();
+    J->Offset = SegmentsOffset + C.Offset;
+    J->NBytes = C.BlockStreamSize + C.CoderStreamSize;
+    P.Jobs[Next[I]] = std::move(J);
+    P.Queue.push_back(Next[I]);
+    ++P.Issued;
+    Added = true;
+  }
+  Lock.unlock();
+  if (Added) {
+    if (P.Workers.empty())
+      FOR(int, T, 0, (MAX(P.NThreads, 1)))
+        P.Workers.emplace_back(PrefetchWorker);
+    P.Wake.notify_all();
+  }
+}
+
+/* Copy a prefetched chunk segment to BlockStream and Coder, waiting if its read is under way. Return false
+if the chunk was not prefetched (or is still queued, then it is taken back), so the caller reads it. */
+static bool
+TakePrefetchedChunk(i64 Chunk, const chunk_meta& C) {
+  chunk_prefetcher& P = Prefetcher;
+  if (P.Depth <= 0)
+    return false;
+  std::unique_lock<std::mutex> Lock(P.Mutex);
+  auto It = P.Jobs.find(Chunk);
+  if (It == P.Jobs.end())
+    return false;
+  prefetch_job* J = It->second.get();
+  P.Ready += J->State == prefetch_job::Done;
+  P.Finished.wait(Lock, [J] { return J->State != prefetch_job::Running; });
+  bool Ok = J->State == prefetch_job::Done;
+  if (Ok) {
+    memcpy(BlockStream.Stream.Data, J->Bytes.data(), C.BlockStreamSize);
+    memcpy(Coder.BitStream.Stream.Data, J->Bytes.data() + C.BlockStreamSize, C.CoderStreamSize);
+    ++P.Used;
+  }
+  P.Jobs.erase(It);
+  return Ok;
+}
+
+/* Decode the chunks of a chunked tree that overlap Query (or take them from ChunkCache), then keep the
+particles (and attributes) inside Query. Query is in the same integer coordinates as the particles. The
+chunks are independent, but they are decoded one at a time: the decoder's state (Coder, BlockStream, the
+contexts and the tree pool) is global. Only their reads overlap with decoding (see chunk_prefetcher). */
+static void
+DecodeRegion(const bbox_int& Query) {
+  const container_section* Segments = FindSection(Dataset, "chunks");
+  const container_section* Index = FindSection(Dataset, "chunk-index");
+  if (!Segments || !Index)
+    EXIT_ERROR("the dataset is not chunked");
+  std::vector<chunk_meta> Chunks;
+  if (!ReadChunkIndex(Dataset, *Index, &Chunks))
+    EXIT_ERROR("the chunk index is corrupt");
+  std::vector<i64> ToRead; // the chunks to decode, in order, for the prefetcher
+  FOR(i64, I, 0, i64(Chunks.size())) {
+    if (Overlaps(GridBBox(Chunks[I].Grid), Query) && !ChunkCache.Index.count(I))
+      ToRead.push_back(I);
+  }
+  i64 NDecoded = 0, NCached = 0, BytesRead = 0;
+  FOR_EACH(Chunk, Chunks) {
+    if (!Overlaps(GridBBox(Chunk->Grid), Query))
+      continue;
+    i64 ChunkIdx = Chunk - Chunks.begin();
+    TRACE_SCOPE("chunk", "chunk", ChunkIdx);
+    if (FetchCachedChunk(ChunkIdx)) {
+      ++NCached;
+      continue;
+    }
+    i64 Next = std::upper_bound(ToRead.begin(), ToRead.end(), ChunkIdx) - ToRead.begin(); // the chunks after this one
+    PrefetchChunks(Chunks, Segments->Offset, ToRead.data() + Next, MIN(i64(ToRead.size()) - Next, i64(Prefetcher.Depth)));
+    i64 Begin = ParticlesInt.size();
+    if (BlockStream.Stream.Data) DeallocBuf(&BlockStream.Stream);
+    if (Coder.BitStream.Stream.Data) DeallocBuf(&Coder.BitStream.Stream);
+    /* pad with zeros since Refill() always loads a whole u64 and the arithmetic decoder reads one register ahead */
+    CallocBuf(&BlockStream.Stream, Chunk->BlockStreamSize + 2*sizeof(u64));
+    CallocBuf(&Coder.BitStream.Stream, Chunk->CoderStreamSize + 2*sizeof(u64));
+    {
+      TIME_STAGE(stage::FileRead);
+      i64 Offset = Segments->Offset + Chunk->Offset;
+      if (!TakePrefetchedChunk(ChunkIdx, *Chunk) &&
+          (ReadAt(Dataset.Fd, BlockStream.Stream.Data, Chunk->BlockStreamSize, Offset) != Chunk->BlockStreamSize ||
+           ReadAt(Dataset.Fd, Coder.BitStream.Stream.Data, Chunk->CoderStreamSize, Offset + Chunk->BlockStreamSize) != Chunk->CoderStreamSize))
+        EXIT_ERROR("a chunk is corrupt");
+      if (HashBytes(Coder.BitStream.Stream.Data, Chunk->CoderStreamSize,
+                    HashBytes(BlockStream.Stream.Data, Chunk->BlockStreamSize)) != Chunk->Checksum)
+        EXIT_ERROR("a chunk is corrupt");
+    }
+    Coder.InitRead();
+    InitRead(&BlockStream, BlockStream.Stream);
+    ResetContexts();
+    InitAttributeCoder();
+    tree* SaveTreePtr = TreePtr;
+    DecodeTreeIntPredict(nullptr, ParticlesInt, 0, Chunk->NParticles, Msb(u64(Chunk->NParticles))+1, Chunk->Grid, ChunkSplit(), 0, Params.ChunkDepth);
+    TreePtr = SaveTreePtr;
+    CacheChunk(ChunkIdx, GridBBox(Chunk->Grid), Begin);
+    ++NDecoded;
+    BytesRead += Chunk->BlockStreamSize + Chunk->CoderStreamSize;
+  }
+  printf("decoded %lld of %zu chunks (%lld bytes), %lld more from the cache\n", NDecoded, Chunks.size(), BytesRead, NCached);
+  /* the chunks on the border of the query also hold particles outside of it */
+  int NC = Params.NAttrs;
+  i64 NKept = 0;
+  FOR(i64, I, 0, i64(ParticlesInt.size())) {
+    if (!Inside(ParticlesInt[I].Pos, Query))
+      continue;
+    ParticlesInt[NKept] = ParticlesInt[I];
+    FOR(int, C, 0, NC) { Attributes[NKept*NC + C] = Attributes[I*NC + C]; }
+    ++NKept;
+  }
+  ParticlesInt.resize(NKept);
+  Attributes.resize(NKept * NC);
+}
+
+/* Level streams: the sub-streams of levels 1 and up have the same capacity as that of level 0 */
+static void
+InitLevelStreamsWrite() {
+  TIME_STAGE(stage::Allocation);
+  InitLevelStates();
+  FOR(i8, L, 1, Params.NLevels) {
+    InitWrite(&LevelStates[L].BlockStream, BlockStream.Stream.Bytes);
+    LevelStates[L].Coder.InitWrite(Coder.BitStream.Stream.Bytes);
+  }
+}
+
+/* Write the index of the level sub-streams, then the sub-streams, coarsest first. Level 0 is in the
+globals and already finalized. Return the total size of the sub-streams. */
+static i64
+WriteLevelStreams(container_writer* Out) {
+  REQUIRE(StreamLevel == 0);
+  SwapLevelState(&LevelStates[0]); // park level 0 with the others
+  std::vector<level_stream_meta> Levels(Params.NLevels);
+  i64 Offset = 0;
+  LevelStates[0].NParticles = NParticlesDecoded; // all the particles coded, less those of the finer levels
+  FOR(i8, L, 1, Params.NLevels) { LevelStates[0].NParticles -= LevelStates[L].NParticles; }
+  FOR(i8, L, 0, Params.NLevels) {
+    level_state& S = LevelStates[L];
+    if (L > 0) {
+      S.Coder.EncodeFinalize();
+      Flush(&S.BlockStream);
+    }
+    level_stream_meta& Meta = Levels[L];
+    Meta.Offset = Offset;
+    Meta.BlockStreamSize = Size(S.BlockStream);
+    Meta.CoderStreamSize = Size(S.Coder.BitStream);
+    Meta.Checksum = HashBytes(S.Coder.BitStream.Stream.Data, Meta.CoderStreamSize,
+                              HashBytes(S.BlockStream.Stream.Data, Meta.BlockStreamSize));
+    Meta.NParticles = S.NParticles;
+    Offset += Meta.BlockStreamSize + Meta.CoderStreamSize;
+    printf("Level %d stream size                 = %lld\n", L, Meta.BlockStreamSize + Meta.CoderStreamSize);
+  }
+  WriteSection(Out, "level-index", Levels.data(), Levels.size() * sizeof(level_stream_meta));
+  BeginSection(Out, "levels");
+  FOR(i8, L, 0, Params.NLevels) {
+    const level_state& S = LevelStates[L];
+    AppendSection(Out, S.BlockStream.Stream.Data, Levels[L].BlockStreamSize);
+    AppendSection(Out, S.Coder.BitStream.Stream.Data, Levels[L].CoderStreamSize);
+  }
+  EndSection(Out);
+  SwapLevelState(&LevelStates[0]);
+  return Offset;
+}
+
+/* Read the sub-streams of levels 0 to Params.MaxLevel, which are a prefix of the "levels" section, and
+start those of levels 1 and up. Level 0 is left in the globals, to be started like a single stream. */
+static void
+ReadLevelStreams() {
+  const container_section* Streams = FindSection(Dataset, "levels");
+  const container_section* Index = FindSection(Dataset, "level-index");
+  if (!Streams || !Index || Index->Bytes != Params.NLevels*i64(sizeof(level_stream_meta)))
+    EXIT_ERROR("the dataset has no level streams");
+  std::vector<level_stream_meta> Levels(Params.NLevels);
+  if (!ReadSection(Dataset, *Index, Levels.data()))
+    EXIT_ERROR("the level index is corrupt");
+  InitLevelStates();
+  SwapLevelState(&LevelStates[0]); // park level 0 so that all levels are read the same way
+  i8 NRead = i8((MIN(i32(Params.MaxLevel), Params.NLevels-1)) + 1);
+  if (Budget.MaxBytes > 0) { // the levels that fit in the budget, but at least level 0
+    i64 Bytes = Levels[0].BlockStreamSize + Levels[0].CoderStreamSize;
+    i8 NFit = 1;
+    while (NFit < NRead && (Bytes += Levels[NFit].BlockStreamSize + Levels[NFit].CoderStreamSize) <= Budget.MaxBytes)
+      ++NFit;
+    NRead = NFit;
+    Params.MaxLevel = NRead - 1;
+  }
+  Budget.LevelFill.assign(Params.NLevels, 0);
+  FOR(i8, L, NRead, Params.NLevels) { Budget.LevelFill[L] = Levels[L].NParticles; }
+  i64 BytesRead = 0;
+  FOR(i8, L, 0, NRead) {
+    level_state& S = LevelStates[L];
+    const level_stream_meta& Meta = Levels[L];
+    /* pad with zeros since Refill() always loads a whole u64 and the arithmetic decoder reads one register ahead */
+    CallocBuf(&S.BlockStream.Stream, Meta.BlockStreamSize + 2*sizeof(u64));
+    CallocBuf(&S.Coder.BitStream.Stream, Meta.CoderStreamSize + 2*sizeof(u64));
+    i64 Offset = Streams->Offset + Meta.Offset;
+    if (ReadAt(Dataset.Fd, S.BlockStream.Stream.Data, Meta.BlockStreamSize, Offset) != Meta.BlockStreamSize ||
+        ReadAt(Dataset.Fd, S.Coder.BitStream.Stream.Data, Meta.CoderStreamSize, Offset + Meta.BlockStreamSize) != Meta.CoderStreamSize ||
+        HashBytes(S.Coder.BitStream.Stream.Data, Meta.CoderStreamSize,
+                  HashBytes(S.BlockStream.Stream.Data, Meta.BlockStreamSize)) != Meta.Checksum)
+      EXIT_ERROR("a level sub-stream is corrupt");
+    if (L > 0) {
+      S.Coder.InitRead();
+      InitRead(&S.BlockStream, S.BlockStream.Stream);
+    }
+    BytesRead += Meta.BlockStreamSize + Meta.CoderStreamSize;
+  }
+  SwapLevelState(&LevelStates[0]);
+  printf("read %d of %d levels (%lld of %lld bytes)\n", NRead, Params.NLevels, BytesRead, Streams->Bytes);
+}
+
 /* we do not do "resolution splits" any more
 * "Grid" refers to the grid made of blocks, not individual cells */
 static u32 Stack[128] = {};
@@ -4073,66 +5192,461 @@ CompressBlockFast() {
       }
       Avg += N;
     }
-    Avg /= (B3.z * B3.y);
-    printf("   Avg N = %d\n", Avg);
-      // TODO: compress along Y
+    Avg /= (B3.z * B3.y);
+    printf("   Avg N = %d\n", Avg);
+      // TODO: compress along Y
+  }
+}
+
+/* Remove the repeated positions in place and return how many particles were removed. The particles
+are permuted in place into partitions by a prefix of their position hash, so equal positions share a
+partition and clustered inputs still split evenly. The threads first split the array in place on the
+top bits of the prefix until each has its own range of partitions, then permute their range (American
+flag sort), then sort and deduplicate disjoint ranges of partitions. Last, the kept particles past the
+end of the result are swapped into the holes before it. No step needs a second full-size array. The
+order of the particles is not kept. If Attrs is given, its rows of NAttrs values follow their particles
+(a repeated position keeps the row of one of its particles). */
+constexpr int DedupPartitionBits = 10;
+static i64
+RemoveRepeatedParticles(std::vector<particle_int>* Particles, int NThreads, std::vector<i32>* Attrs = nullptr, int NAttrs = 0) {
+  constexpr int NParts = 1 << DedupPartitionBits;
+  std::vector<particle_int>& Ps = *Particles;
+  i64 N = Ps.size();
+  int NA = Attrs ? NAttrs : 0;
+  i32* As = NA > 0 ? Attrs->data() : nullptr;
+  if (NA > 0)
+    REQUIRE(i64(Attrs->size()) == N*NA);
+  auto Part = [](const particle_int& P) {
+    return int(HashPosition(P.Pos, 0x243f6a8885a308d3ull) >> (64 - DedupPartitionBits));
+  };
+  auto Swap = [&Ps, As, NA](i64 I, i64 J) {
+    std::swap(Ps[I], Ps[J]);
+    std::swap_ranges(As + I*NA, As + (I+1)*NA, As + J*NA);
+  };
+  /* count the partition sizes */
+  std::vector<std::array<i64, NParts>> Counts(NThreads);
+  ParallelFor(N, NThreads, [&](int T, i64 Begin, i64 End) {
+    Counts[T].fill(0);
+    FOR(i64, I, Begin, End) { ++Counts[T][Part(Ps[I])]; }
+  });
+  std::vector<i64> Begin(NParts + 1, 0);
+  FOR(int, B, 0, NParts) {
+    Begin[B+1] = Begin[B];
+    FOR(int, T, 0, NThreads) { Begin[B+1] += Counts[T][B]; }
+  }
+  /* split on the top TopBits bits of the partition, one bit at a time, all threads on each split */
+  int TopBits = 0;
+  while ((1 << TopBits) < NThreads && TopBits < DedupPartitionBits) ++TopBits;
+  FOR(int, Bit, 0, TopBits) {
+    int Shift = DedupPartitionBits - 1 - Bit;
+    FOR(int, G, 0, 1 << Bit) { // the groups of partitions that share the bits above
+      i64 Lo = Begin[G << (Shift+1)], Hi = Begin[(G+1) << (Shift+1)];
+      ParallelPartition(Lo, Hi, NThreads, [&](i64 I) { return (Part(Ps[I]) >> Shift) & 1; }, Swap);
+    }
+  }
+  /* permute each group of partitions, Next[B] is the first slot of partition B not holding one of its
+  particles yet */
+  int NGroups = 1 << TopBits, PartsPerGroup = NParts / NGroups;
+  ParallelFor(NGroups, NThreads, [&](int, i64 FirstGroup, i64 LastGroup) {
+    std::vector<i64> Next(Begin.begin(), Begin.end() - 1);
+    std::vector<i32> Row(NA); // of the particle being carried
+    FOR(i64, B, FirstGroup*PartsPerGroup, LastGroup*PartsPerGroup) {
+      while (Next[B] < Begin[B+1]) {
+        particle_int P = Ps[Next[B]];
+        std::copy(As + Next[B]*NA, As + (Next[B]+1)*NA, Row.begin());
+        int PB = Part(P);
+        while (PB != B) {
+          std::swap(P, Ps[Next[PB]]);
+          std::swap_ranges(Row.begin(), Row.end(), As + Next[PB]*NA);
+          ++Next[PB];
+          PB = Part(P);
+        }
+        Ps[Next[B]] = P;
+        std::copy(Row.begin(), Row.end(), As + Next[B]*NA);
+        ++Next[B];
+      }
+    }
+  });
+  /* sort and deduplicate each partition (through an index when the rows have to follow) */
+  std::vector<i64> NKept(NParts);
+  ParallelFor(NParts, NThreads, [&](int, i64 First, i64 Last) {
+    std::vector<i64> Idx;
+    std::vector<particle_int> TmpPs;
+    std::vector<i32> TmpAs;
+    FOR(i64, B, First, Last) {
+      auto It = Ps.begin() + Begin[B], End = Ps.begin() + Begin[B+1];
+      if (NA == 0) {
+        std::sort(It, End, [](const particle_int& P1, const particle_int& P2) { return LessZYX(P1.Pos, P2.Pos); });
+        NKept[B] = std::unique(It, End, [](const particle_int& P1, const particle_int& P2) { return P1.Pos == P2.Pos; }) - It;
+        continue;
+      }
+      Idx.resize(Begin[B+1] - Begin[B]);
+      FOR(i64, I, 0, i64(Idx.size())) { Idx[I] = Begin[B] + I; }
+      std::sort(Idx.begin(), Idx.end(), [&Ps](i64 I, i64 J) { return LessZYX(Ps[I].Pos, Ps[J].Pos); });
+      Idx.erase(std::unique(Idx.begin(), Idx.end(), [&Ps](i64 I, i64 J) { return Ps[I].Pos == Ps[J].Pos; }), Idx.end());
+      TmpPs.resize(Idx.size());
+      TmpAs.resize(Idx.size() * NA);
+      FOR(i64, I, 0, i64(Idx.size())) {
+        TmpPs[I] = Ps[Idx[I]];
+        std::copy(As + Idx[I]*NA, As + (Idx[I]+1)*NA, TmpAs.begin() + I*NA);
+      }
+      std::copy(TmpPs.begin(), TmpPs.end(), It);
+      std::copy(TmpAs.begin(), TmpAs.end(), As + Begin[B]*NA);
+      NKept[B] = Idx.size();
+    }
+  });
+  /* compact: the kept particles at or past Kept fill the holes before it */
+  i64 Kept = 0;
+  FOR(int, B, 0, NParts) { Kept += NKept[B]; }
+  std::vector<index_range> KeptAfter, HolesBefore;
+  FOR(int, B, 0, NParts) {
+    i64 KeptBegin = (MAX(Begin[B], Kept)), HolesEnd = (MIN(Begin[B+1], Kept));
+    if (KeptBegin < Begin[B] + NKept[B]) KeptAfter.push_back({KeptBegin, Begin[B] + NKept[B]});
+    if (Begin[B] + NKept[B] < HolesEnd) HolesBefore.push_back({Begin[B] + NKept[B], HolesEnd});
+  }
+  SwapAcrossRanges(KeptAfter, HolesBefore, NThreads, Swap);
+  Ps.resize(Kept);
+  if (NA > 0)
+    Attrs->resize(Kept * NA);
+  return N - Kept;
+}
+
+// TODO: add the number of blocks to the dataset header
+// TODO: 
+
+//int 
+//main(int Argc, cstr* Argv) {
+//  f64 Accuracy = 0;
+//  bool Ok = ToDouble(Argv[1], &Accuracy);
+//  if (Ok)
+//    TestCompressSeries(Accuracy);
+//  else
+//    printf("ERROR: provide an accuracy");
+//  return 0;
+//}
+
+static std::vector<particle>
+ReadParticles(cstr FileName) {
+  TIME_STAGE(stage::FileRead);
+  if (strstr(FileName, ".xyz"))
+    return ReadXYZ(FileName);
+  if (strstr(FileName, ".dat"))
+    return ReadCosmo(FileName);
+  if (strstr(FileName, ".vtu"))
+    return ReadVtu(FileName);
+  if (strstr(FileName, ".pos"))
+    return ReadRawParticles(FileName);
+  if (strstr(FileName, ".ply"))
+    return ReadPly(FileName);
+  return std::vector<particle>();
+}
+
+static std::vector<particle_int>
+ReadParticlesInt(cstr FileName) {
+  TIME_STAGE(stage::FileRead);
+  if (strstr(FileName, ".ply"))
+    return ReadPlyInt(FileName);
+  if (strstr(FileName, ".vtu"))
+    return ReadVtuInt(FileName);
+  return std::vector<particle_int>();
+}
+
+/* Number of tree nodes to preallocate. Below depth ~log2(N) most particles sit alone in a chain of
+single-child nodes, so sparse inputs (e.g. float positions mapped to ints) need a deeper pool. */
+static i64
+TreePoolSize(i64 NParticles, int MaxDepth, int MinNodesPerParticle) {
+  int ChainDepth = MaxDepth - Msb(u64(MAX(NParticles, i64(1))));
+  return NParticles * (MAX(MinNodesPerParticle, 2 * (ChainDepth + 1))) + 64;
+}
+
+/* Read float positions (.pos64 for doubles, any float format otherwise) and map them losslessly to ints,
+the low bits that do not fit in the tree go to Low (see MapFloatsToInts) */
+static std::vector<particle_int>
+ReadParticlesFloatAsInt(cstr FileName, std::vector<i32>* Low) {
+  TIME_STAGE(stage::FileRead);
+  std::vector<particle_int> ParticlesInt;
+  bool Ok = true;
+  if (strstr(FileName, ".pos64")) {
+    std::vector<f64> Pos3;
+    if (!ReadRawParticlesF64(FileName, &Pos3)) {
+      fprintf(stderr, "cannot read %s (missing or truncated)\n", FileName);
+      return ParticlesInt;
+    }
+    Ok = MapFloatsToInts(Pos3.data(), i64(Pos3.size() / 3), &ParticlesInt, Low);
+  } else {
+    auto Particles = ReadParticles(FileName);
+    static_assert(sizeof(particle) == 3 * sizeof(f32));
+    if (!Particles.empty())
+      Ok = MapFloatsToInts(&Particles[0].Pos.x, i64(Particles.size()), &ParticlesInt, Low);
+  }
+  if (!Ok) ParticlesInt.clear();
+  return ParticlesInt;
+}
+
+/* ---------------- distortion metrics ---------------- */
+/* D1 (point-to-point) and D2 (point-to-plane) errors and the Hausdorff distance between two clouds, in
+both directions, as in the MPEG point cloud metrics. A direction A->B matches each point of A to its
+nearest point of B; D2 projects the error on the normal at that point of B, estimated by PCA of its
+MetricNormalK nearest neighbors. */
+using point3 = std::array<f64, 3>;
+
+/* A kd-tree stored flat: the points are permuted so that every subtree is a contiguous range whose
+median point, at the middle index Mid, splits the range along axis Dims[Mid]. Ranges of at most
+KdLeafSize points are scanned. There are no pointers, and the queries of one range touch one block of
+memory. */
+constexpr inline i64 KdLeafSize = 8;
+constexpr inline int MetricNormalK = 12;
+struct flat_kdtree {
+  std::vector<point3> Points;
+  std::vector<u8> Dims;
+  std::vector<point3> Normals; // of Points[I], for D2
+};
+
+INLINE f64
+Dist2(const point3& A, const point3& B) {
+  f64 X = A[0]-B[0], Y = A[1]-B[1], Z = A[2]-B[2];
+  return X*X + Y*Y + Z*Z;
+}
+
+/* Split along the longest axis of each range, building the top levels on separate threads */
+static void
+BuildKdTree(flat_kdtree* Tree, i64 Lo, i64 Hi, int NThreads) {
+  if (Hi - Lo <= KdLeafSize) return;
+  point3 Min = Tree->Points[Lo], Max = Tree->Points[Lo];
+  FOR(i64, I, Lo+1, Hi) {
+    FOR(int, D, 0, 3) {
+      Min[D] = (MIN(Min[D], Tree->Points[I][D]));
+      Max[D] = (MAX(Max[D], Tree->Points[I][D]));
+    }
+  }
+  int D = 0;
+  if (Max[1]-Min[1] > Max[D]-Min[D]) D = 1;
+  if (Max[2]-Min[2] > Max[D]-Min[D]) D = 2;
+  i64 Mid = (Lo+Hi) / 2;
+  auto Begin = Tree->Points.begin();
+  std::nth_element(Begin+Lo, Begin+Mid, Begin+Hi, [D](const point3& A, const point3& B) { return A[D] < B[D]; });
+  Tree->Dims[Mid] = u8(D);
+  if (NThreads > 1) {
+    std::thread Left([=]() { BuildKdTree(Tree, Lo, Mid, NThreads/2); });
+    BuildKdTree(Tree, Mid+1, Hi, NThreads - NThreads/2);
+    Left.join();
+  } else {
+    BuildKdTree(Tree, Lo, Mid, 1);
+    BuildKdTree(Tree, Mid+1, Hi, 1);
+  }
+}
+
+/* Update (Best, BestD2) if a point in [Lo, Hi) is closer to Q */
+static void
+KdNearest(const flat_kdtree& Tree, const point3& Q, i64 Lo, i64 Hi, i64* Best, f64* BestD2) {
+  if (Hi - Lo <= KdLeafSize) {
+    FOR(i64, I, Lo, Hi) {
+      f64 D2 = Dist2(Q, Tree.Points[I]);
+      if (D2 < *BestD2) { *BestD2 = D2; *Best = I; }
+    }
+    return;
+  }
+  i64 Mid = (Lo+Hi) / 2;
+  int D = Tree.Dims[Mid];
+  f64 Diff = Q[D] - Tree.Points[Mid][D];
+  f64 D2 = Dist2(Q, Tree.Points[Mid]);
+  if (D2 < *BestD2) { *BestD2 = D2; *Best = Mid; }
+  if (Diff < 0) {
+    KdNearest(Tree, Q, Lo, Mid, Best, BestD2);
+    if (Diff*Diff < *BestD2) KdNearest(Tree, Q, Mid+1, Hi, Best, BestD2);
+  } else {
+    KdNearest(Tree, Q, Mid+1, Hi, Best, BestD2);
+    if (Diff*Diff < *BestD2) KdNearest(Tree, Q, Lo, Mid, Best, BestD2);
+  }
+}
+
+/* The K nearest points, closest first */
+struct knn_list {
+  int K = 0, N = 0;
+  i64 Idx[MetricNormalK];
+  f64 D2[MetricNormalK];
+  f64 Worst() const { return N < K ? INFINITY : D2[N-1]; }
+  void Insert(i64 I, f64 Dist2) {
+    if (Dist2 >= Worst()) return;
+    int J = (N < K) ? N++ : N-1;
+    while (J > 0 && D2[J-1] > Dist2) { D2[J] = D2[J-1]; Idx[J] = Idx[J-1]; --J; }
+    D2[J] = Dist2;
+    Idx[J] = I;
+  }
+};
+
+static void
+KdKNearest(const flat_kdtree& Tree, const point3& Q, i64 Lo, i64 Hi, knn_list* List) {
+  if (Hi - Lo <= KdLeafSize) {
+    FOR(i64, I, Lo, Hi) { List->Insert(I, Dist2(Q, Tree.Points[I])); }
+    return;
+  }
+  i64 Mid = (Lo+Hi) / 2;
+  int D = Tree.Dims[Mid];
+  f64 Diff = Q[D] - Tree.Points[Mid][D];
+  List->Insert(Mid, Dist2(Q, Tree.Points[Mid]));
+  if (Diff < 0) {
+    KdKNearest(Tree, Q, Lo, Mid, List);
+    if (Diff*Diff < List->Worst()) KdKNearest(Tree, Q, Mid+1, Hi, List);
+  } else {
+    KdKNearest(Tree, Q, Mid+1, Hi, List);
+    if (Diff*Diff < List->Worst()) KdKNearest(Tree, Q, Lo, Mid, List);
+  }
+}
+
+/* The eigenvector of the smallest eigenvalue of a symmetric 3x3 matrix (cyclic Jacobi rotations) */
+static point3
+SmallestEigenvector(f64 C[3][3]) {
+  f64 V[3][3] = { {1,0,0}, {0,1,0}, {0,0,1} };
+  const int Pairs[3][2] = { {0,1}, {0,2}, {1,2} };
+  FOR(int, Sweep, 0, 32) {
+    if (C[0][1]*C[0][1] + C[0][2]*C[0][2] + C[1][2]*C[1][2] < 1e-24 * (C[0][0]*C[0][0] + C[1][1]*C[1][1] + C[2][2]*C[2][2]))
+      break;
+    FOR(int, I, 0, 3) {
+      int P = Pairs[I][0], Q = Pairs[I][1];
+      if (C[P][Q] == 0) continue;
+      f64 Theta = (C[Q][Q] - C[P][P]) / (2 * C[P][Q]);
+      f64 T = (Theta >= 0 ? 1 : -1) / (fabs(Theta) + sqrt(Theta*Theta + 1));
+      f64 Cs = 1 / sqrt(T*T + 1), Sn = T * Cs;
+      FOR(int, K, 0, 3) { f64 A = C[K][P], B = C[K][Q]; C[K][P] = Cs*A - Sn*B; C[K][Q] = Sn*A + Cs*B; }
+      FOR(int, K, 0, 3) { f64 A = C[P][K], B = C[Q][K]; C[P][K] = Cs*A - Sn*B; C[Q][K] = Sn*A + Cs*B; }
+      FOR(int, K, 0, 3) { f64 A = V[K][P], B = V[K][Q]; V[K][P] = Cs*A - Sn*B; V[K][Q] = Sn*A + Cs*B; }
+    }
   }
+  int M = 0;
+  if (C[1][1] < C[M][M]) M = 1;
+  if (C[2][2] < C[M][M]) M = 2;
+  return point3{V[0][M], V[1][M], V[2][M]};
 }
 
-INLINE u64
-Pack3i64(const vec3i& V) { return u64(V.x & 0x1FFFFF) + (u64(V.y & 0x1FFFFF) << 21) + (u64(V.z & 0x1FFFFF) << 42); }
-std::vector<particle_int>
-RemoveRepeatedParticles(std::vector<particle_int>& Input) {
-  std::vector<particle_int> Output;
-  Output.reserve(Input.size());
-  std::sort(Input.begin(), Input.end(), [](const auto& P1, const auto& P2) {
-    return Pack3i64(P1.Pos) < Pack3i64(P2.Pos);
+static void
+EstimateNormals(flat_kdtree* Tree, int NThreads) {
+  i64 N = Tree->Points.size();
+  Tree->Normals.resize(N);
+  ParallelFor(N, NThreads, [Tree, N](int, i64 Begin, i64 End) {
+    FOR(i64, I, Begin, End) {
+      knn_list List;
+      List.K = int(MIN(i64(MetricNormalK), N));
+      KdKNearest(*Tree, Tree->Points[I], 0, N, &List);
+      point3 Mean = {0, 0, 0};
+      FOR(int, J, 0, List.N) { FOR(int, D, 0, 3) { Mean[D] += Tree->Points[List.Idx[J]][D] / List.N; } }
+      f64 C[3][3] = {};
+      FOR(int, J, 0, List.N) {
+        const point3& P = Tree->Points[List.Idx[J]];
+        FOR(int, R, 0, 3) { FOR(int, S, 0, 3) { C[R][S] += (P[R]-Mean[R]) * (P[S]-Mean[S]); } }
+      }
+      Tree->Normals[I] = SmallestEigenvector(C);
+    }
   });
-  Output.push_back(Input[0]);
-  for (i64 I = 1; I < Input.size(); ++I) {
-    if (Input[I].Pos != Input[I-1].Pos) {
-      Output.push_back(Input[I]);
+}
+
+static flat_kdtree
+BuildMetricTree(std::vector<point3>&& Points, int NThreads) {
+  flat_kdtree Tree;
+  Tree.Points = std::move(Points);
+  Tree.Dims.resize(Tree.Points.size());
+  BuildKdTree(&Tree, 0, Tree.Points.size(), NThreads);
+  EstimateNormals(&Tree, NThreads);
+  return Tree;
+}
+
+struct metric_result {
+  f64 D1Mse = 0, D2Mse = 0, Hausdorff = 0;
+};
+
+/* Match every point of A (in A's tree order, so consecutive queries are close in B too) to B */
+static metric_result
+DirectionalMetrics(const flat_kdtree& A, const flat_kdtree& B, int NThreads) {
+  i64 NA = A.Points.size(), NB = B.Points.size();
+  std::vector<metric_result> Partial(NThreads);
+  ParallelFor(NA, NThreads, [&](int T, i64 Begin, i64 End) {
+    f64 D1 = 0, D2 = 0, MaxD2 = 0;
+    i64 Best = 0;
+    FOR(i64, I, Begin, End) {
+      const point3& P = A.Points[I];
+      f64 BestD2 = INFINITY;
+      KdNearest(B, P, 0, NB, &Best, &BestD2);
+      const point3& Q = B.Points[Best];
+      const point3& Normal = B.Normals[Best];
+      f64 Proj = (P[0]-Q[0])*Normal[0] + (P[1]-Q[1])*Normal[1] + (P[2]-Q[2])*Normal[2];
+      D1 += BestD2;
+      D2 += Proj * Proj;
+      MaxD2 = (MAX(MaxD2, BestD2));
     }
+    Partial[T] = metric_result{D1, D2, MaxD2};
+  });
+  metric_result Result;
+  FOR_EACH(R, Partial) {
+    Result.D1Mse += R->D1Mse;
+    Result.D2Mse += R->D2Mse;
+    Result.Hausdorff = (MAX(Result.Hausdorff, R->Hausdorff));
   }
-  return Output;
+  Result.D1Mse /= MAX(NA, i64(1));
+  Result.D2Mse /= MAX(NA, i64(1));
+  Result.Hausdorff = sqrt(Result.Hausdorff);
+  return Result;
 }
 
-// TODO: add the number of blocks to the .idx file
-// TODO: 
+/* PSNR with the MPEG convention, where Peak is the largest coordinate range of the reference */
+INLINE f64
+MetricPsnr(f64 Mse, f64 Peak) { return 10 * log10(3 * Peak * Peak / Mse); }
 
-//int 
-//main(int Argc, cstr* Argv) {
-//  f64 Accuracy = 0;
-//  bool Ok = ToDouble(Argv[1], &Accuracy);
-//  if (Ok)
-//    TestCompressSeries(Accuracy);
-//  else
-//    printf("ERROR: provide an accuracy");
-//  return 0;
-//}
+static void
+PrintMetrics(std::vector<point3>&& Points1, std::vector<point3>&& Points2, f64 Peak, int NThreads) {
+  if (Points1.empty() || Points2.empty())
+    EXIT_ERROR("both point clouds must be non-empty");
+  if (Peak <= 0) { // the largest extent of the reference
+    point3 Min = Points1[0], Max = Points1[0];
+    FOR_EACH(P, Points1) { FOR(int, D, 0, 3) { Min[D] = (MIN(Min[D], (*P)[D])); Max[D] = (MAX(Max[D], (*P)[D])); } }
+    Peak = MAX(MAX(Max[0]-Min[0], Max[1]-Min[1]), Max[2]-Min[2]);
+  }
+  flat_kdtree Tree1 = BuildMetricTree(std::move(Points1), NThreads);
+  flat_kdtree Tree2 = BuildMetricTree(std::move(Points2), NThreads);
+  metric_result R12 = DirectionalMetrics(Tree1, Tree2, NThreads);
+  metric_result R21 = DirectionalMetrics(Tree2, Tree1, NThreads);
+  metric_result Sym{MAX(R12.D1Mse, R21.D1Mse), MAX(R12.D2Mse, R21.D2Mse), MAX(R12.Hausdorff, R21.Hausdorff)};
+  printf("peak = %f\n", Peak);
+  printf("%-10s %14s %12s %14s %12s %14s\n", "direction", "D1 mse", "D1 psnr", "D2 mse", "D2 psnr", "hausdorff");
+  cstr Names[] = { "in->out", "out->in", "symmetric" };
+  const metric_result* Results[] = { &R12, &R21, &Sym };
+  FOR(int, I, 0, 3) {
+    const metric_result& R = *Results[I];
+    printf("%-10s %14.6g %12.4f %14.6g %12.4f %14.6g\n", Names[I], R.D1Mse, MetricPsnr(R.D1Mse, Peak),
+      R.D2Mse, MetricPsnr(R.D2Mse, Peak), R.Hausdorff);
+  }
+}
 
-static std::vector<particle>
-ReadParticles(cstr FileName) {
-  if (strstr(FileName, ".xyz"))
-    return ReadXYZ(FileName);
-  if (strstr(FileName, ".dat"))
-    return ReadCosmo(FileName);
-  if (strstr(FileName, ".vtu"))
-    return ReadVtu(FileName);
-  if (strstr(FileName, ".pos"))
-    return ReadRawParticles(FileName);
-  if (strstr(FileName, ".ply"))
-    return ReadPly(FileName);
-  return std::vector<particle>();
+/* Positions as doubles: ints from .ply/.vtu, or floats with Float */
+static std::vector<point3>
+ReadMetricPoints(cstr FileName, bool Float) {
+  std::vector<point3> Points;
+  if (Float) {
+    auto Particles = ReadParticles(FileName);
+    Points.reserve(Particles.size());
+    FOR_EACH(P, Particles) { Points.push_back(point3{P->Pos.x, P->Pos.y, P->Pos.z}); }
+  } else {
+    auto Particles = ReadParticlesInt(FileName);
+    Points.reserve(Particles.size());
+    FOR_EACH(P, Particles) { Points.push_back(point3{f64(P->Pos.x), f64(P->Pos.y), f64(P->Pos.z)}); }
+  }
+  return Points;
 }
 
-static std::vector<particle_int>
-ReadParticlesInt(cstr FileName) {
-  if (strstr(FileName, ".ply"))
-    return ReadPlyInt(FileName);
-  if (strstr(FileName, ".vtu"))
-    return ReadVtuInt(FileName);
-  return std::vector<particle_int>();
+/* Write the decoded particles back as the floats they were mapped from. The low bits of the positions
+are the last attribute components (see MapFloatsToInts). */
+static void
+WriteParticlesIntAsFloat(cstr FileName, const std::vector<particle_int>& ParticlesInt) {
+  int NC = Params.NAttrs, NUser = NC - FloatLowAttrs(Params.FloatLowBits3);
+  auto Low = [NC, NUser](i64 I) { return NC > NUser ? &Attributes[I*NC + NUser] : nullptr; };
+  if (Params.FloatBits == 64) {
+    std::vector<f64> Pos3(ParticlesInt.size() * 3);
+    FOR(i64, I, 0, i64(ParticlesInt.size())) MapIntToFloats(ParticlesInt[I].Pos, Low(I), &Pos3[I*3]);
+    WriteRawParticlesF64(PRINT("%s.pos64", FileName), Pos3);
+  } else {
+    std::vector<particle> Particles(ParticlesInt.size());
+    FOR(i64, I, 0, i64(ParticlesInt.size())) MapIntToFloats(ParticlesInt[I].Pos, Low(I), &Particles[I].Pos.x);
+    WriteRawParticles(PRINT("%s.pos", FileName), Particles);
+  }
 }
 
 static void
@@ -4175,21 +5689,726 @@ EnlargeToPow2(const vec3i& Dims3) {
   return NewDims3;
 }
 
-/* Process semantic3d data sets, from text to binary */
+/* Process semantic3d data sets, from text to binary (the intensity and rgb go to FileNameOut.attr) */
 static void
 ProcessSemantic3D(cstr FileNameIn, cstr FileNameOut) {
   std::vector<particle> Particles;
+  std::vector<i32> Attrs; // intensity, r, g, b
   Particles.reserve(1000000);
+  Attrs.reserve(4 * 1000000);
   char Line[128];
   FILE* Fp = fopen(FileNameIn, "r");
   while (fgets(Line, sizeof(Line), Fp)) {
     vec3f Pos3;
-    vec3f Temp3; // discarding
-    sscanf(Line, "%f %f %f %f %f %f", &Pos3.x, &Pos3.y, &Pos3.z, &Temp3.x, &Temp3.y, &Temp3.z);
+    i32 I = 0, R = 0, G = 0, B = 0;
+    sscanf(Line, "%f %f %f %d %d %d %d", &Pos3.x, &Pos3.y, &Pos3.z, &I, &R, &G, &B);
     Particles.push_back(particle{.Pos = Pos3});
+    Attrs.insert(Attrs.end(), {I, R, G, B});
   }
   fclose(Fp);
   WriteParticles(FileNameOut, Particles);
+  WriteAttributes(PRINT("%s.attr", FileNameOut), 4, 0, Attrs);
+}
+
+/* The per frame grid parameters of a time step, taken from Params */
+static time_step_meta
+MakeTimeStepMeta() {
+  time_step_meta Meta;
+  Meta.NParticles = Params.NParticles;
+  Meta.BBoxInt = Params.BBoxInt;
+  Meta.Dims3 = Params.Dims3;
+  Meta.W3 = Params.W3;
+  memcpy(Meta.DimsStr, Params.DimsStr, sizeof(Meta.DimsStr));
+  memcpy(Meta.FloatShift3, Params.FloatShift3, sizeof(Meta.FloatShift3));
+  memcpy(Meta.FloatMin3, Params.FloatMin3, sizeof(Meta.FloatMin3));
+  memcpy(Meta.FloatLowBits3, Params.FloatLowBits3, sizeof(Meta.FloatLowBits3));
+  Meta.NAttrs = Params.NAttrs;
+  return Meta;
+}
+
+static void
+ApplyTimeStepMeta(const time_step_meta& Meta) {
+  Params.NParticles = Meta.NParticles;
+  Params.BBoxInt = Meta.BBoxInt;
+  Params.Dims3 = Meta.Dims3;
+  Params.W3 = Meta.W3;
+  memcpy(Params.DimsStr, Meta.DimsStr, sizeof(Params.DimsStr));
+  memcpy(Params.FloatShift3, Meta.FloatShift3, sizeof(Params.FloatShift3));
+  memcpy(Params.FloatMin3, Meta.FloatMin3, sizeof(Params.FloatMin3));
+  memcpy(Params.FloatLowBits3, Meta.FloatLowBits3, sizeof(Params.FloatLowBits3));
+  Params.NAttrs = Meta.NAttrs;
+  Params.MaxDepth = ComputeMaxDepth(Params.Dims3);
+}
+
+/* Read the next time step of a series list, a line "particle_file [attribute_file]" ('#' lines are skipped) */
+static bool
+ReadTimeStepLine(FILE* Tp, char* ParticleFile, char* AttrFile) {
+  char Line[1024];
+  while (fgets(Line, sizeof(Line), Tp)) {
+    AttrFile[0] = '\0';
+    if (sscanf(Line, "%511s %511s", ParticleFile, AttrFile) >= 1 && ParticleFile[0] != '#')
+      return true;
+  }
+  return false;
+}
+
+/* The union of the bounding boxes of all time steps, so that moving particles do not change the grid of
+every frame. A first pass over the list (one frame in memory at a time), --bbox skips it */
+static bbox_int
+SeriesBoundingBox(FILE* Tp) {
+  char ParticleFile[512], AttrFile[512];
+  bbox_int BBox{.Min = vec3i(INT_MAX), .Max = vec3i(INT_MIN)};
+  while (ReadTimeStepLine(Tp, ParticleFile, AttrFile)) {
+    auto Particles = ReadParticlesInt(ParticleFile);
+    if (Particles.empty())
+      EXIT_ERROR("No particles read");
+    bbox_int B = ComputeBoundingBox(Particles);
+    BBox.Min = min(BBox.Min, B.Min);
+    BBox.Max = max(BBox.Max, B.Max);
+  }
+  rewind(Tp);
+  return BBox;
+}
+
+/* Whether the previous frame's grid also separates the particles of this one (Params): the same bounding
+box and cells no larger than this frame's own. The frame is then coded on the previous grid, its finer
+cells only move refinement bits into the tree, and it can be predicted */
+static bool
+FitsGrid(const time_step_meta& Prev) {
+  return Prev.BBoxInt.Min == Params.BBoxInt.Min && Prev.BBoxInt.Max == Params.BBoxInt.Max &&
+         Prev.W3.x <= Params.W3.x && Prev.W3.y <= Params.W3.y && Prev.W3.z <= Params.W3.z;
+}
+
+/* A frame can only be predicted from the previous one if both trees are built on the same grid */
+static bool
+SameGrid(const time_step_meta& A, const time_step_meta& B) {
+  return A.BBoxInt.Min == B.BBoxInt.Min && A.BBoxInt.Max == B.BBoxInt.Max &&
+         A.Dims3 == B.Dims3 && A.W3 == B.W3 && strcmp(A.DimsStr, B.DimsStr) == 0;
+}
+
+/* Whether a predicted frame uses anything of the previous one: its tree (FRAME_PREDICT builds only), its
+leaves (--temporal_leaves) or its context counts (--carry_contexts). Without any, every frame is a key frame */
+static bool
+CanPredictFrames() {
+#if defined(FRAME_PREDICT)
+  return true;
+#else
+  return Params.TemporalLeaves || Params.CarryContexts;
+#endif
+}
+
+/* A time step is a key frame (decodable on its own) if it is the first one, every --keyframe_interval-th
+one, if its grid differs from the previous frame's, or if nothing can be predicted (see CanPredictFrames) */
+static bool
+IsKeyframe(i32 TimeStep, const time_step_meta& Meta, const std::vector<time_step_meta>& TimeSteps) {
+  return TimeStep%Params.KeyframeInterval == 0 || TimeSteps.empty() ||
+         !SameGrid(Meta, TimeSteps.back()) || !CanPredictFrames();
+}
+
+static void
+WriteDecodedParticles(cstr OutFile) {
+  TIME_STAGE(stage::FileWrite);
+  if (Params.FloatBits > 0)
+    WriteParticlesIntAsFloat(OutFile, ParticlesInt);
+  else
+    WritePLYInt(PRINT("%s.ply", OutFile), ParticlesInt.begin(), ParticlesInt.end());
+  int NC = Params.NAttrs, NUser = NC - FloatLowAttrs(Params.FloatLowBits3);
+  if (NUser == NC && NC > 0) {
+    WriteAttributes(PRINT("%s.attr", OutFile), NC, Params.AttrFloatMask, Attributes);
+  } else if (NUser > 0) { // without the low bits of the float positions
+    std::vector<i32> UserAttrs(ParticlesInt.size() * NUser);
+    FOR(i64, I, 0, i64(ParticlesInt.size())) {
+      std::copy(&Attributes[I*NC], &Attributes[I*NC + NUser], &UserAttrs[I*NUser]);
+    }
+    WriteAttributes(PRINT("%s.attr", OutFile), NUser, Params.AttrFloatMask, UserAttrs);
+  }
+}
+
+/* Decode one time step of a series (or all of them if TimeStep < 0). Decoding starts at the closest
+key frame at or before TimeStep, and only the trees of two consecutive frames are kept in memory. */
+static void
+DecodeSeries(i32 TimeStep) {
+  if (TimeStep >= Params.NTimeSteps)
+    EXIT_ERROR("--timestep is out of range");
+  const container_section* Segments = FindSection(Dataset, "series");
+  const container_section* Steps = FindSection(Dataset, "steps");
+  if (!Segments || !Steps || Steps->Bytes != Params.NTimeSteps*i64(sizeof(time_step_meta)))
+    EXIT_ERROR("the dataset is not a series");
+  std::vector<time_step_meta> TimeSteps(Params.NTimeSteps);
+  if (!ReadSection(Dataset, *Steps, TimeSteps.data()))
+    EXIT_ERROR("the time step index is corrupt");
+  i32 First = 0, Last = Params.NTimeSteps - 1;
+  if (TimeStep >= 0) {
+    First = Last = TimeStep;
+    while (!TimeSteps[First].Keyframe) --First;
+  }
+  tree_pool Pools[2]; // the frame being decoded and the previous frame
+#if defined(FRAME_PREDICT)
+  tree* PrevFrame = nullptr;
+#endif
+  double start_time = timer();
+  FOR(i32, I, First, Last+1) {
+    TRACE_SCOPE("time step", "time step", I);
+    const time_step_meta& Meta = TimeSteps[I];
+    ApplyTimeStepMeta(Meta);
+    if (i64(FloatRuns.size()) >= (I+1) * 3)
+      std::copy(FloatRuns.begin() + I*3, FloatRuns.begin() + (I+1)*3, Params.FloatRuns3);
+    if (Meta.Keyframe || !Params.CarryContexts)
+      ResetContexts();
+    else
+      RescaleContexts(ContextPriorMaxTotal);
+    InitAttributeCoder(!Meta.Keyframe && Params.CarryContexts);
+    if (BlockStream.Stream.Data) DeallocBuf(&BlockStream.Stream);
+    if (Coder.BitStream.Stream.Data) DeallocBuf(&Coder.BitStream.Stream);
+    /* pad with zeros since Refill() always loads a whole u64 and the arithmetic decoder reads one register ahead */
+    CallocBuf(&BlockStream.Stream, Meta.BlockStreamSize + 2*sizeof(u64));
+    CallocBuf(&Coder.BitStream.Stream, Meta.CoderStreamSize + 2*sizeof(u64));
+    {
+      TIME_STAGE(stage::FileRead);
+      i64 Offset = Segments->Offset + Meta.Offset;
+      if (ReadAt(Dataset.Fd, BlockStream.Stream.Data, Meta.BlockStreamSize, Offset) != Meta.BlockStreamSize ||
+          ReadAt(Dataset.Fd, Coder.BitStream.Stream.Data, Meta.CoderStreamSize, Offset + Meta.BlockStreamSize) != Meta.CoderStreamSize ||
+          HashBytes(Coder.BitStream.Stream.Data, Meta.CoderStreamSize,
+                    HashBytes(BlockStream.Stream.Data, Meta.BlockStreamSize)) != Meta.Checksum)
+        EXIT_ERROR("a time step segment is corrupt");
+    }
+    Coder.InitRead();
+    InitRead(&BlockStream, BlockStream.Stream);
+    i64 N = ReadVarByte(&BlockStream);
+    REQUIRE(N == Meta.NParticles);
+    tree_pool* Pool = &Pools[I & 1]; // the other pool holds the previous frame
+    Reserve(Pool, TreePoolSize(N, Params.MaxDepth, 8));
+    TreePtr = Pool->Nodes;
+    ParticlesInt.clear();
+    Attributes.clear();
+    ParticlesInt.reserve(N);
+    Attributes.reserve(N * Params.NAttrs);
+    grid_int Grid{.From3 = vec3i(0), .Dims3 = Params.Dims3, .Stride3 = vec3i(1)};
+    split_type Split = (Params.NLevels>1 && Params.StartResolutionSplit==0) ? ResolutionSplit : SpatialSplit;
+    UseTemporalLeaves = Params.TemporalLeaves && !Meta.Keyframe;
+    {
+      TIME_STAGE(stage::TreeBuild);
+#if defined(FRAME_PREDICT)
+      PrevFrame = DecodeTreeIntPredict(Meta.Keyframe?nullptr:PrevFrame, ParticlesInt, 0, N, Msb(u64(N))+1, Grid, Split, 0, 0);
+#else
+      DecodeTreeIntPredict(nullptr, ParticlesInt, 0, N, Msb(u64(N))+1, Grid, Split, 0, 0);
+#endif
+    }
+    if (Params.TemporalLeaves)
+      IndexFrameLeaves(ParticlesInt);
+    printf("time step %d: %lld particles (%s)\n", I, N, Meta.Keyframe ? "key frame" : "predicted");
+    if (TimeStep < 0 || I == TimeStep) {
+      char OutFile[512];
+      if (TimeStep < 0)
+        snprintf(OutFile, sizeof(OutFile), "%s-%04d", Params.OutFile, I);
+      else
+        snprintf(OutFile, sizeof(OutFile), "%s", Params.OutFile);
+      WriteDecodedParticles(OutFile);
+    }
+  }
+  FOR(int, I, 0, 2) { delete[] Pools[I].Nodes; }
+  printf("decoded time steps %d to %d in %f s\n", First, Last, timer() - start_time);
+}
+
+/* ---------------- tests (--action test) ---------------- */
+/* The round-trip tests run this executable on test-* files in the working directory, so that every
+encode and decode starts from fresh globals and a failing one (EXIT_ERROR) only fails its run */
+static cstr TestExe = nullptr;
+static cstr TestLog = "test-run.log"; // the output of the last RunSelf
+
+static bool
+RunSelf(cstr Format, ...) {
+  char Args[1024], Cmd[2048];
+  va_list List;
+  va_start(List, Format);
+  vsnprintf(Args, sizeof(Args), Format, List);
+  va_end(List);
+#if defined(_WIN32)
+  snprintf(Cmd, sizeof(Cmd), "\"\"%s\" %s > %s 2>&1\"", TestExe, Args, TestLog);
+#else
+  snprintf(Cmd, sizeof(Cmd), "\"%s\" %s > %s 2>&1", TestExe, Args, TestLog);
+#endif
+  return system(Cmd) == 0;
+}
+
+/* sscanf the first line of the last RunSelf's output that starts with Prefix, return the number of
+values read (0 if there is no such line) */
+static int
+ScanLog(cstr Prefix, cstr Format, ...) {
+  FILE* Fp = fopen(TestLog, "r");
+  if (!Fp) return 0;
+  char Line[1024];
+  int NRead = 0;
+  while (fgets(Line, sizeof(Line), Fp)) {
+    if (strncmp(Line, Prefix, strlen(Prefix)) != 0) continue;
+    va_list List;
+    va_start(List, Format);
+    NRead = vsscanf(Line, Format, List);
+    va_end(List);
+    break;
+  }
+  fclose(Fp);
+  return MAX(NRead, 0);
+}
+
+/* N distinct random positions in [0, Extent) on each axis */
+static std::vector<particle_int>
+TestParticles(i64 N, i32 Extent, u32 Seed) {
+  std::mt19937 G(Seed);
+  std::uniform_int_distribution<i32> U(0, Extent-1);
+  std::unordered_set<u64> Seen;
+  std::vector<particle_int> Particles;
+  while (i64(Particles.size()) < N) {
+    particle_int P{.Pos = vec3i(U(G), U(G), U(G))};
+    if (Seen.insert((u64(P.Pos.x) << 42) | (u64(P.Pos.y) << 21) | u64(P.Pos.z)).second)
+      Particles.push_back(P);
+  }
+  return Particles;
+}
+
+static void
+WriteTestParticles(cstr FileName, const std::vector<particle_int>& Particles) {
+  WritePLYInt(FileName, Particles.begin(), Particles.end());
+}
+
+static bool
+SameParticles(const std::vector<particle_int>& A, const std::vector<particle_int>& B) {
+  return HashPositions(A, 1) == HashPositions(B, 1);
+}
+
+/* The floats of Pos3, as their bit patterns sorted by particle */
+template <typename t> static std::vector<std::array<typename traits<t>::integral_t, 3>>
+SortedFloatBits(const std::vector<t>& Pos3) {
+  std::vector<std::array<typename traits<t>::integral_t, 3>> Bits(Pos3.size() / 3);
+  memcpy(Bits.data(), Pos3.data(), Pos3.size() * sizeof(t));
+  std::sort(Bits.begin(), Bits.end());
+  return Bits;
+}
+
+template <typename t> static void
+CheckFloatMapping(const std::vector<t>& Pos3) {
+  i64 N = i64(Pos3.size() / 3);
+  std::vector<particle_int> ParticlesInt;
+  std::vector<i32> Low;
+  REQUIRE(MapFloatsToInts(Pos3.data(), N, &ParticlesInt, &Low));
+  int NLow = FloatLowAttrs(Params.FloatLowBits3);
+  REQUIRE(i64(Low.size()) == N * NLow);
+  FOR(i64, I, 0, N) {
+    t Back[3];
+    MapIntToFloats(ParticlesInt[I].Pos, NLow ? &Low[I*NLow] : nullptr, Back);
+    REQUIRE(memcmp(Back, &Pos3[I*3], sizeof(Back)) == 0);
+    FOR(int, D, 0, 3) { CHECK(ParticlesInt[I].Pos[D] >= 0); }
+  }
+  FOR(int, D, 0, 3) { // the mapping preserves the order of the floats (ties only in the low bits)
+    if (Params.FloatLowBits3[D] > 0) continue;
+    FOR(i64, I, 1, N) {
+      t A = Pos3[(I-1)*3 + D], B = Pos3[I*3 + D];
+      if (A < B) CHECK(ParticlesInt[I-1].Pos[D] < ParticlesInt[I].Pos[D]);
+      if (B < A) CHECK(ParticlesInt[I].Pos[D] < ParticlesInt[I-1].Pos[D]);
+    }
+  }
+}
+
+TEST_CASE("floats map to ordered ints and back without loss") {
+  std::mt19937 G(1);
+  std::uniform_real_distribution<f64> U(-1000, 1000);
+  std::vector<f32> F32(3000);
+  std::vector<f64> F64(3000), F64FromF32(3000);
+  FOR(int, I, 0, 3000) {
+    F64[I] = U(G);
+    F32[I] = f32(F64[I] * ((I%7) ? 1 : 1e-20)); // some tiny magnitudes, so that exponent classes are skipped
+    F64FromF32[I] = F32[I];
+  }
+  F32[0] = 0.0f; F32[3] = -0.0f; // both zeros keep their sign
+  SUBCASE("f32") { CheckFloatMapping(F32); }
+  SUBCASE("f64 from f32") { // the zero low mantissa bits are dropped, nothing goes to the attributes
+    CheckFloatMapping(F64FromF32);
+    CHECK(FloatLowAttrs(Params.FloatLowBits3) == 0);
+  }
+  SUBCASE("f64") { // full mantissas keep their low bits apart
+    CheckFloatMapping(F64);
+    CHECK(FloatLowAttrs(Params.FloatLowBits3) == 3);
+  }
+}
+
+TEST_CASE("encode --float round trip") {
+  std::mt19937 G(2);
+  std::uniform_real_distribution<f64> U(-50, 50);
+  std::vector<f64> Pos3(3 * 5000);
+  FOR_EACH(P, Pos3) { *P = U(G); }
+  WriteRawParticlesF64("test-float.pos64", Pos3);
+  REQUIRE(RunSelf("--action encode --in test-float.pos64 --float --name test-float --ndims 3 --nlevels 2 --start_depth 6 --height 60"));
+  REQUIRE(RunSelf("--action decode --in test-float --out test-float-out"));
+  std::vector<f64> Decoded;
+  REQUIRE(ReadRawParticlesF64("test-float-out.pos64", &Decoded));
+  CHECK(SortedFloatBits(Decoded) == SortedFloatBits(Pos3));
+}
+
+static i64
+FileSize(cstr FileName) {
+  FILE* Fp = fopen(FileName, "rb");
+  if (!Fp) return -1;
+  FSEEK(Fp, 0, SEEK_END);
+  i64 Size = FTELL(Fp);
+  fclose(Fp);
+  return Size;
+}
+
+/* NFrames time steps test-series-NNNN.ply listed in test-series.txt: one particle in each of N random
+cells of 32^3 of [0, 2048) x [0, 1536) x [0, 1024), which moves by at most one unit per axis and time
+step (it never leaves its cell) */
+static std::vector<std::vector<particle_int>>
+WriteTestSeries(i64 N, int NFrames) {
+  std::mt19937 G(3);
+  std::vector<i32> Cells(64 * 48 * 32);
+  std::iota(Cells.begin(), Cells.end(), 0);
+  std::shuffle(Cells.begin(), Cells.end(), G);
+  std::uniform_int_distribution<i32> Offset(8, 23), Move(-1, 1);
+  std::vector<std::vector<particle_int>> Frames(NFrames, std::vector<particle_int>(N));
+  FOR(i64, I, 0, N) {
+    i32 C = Cells[I];
+    Frames[0][I].Pos = vec3i(C%64, C/64%48, C/(64*48))*32 + vec3i(Offset(G), Offset(G), Offset(G));
+  }
+  FILE* Fp = fopen("test-series.txt", "w");
+  REQUIRE(Fp);
+  FOR(int, T, 0, NFrames) {
+    if (T > 0) {
+      FOR(i64, I, 0, N) { Frames[T][I].Pos = Frames[T-1][I].Pos + vec3i(Move(G), Move(G), Move(G)); }
+    }
+    char FileName[64];
+    snprintf(FileName, sizeof(FileName), "test-series-%04d.ply", T);
+    WriteTestParticles(FileName, Frames[T]);
+    fprintf(Fp, "%s\n", FileName);
+  }
+  fclose(Fp);
+  return Frames;
+}
+
+TEST_CASE("series round trip with temporally predicted leaves") {
+  auto Frames = WriteTestSeries(5000, 4);
+  cstr Encode = "--action encode --series --in test-series.txt --bbox 0 0 0 2047 1535 1023 --ndims 3 --nlevels 2 --start_depth 6 --height 60";
+  REQUIRE(RunSelf("%s --name test-series-key", Encode));
+  REQUIRE(RunSelf("%s --name test-series --temporal_leaves", Encode));
+  /* the frames share one grid (the cells of --bbox), so all but the first are predicted and cost much
+  less than key frames */
+  CHECK(FileSize("test-series.mrt") < FileSize("test-series-key.mrt") * 3 / 4);
+  REQUIRE(RunSelf("--action decode --in test-series --out test-series-out"));
+  FOR(int, T, 0, int(Frames.size())) {
+    char FileName[64];
+    snprintf(FileName, sizeof(FileName), "test-series-out-%04d.ply", T);
+    CHECK(SameParticles(ReadParticlesInt(FileName), Frames[T]));
+  }
+  REQUIRE(RunSelf("--action decode --in test-series --out test-series-out --timestep 2"));
+  CHECK(SameParticles(ReadParticlesInt("test-series-out.ply"), Frames[2]));
+}
+
+/* Bytes of a section of a dataset, -1 if there is no such section */
+static i64
+SectionBytes(cstr FileName, cstr Name) {
+  container C;
+  i64 Bytes = -1;
+  if (OpenContainer(&C, FileName)) {
+    if (const container_section* S = FindSection(C, Name))
+      Bytes = S->Bytes;
+  }
+  CloseContainer(&C);
+  return Bytes;
+}
+
+TEST_CASE("carried contexts and a context model shrink the streams") {
+  auto Frames = WriteTestSeries(5000, 4);
+  cstr Encode = "--action encode --series --in test-series.txt --bbox 0 0 0 2047 1535 1023 --ndims 3 --nlevels 2 --start_depth 6 --height 60 --temporal_leaves";
+  REQUIRE(RunSelf("%s --name test-fresh", Encode));
+  REQUIRE(RunSelf("%s --name test-carry --carry_contexts", Encode));
+  CHECK(SectionBytes("test-carry.mrt", "series") < SectionBytes("test-fresh.mrt", "series"));
+  REQUIRE(RunSelf("--action decode --in test-carry --out test-carry-out --timestep 3"));
+  CHECK(SameParticles(ReadParticlesInt("test-carry-out.ply"), Frames[3]));
+
+  /* a small file, coded from the counts of a similar one */
+  std::vector<particle_int> Small(Frames[1].begin(), Frames[1].begin() + 1000);
+  WriteTestParticles("test-small.ply", Small);
+  cstr Args = "--ndims 3 --nlevels 2 --start_depth 6 --height 60";
+  REQUIRE(RunSelf("--action encode --in test-series-0000.ply --name test-train %s --save_model test.model", Args));
+  REQUIRE(RunSelf("--action encode --in test-small.ply --name test-small %s", Args));
+  REQUIRE(RunSelf("--action encode --in test-small.ply --name test-small-model %s --model test.model", Args));
+  CHECK(SectionBytes("test-small-model.mrt", "coder") < SectionBytes("test-small.mrt", "coder"));
+  CHECK(!RunSelf("--action decode --in test-small-model --out test-small-out")); // needs the model
+  REQUIRE(RunSelf("--action decode --in test-small-model --out test-small-out --model test.model"));
+  CHECK(SameParticles(ReadParticlesInt("test-small-out.ply"), Small));
+}
+
+/* The particles inside Box */
+static std::vector<particle_int>
+InBox(const std::vector<particle_int>& Particles, const bbox_int& Box) {
+  std::vector<particle_int> Kept;
+  FOR_EACH(P, Particles) { if (Inside(P->Pos, Box)) Kept.push_back(*P); }
+  return Kept;
+}
+
+TEST_CASE("container sections round trip, and a failed write or open is reported") {
+  std::vector<byte> A(5000), B(100000);
+  FOR_EACH(X, A) { *X = byte(X - A.begin()); }
+  FOR_EACH(X, B) { *X = byte((X - B.begin()) * 7); }
+  container_writer W;
+  REQUIRE(BeginContainer(&W, "test-container.mrt"));
+  WriteSection(&W, "a", A.data(), A.size());
+  BeginSection(&W, "b"); // appended in two parts
+  AppendSection(&W, B.data(), 60000);
+  AppendSection(&W, B.data() + 60000, B.size() - 60000);
+  EndSection(&W);
+  REQUIRE(EndContainer(&W, Params));
+  container C;
+  REQUIRE(OpenContainer(&C, "test-container.mrt"));
+  const container_section* Sa = FindSection(C, "a");
+  const container_section* Sb = FindSection(C, "b");
+  REQUIRE((Sa && Sb));
+  CHECK(!FindSection(C, "c"));
+  CHECK((Sa->Offset % ContainerAlign == 0 && Sb->Offset % ContainerAlign == 0));
+  std::vector<byte> ReadA(Sa->Bytes), ReadB(Sb->Bytes);
+  CHECK((ReadSection(C, *Sa, ReadA.data()) && ReadA == A));
+  CHECK((ReadSection(C, *Sb, ReadB.data()) && ReadB == B));
+  i64 CorruptAt = Sb->Offset + 1234;
+  CloseContainer(&C);
+
+  SUBCASE("a corrupt section or header") {
+    FILE* Fp = fopen("test-container.mrt", "r+b");
+    REQUIRE(Fp);
+    FSEEK(Fp, CorruptAt, SEEK_SET);
+    fputc(~B[1234] & 0xFF, Fp);
+    fclose(Fp);
+    REQUIRE(OpenContainer(&C, "test-container.mrt"));
+    CHECK(!ReadSection(C, *FindSection(C, "b"), ReadB.data()));
+    CloseContainer(&C);
+    Fp = fopen("test-container.mrt", "r+b");
+    REQUIRE(Fp);
+    FSEEK(Fp, 8, SEEK_SET);
+    fputc(0xFF, Fp);
+    fclose(Fp);
+    CHECK(!OpenContainer(&C, "test-container.mrt"));
+    CloseContainer(&C);
+  }
+  SUBCASE("a missing file or directory") {
+    CHECK(!OpenContainer(&C, "test-no-such-file.mrt"));
+    CloseContainer(&C);
+    CHECK(!BeginContainer(&W, "test-no-such-dir/test.mrt"));
+    WriteTestParticles("test-container.ply", TestParticles(1000, 1024, 5));
+    CHECK(!RunSelf("--action encode --in test-container.ply --name test-no-such-dir/test --ndims 3 --nlevels 2 --start_depth 6 --height 60"));
+    CHECK(!RunSelf("--action encode --in test-no-such-file.ply --name test-missing --ndims 3 --nlevels 2 --start_depth 6 --height 60"));
+    CHECK(FileSize("test-missing.mrt") == -1); // an encode that fails leaves no dataset
+  }
+#if defined(__linux__)
+  SUBCASE("a short write") { // every write to /dev/full fails with ENOSPC
+    REQUIRE(BeginContainer(&W, "/dev/full"));
+    WriteSection(&W, "b", B.data(), B.size());
+    CHECK(W.Failed);
+    CHECK(!EndContainer(&W, Params));
+  }
+#endif
+  SUBCASE("an aborted container is deleted") {
+    REQUIRE(BeginContainer(&W, "test-aborted.mrt"));
+    WriteSection(&W, "a", A.data(), A.size());
+    AbortContainer(&W);
+    CHECK(!OpenContainer(&C, "test-aborted.mrt"));
+    CHECK(FileSize("test-aborted.mrt") == -1);
+    CloseContainer(&C);
+  }
+}
+
+/* Two attributes that are a function of the position, to check that they stay with their particle */
+static std::array<i32, 2>
+TestAttributes(const vec3i& P) { return { P.x ^ P.y, P.z*3 - 7 }; }
+
+static bool
+AttributesFollowParticles(cstr PlyFile, cstr AttrFile) {
+  auto Particles = ReadParticlesInt(PlyFile);
+  int NAttrs = 0;
+  u32 FloatMask = 0;
+  std::vector<i32> Attrs;
+  if (!ReadAttributes(AttrFile, &NAttrs, &FloatMask, &Attrs) || NAttrs != 2 || Attrs.size() != Particles.size()*2)
+    return false;
+  FOR(size_t, I, 0, Particles.size()) {
+    auto A = TestAttributes(Particles[I].Pos);
+    if (Attrs[I*2] != A[0] || Attrs[I*2 + 1] != A[1]) return false;
+  }
+  return true;
+}
+
+TEST_CASE("a region decodes only the chunks it overlaps") {
+  auto Particles = TestParticles(20000, 4096, 6);
+  std::vector<i32> Attrs;
+  FOR_EACH(P, Particles) { auto A = TestAttributes(P->Pos); Attrs.insert(Attrs.end(), A.begin(), A.end()); }
+  WriteTestParticles("test-roi.ply", Particles);
+  WriteAttributes("test-roi.attr", 2, 0, Attrs);
+  cstr Args = "--ndims 3 --nlevels 2 --start_depth 6 --height 60";
+  REQUIRE(RunSelf("--action encode --in test-roi.ply --attributes test-roi.attr --name test-roi %s --chunk_depth 6", Args));
+  long long NChunks = 0, NDecoded = 0;
+  REQUIRE(ScanLog("Stream size", "Stream size = %*d (%lld chunks)", &NChunks) == 1);
+  CHECK(SectionBytes("test-roi.mrt", "chunk-index") < NChunks * i64(sizeof(chunk_meta)) / 2); // varbytes
+
+  REQUIRE(RunSelf("--action decode --in test-roi --out test-roi-all")); // the whole domain
+  CHECK(SameParticles(ReadParticlesInt("test-roi-all.ply"), Particles));
+  CHECK(AttributesFollowParticles("test-roi-all.ply", "test-roi-all.attr"));
+
+  bbox_int Box{vec3i(100, 200, 300), vec3i(700, 900, 800)};
+  REQUIRE(RunSelf("--action decode --in test-roi --out test-roi-box --roi 100 200 300 700 900 800"));
+  REQUIRE(ScanLog("decoded", "decoded %lld of", &NDecoded) == 1);
+  CHECK(NDecoded > 0);
+  CHECK(NDecoded <= NChunks / 8);
+  auto Decoded = ReadParticlesInt("test-roi-box.ply");
+  CHECK(Decoded.size() == InBox(Particles, Box).size());
+  CHECK(SameParticles(Decoded, InBox(Particles, Box)));
+  CHECK(AttributesFollowParticles("test-roi-box.ply", "test-roi-box.attr"));
+
+  REQUIRE(RunSelf("--action decode --in test-roi --out test-roi-none --roi 5000 5000 5000 6000 6000 6000"));
+  REQUIRE(ScanLog("decoded", "decoded %lld of", &NDecoded) == 1);
+  CHECK(NDecoded == 0);
+  CHECK(ReadParticlesInt("test-roi-none.ply").empty());
+
+  CHECK(!RunSelf("--action decode --in test-roi --out test-roi-bad --roi 0 0 0 10 10")); // not six ints
+  REQUIRE(RunSelf("--action encode --in test-roi.ply --name test-roi-flat %s", Args));
+  CHECK(!RunSelf("--action decode --in test-roi-flat --out test-roi-bad --roi 0 0 0 10 10 10")); // not chunked
+}
+
+TEST_CASE("overlapping regions decode their shared chunks once") {
+  auto Particles = TestParticles(20000, 4096, 3);
+  WriteTestParticles("test-chunks.ply", Particles);
+  REQUIRE(RunSelf("--action encode --in test-chunks.ply --name test-chunks --ndims 3 --nlevels 2 --start_depth 6 --height 60 --chunk_depth 4"));
+  long long NChunks = 0;
+  REQUIRE(ScanLog("Stream size", "Stream size = %*d (%lld chunks)", &NChunks) == 1);
+  bbox_int Boxes[3] = { {vec3i(0), vec3i(2500, 2000, 1500)}, {vec3i(1000, 500, 500), vec3i(4095)}, {vec3i(0), vec3i(4095)} };
+  cstr Roi = "--roi 0 0 0 2500 2000 1500  1000 500 500 4095 4095 4095  0 0 0 4095 4095 4095";
+  REQUIRE(RunSelf("--action decode --in test-chunks --out test-chunks-out %s", Roi));
+  long long Hits = 0, Misses = 0, Bytes = 0, NCompact = 0;
+  REQUIRE(ScanLog("chunk cache", "chunk cache: %lld hits, %lld misses, %lld bytes, %lld", &Hits, &Misses, &Bytes, &NCompact) == 4);
+  CHECK(Misses == NChunks); // every chunk is decoded once, the last region (all of them) only hits
+  CHECK(Hits >= NChunks);
+  CHECK(NCompact == NChunks); // the boxes span less than 2^16
+  CHECK(Bytes < i64(Particles.size() * sizeof(particle_int)) * 3/4); // u16 offsets, not particle_int
+  FOR(int, Q, 0, 3) {
+    auto Decoded = ReadParticlesInt(PRINT("test-chunks-out-%04d.ply", Q));
+    CHECK(Decoded.size() == InBox(Particles, Boxes[Q]).size());
+    CHECK(SameParticles(Decoded, InBox(Particles, Boxes[Q])));
+  }
+  REQUIRE(RunSelf("--action decode --in test-chunks --out test-nocache-out %s --chunk_cache 0", Roi));
+  FOR(int, Q, 0, 3) {
+    CHECK(SameParticles(ReadParticlesInt(PRINT("test-nocache-out-%04d.ply", Q)),
+                        ReadParticlesInt(PRINT("test-chunks-out-%04d.ply", Q))));
+  }
+}
+
+TEST_CASE("prefetched chunk reads overlap with decoding") {
+  auto Particles = TestParticles(20000, 4096, 4);
+  WriteTestParticles("test-prefetch.ply", Particles);
+  REQUIRE(RunSelf("--action encode --in test-prefetch.ply --name test-prefetch --ndims 3 --nlevels 2 --start_depth 6 --height 60 --chunk_depth 4"));
+  bbox_int Box{vec3i(0), vec3i(4095, 4095, 2047)};
+  REQUIRE(RunSelf("--action decode --in test-prefetch --out test-prefetch-out --roi 0 0 0 4095 4095 2047 --prefetch 3"));
+  long long Issued = 0, Used = 0, Ready = 0, NDecoded = 0;
+  REQUIRE(ScanLog("decoded", "decoded %lld of", &NDecoded) == 1);
+  REQUIRE(ScanLog("prefetch", "prefetch: %lld chunks read ahead, %lld used, %lld", &Issued, &Used, &Ready) == 3);
+  CHECK(Issued == NDecoded - 1); // all but the first chunk are read ahead
+  CHECK(Used == Issued);
+  CHECK(Ready > 0); // read on the I/O threads while an earlier chunk was decoding
+  CHECK(SameParticles(ReadParticlesInt("test-prefetch-out.ply"), InBox(Particles, Box)));
+}
+
+/* The number of particles of A that are one of B (B without repeated positions) */
+static i64
+CountIn(const std::vector<particle_int>& A, const std::vector<particle_int>& B) {
+  std::unordered_set<u64> InB;
+  FOR_EACH(P, B) { InB.insert((u64(P->Pos.x) << 42) | (u64(P->Pos.y) << 21) | u64(P->Pos.z)); }
+  i64 N = 0;
+  FOR_EACH(P, A) { N += InB.count((u64(P->Pos.x) << 42) | (u64(P->Pos.y) << 21) | u64(P->Pos.z)); }
+  return N;
+}
+
+TEST_CASE("level streams decode a prefix of the levels") {
+  auto Particles = TestParticles(20000, 4096, 7);
+  std::vector<i32> Attrs;
+  FOR_EACH(P, Particles) { auto A = TestAttributes(P->Pos); Attrs.insert(Attrs.end(), A.begin(), A.end()); }
+  WriteTestParticles("test-levels.ply", Particles);
+  WriteAttributes("test-levels.attr", 2, 0, Attrs);
+  cstr Args = "--ndims 3 --nlevels 3 --start_depth 6 --height 60";
+  REQUIRE(RunSelf("--action encode --in test-levels.ply --attributes test-levels.attr --name test-levels %s --level_streams", Args));
+  CHECK(SectionBytes("test-levels.mrt", "level-index") == 3 * i64(sizeof(level_stream_meta)));
+  CHECK(SectionBytes("test-levels.mrt", "levels") > 0);
+  CHECK(SectionBytes("test-levels.mrt", "blocks") == -1);
+
+  REQUIRE(RunSelf("--action decode --in test-levels --out test-levels-all"));
+  CHECK(SameParticles(ReadParticlesInt("test-levels-all.ply"), Particles));
+  CHECK(AttributesFollowParticles("test-levels-all.ply", "test-levels-all.attr"));
+
+  size_t PrevSize = 0;
+  FOR(int, K, 0, 3) { // each level adds particles to the coarser ones
+    REQUIRE(RunSelf("--action decode --in test-levels --out test-levels-%d --max_level %d", K, K));
+    int NRead = 0, NLevels = 0;
+    long long BytesRead = 0, Bytes = 0;
+    REQUIRE(ScanLog("read", "read %d of %d levels (%lld of %lld bytes)", &NRead, &NLevels, &BytesRead, &Bytes) == 4);
+    CHECK(NRead == K+1);
+    CHECK(NLevels == 3);
+    CHECK((K < 2 ? BytesRead < Bytes : BytesRead == Bytes));
+    char Ply[64], Attr[64];
+    snprintf(Ply, sizeof(Ply), "test-levels-%d.ply", K);
+    snprintf(Attr, sizeof(Attr), "test-levels-%d.attr", K);
+    auto Decoded = ReadParticlesInt(Ply);
+    CHECK(Decoded.size() > PrevSize);
+    CHECK(CountIn(Decoded, Particles) == i64(Decoded.size()));
+    CHECK(AttributesFollowParticles(Ply, Attr));
+    PrevSize = Decoded.size();
+  }
+  CHECK(PrevSize == Particles.size());
+
+  CHECK(!RunSelf("--action encode --in test-levels.ply --name test-levels-bad %s --level_streams --chunk_depth 6", Args));
+  REQUIRE(RunSelf("--action encode --in test-levels.ply --name test-levels-flat %s", Args));
+  CHECK(SectionBytes("test-levels-flat.mrt", "level-index") == -1);
+}
+
+TEST_CASE("a budgeted decode never outputs more particles than were encoded") {
+  /* four in five particles in the even cells along x of the finest grid (of eight units here), so that
+  the finer level has fewer particles than the coarser one that predicts its counts */
+  auto Random = TestParticles(20000, 4096, 8);
+  std::vector<particle_int> Particles;
+  std::unordered_set<u64> Seen;
+  FOR_EACH(P, Random) {
+    P->Pos.x = (P->Pos.x & ~8) | (Seen.size() % 5 == 0 ? 8 : 0);
+    if (Seen.insert((u64(P->Pos.x) << 42) | (u64(P->Pos.y) << 21) | u64(P->Pos.z)).second)
+      Particles.push_back(*P);
+  }
+  i64 N = i64(Particles.size());
+  WriteTestParticles("test-budget.ply", Particles);
+  REQUIRE(RunSelf("--action encode --in test-budget.ply --name test-budget --ndims 3 --nlevels 2 --start_depth 6 --height 60 --level_streams"));
+  std::vector<long long> LevelCounts; // of the output of levels 0 to K, without filling
+  long long Bytes = 0;
+  FOR(int, K, 0, 2) {
+    REQUIRE(RunSelf("--action decode --in test-budget --out test-budget-out --max_level %d", K));
+    REQUIRE(ScanLog("read", "read %*d of %*d levels (%*lld of %lld bytes)", &Bytes) == 1);
+    LevelCounts.push_back(i64(ReadParticlesInt("test-budget-out.ply").size()));
+  }
+  REQUIRE(LevelCounts.back() == N);
+
+  for (long long MaxBytes : { 1ll, 3000ll, Bytes/2, Bytes-1, Bytes }) {
+    CAPTURE(MaxBytes);
+    REQUIRE(RunSelf("--action decode --in test-budget --out test-budget-out --max_bytes %lld", MaxBytes));
+    int NRead = 0;
+    long long NDecoded = 0, NGenerated = 0;
+    REQUIRE(ScanLog("read", "read %d of", &NRead) == 1);
+    REQUIRE(ScanLog("num particles decoded", "num particles decoded = %lld", &NDecoded) == 1);
+    REQUIRE(ScanLog("num particles generated", "num particles generated = %lld", &NGenerated) == 1);
+    auto Decoded = ReadParticlesInt("test-budget-out.ply");
+    CHECK(NDecoded == LevelCounts[NRead-1]); // the levels read, exactly
+    CHECK(i64(Decoded.size()) == NDecoded + NGenerated);
+    CHECK(i64(Decoded.size()) <= N);
+    CHECK(NGenerated <= N - NDecoded); // at most the particles of the levels not read
+    CHECK(CountIn(Decoded, Particles) >= NDecoded);
+    if (MaxBytes >= Bytes)
+      CHECK(SameParticles(Decoded, Particles));
+  }
+
+  REQUIRE(RunSelf("--action decode --in test-budget --out test-budget-out --max_time 0.000001"));
+  CHECK(i64(ReadParticlesInt("test-budget-out.ply").size()) <= N);
+  REQUIRE(RunSelf("--action decode --in test-budget --out test-budget-out --max_time 1000"));
+  CHECK(SameParticles(ReadParticlesInt("test-budget-out.ply"), Particles));
+  REQUIRE(RunSelf("--action encode --in test-budget.ply --name test-budget-flat --ndims 3 --nlevels 2 --start_depth 6 --height 60"));
+  CHECK(!RunSelf("--action decode --in test-budget-flat --out test-budget-out --max_bytes 3000")); // no level streams
 }
 
 int
@@ -4209,15 +6428,48 @@ main(int Argc, cstr* Argv) {
   context.setAssertHandler(Handler);
   cstr ErrorMsg = "Usage: \n"
                   "  to encode: .exe particle_file.xyz --action encode --ndims 3 --nlevels 4 --height 6 --block 2 --out output\n"
-                  "  to decode: .exe compressed_file --action decode --in particle_file.idx";
+                  "  to decode: .exe --action decode --in compressed_file --out particle_file (reads compressed_file.mrt)\n"
+                  "  (encode --attributes file.attr to also code per-particle attributes in tree order)\n"
+                  "  (encode --float to code float positions (.pos64 for doubles) losslessly, without convert --quantize)\n"
+                  "  (encode --multiplicity to keep repeated positions, each leaf codes its particle count, so no dedup pass is needed)\n"
+                  "  (encode [--refinement error] --accuracy A to stop refining once particles are within A grid units, lossless without --accuracy)\n"
+                  "  (encode --series --in list.txt [--keyframe_interval 8] [--temporal_leaves] [--carry_contexts] codes one time step per line: \"particle_file [attribute_file]\";\n"
+                  "   all time steps share one grid, on the union of their bounding boxes (a first pass over the list, or --bbox x0 y0 z0 x1 y1 z1);\n"
+                  "   a time step is a key frame every --keyframe_interval steps, when it needs finer grid cells, and always without --temporal_leaves or --carry_contexts;\n"
+                  "   decode --timestep T decodes time step T only, otherwise all time steps are written to <out>-NNNN)\n"
+                  "  (encode --chunk_depth D codes each subtree at depth D <= --start_depth on its own and indexes them;\n"
+                  "   decode --roi x0 y0 z0 x1 y1 z1 then only decodes the subtrees overlapping the region; with several regions,\n"
+                  "   each is written to <out>-NNNN and --chunk_cache MB (256 by default, 0 to disable) keeps the decoded subtrees they share;\n"
+                  "   --prefetch D [--io_threads T] reads the next D subtrees on T threads (4 by default) while one is decoded)\n"
+                  "  (encode --level_streams codes each resolution level into its own sub-stream, coarsest first;\n"
+                  "   decode --max_level K then only reads and decodes levels 0 to K, for a coarser particle set)\n"
+                  "  (decode --max_bytes B reads the levels that fit in B bytes, --max_time S stops decoding the tree after S seconds;\n"
+                  "   the subtrees left out are filled in with generated particles)\n"
+                  "  (encode --save_model file.model to save the trained context counts; encode and decode --model file.model to start from them)\n"
+                  "  (encode --stats file.json to dump the bits per depth, level, symbol class and context; needs a build with STATS)\n"
+                  "  (--timing prints the time spent in each stage at exit, --perf adds hardware counters on Linux)\n"
+                  "  (--trace file.json records the stages, blocks and block fetches for chrome://tracing or Perfetto)\n"
+                  "  to verify: .exe --action error --in a.ply --out b.ply [--threads T] [--diff] compares the position multisets\n"
+                  "  (error --metrics [--peak P] [--float] prints the D1/D2 PSNR and Hausdorff distance, both ways, with --in as the reference)\n"
+                  "  to dedup: .exe --action dedup --in a.ply --out b [--threads T] [--count] removes repeated positions\n"
+                  "  to test: .exe --action test runs the round-trip tests on test-* files in the working directory";
   cstr Action = nullptr;
   if (!OptVal(Argc, Argv, "--action", &Action)) EXIT_ERROR(ErrorMsg);
+  if (strcmp("test", Action) == 0) { // the test cases above, doctest options (e.g. --test-case=name) apply
+    TestExe = Argv[0];
+    return context.run();
+  }
   if (strcmp("encode", Action) == 0) Params.Action = action::Encode;
   else if (strcmp("decode", Action) == 0) Params.Action = action::Decode;
   else if (strcmp("error", Action) == 0) Params.Action = action::Error;
   else if (strcmp("convert", Action) == 0) Params.Action = action::Convert;
   else if (strcmp("dedup", Action) == 0) Params.Action = action::Dedup;
   else EXIT_ERROR(ErrorMsg);
+  if (OptExists(Argc, Argv, "--timing") || OptExists(Argc, Argv, "--perf"))
+    EnableStageTimer(OptExists(Argc, Argv, "--perf"));
+  cstr TraceFileName = nullptr;
+  if (OptVal(Argc, Argv, "--trace", &TraceFileName))
+    EnableTrace(TraceFileName);
 
   if (Params.Action == action::Encode) {
     if (!OptVal(Argc, Argv, "--name", &Params.OutFile)) EXIT_ERROR("missing --name");
@@ -4230,74 +6482,190 @@ main(int Argc, cstr* Argv) {
         EXIT_ERROR("missing --height and --accuracy");
     }
     //Params.NoRefinement = OptExists(Argc, Argv, "--no_refinement");
-    char Temp[32];
-    cstr Str = Temp;
-    OptVal(Argc, Argv, "--refinement", &Str);
+    cstr Str = "";
+    bool HasAccuracy = OptVal(Argc, Argv, "--accuracy", &Params.Accuracy);
+    if (!OptVal(Argc, Argv, "--refinement", &Str)) // error based only if an accuracy is given
+      Params.RefinementMode = HasAccuracy ? refinement_mode::ERROR_BASED : refinement_mode::LOSSLESS;
     if (strcmp(Str, "error"     ) == 0) Params.RefinementMode = refinement_mode::ERROR_BASED;
     if (strcmp(Str, "lossless"  ) == 0) Params.RefinementMode = refinement_mode::LOSSLESS;
     if (strcmp(Str, "separation") == 0) Params.RefinementMode = refinement_mode::SEPARATION_ONLY;
+    if (strcmp(Str, "error") == 0 && !HasAccuracy)
+      EXIT_ERROR("missing --accuracy for --refinement error");
     if (!OptVal(Argc, Argv, "--in", &Params.InFile)) EXIT_ERROR("missing --in");
     char Buf[512]; 
     strncpy(Buf, Params.InFile, sizeof(Buf));
     CdfTable = CreateBinomialTable(BinomialCutoff);
-    InitWrite(&BlockStream, 900 << 20); // 900 MB
-    Coder.InitWrite(900 << 20);
+    {
+      TIME_STAGE(stage::Allocation);
+      InitWrite(&BlockStream, 900 << 20); // 900 MB
+      Coder.InitWrite(900 << 20);
+    }
     bool Series = OptExists(Argc, Argv, "--series");
+    cstr AttrFile = nullptr;
+    OptVal(Argc, Argv, "--attributes", &AttrFile);
+    bool FloatInput = OptExists(Argc, Argv, "--float"); // lossless f32/f64 positions
+    Params.KeyframeInterval = 8;
+    OptVal(Argc, Argv, "--keyframe_interval", &Params.KeyframeInterval);
+    if (Params.KeyframeInterval < 1)
+      EXIT_ERROR("--keyframe_interval must be at least 1");
+    Params.TemporalLeaves = Series && OptExists(Argc, Argv, "--temporal_leaves");
+    if (Params.TemporalLeaves && Params.RefinementMode == refinement_mode::ERROR_BASED) // see FindPrevFrameLeaf
+      EXIT_ERROR("--temporal_leaves needs the lossless refinement bits, not --refinement error");
+    Params.CarryContexts = Series && OptExists(Argc, Argv, "--carry_contexts");
+    if (Series && !CanPredictFrames())
+      printf("every time step is a key frame (predicting a frame needs --temporal_leaves or --carry_contexts)\n");
+    Params.Multiplicity = OptExists(Argc, Argv, "--multiplicity");
+    OptVal(Argc, Argv, "--chunk_depth", &Params.ChunkDepth);
+    if (Params.ChunkDepth > 0 && Series)
+      EXIT_ERROR("--chunk_depth does not apply to --series");
+    Params.LevelStreams = OptExists(Argc, Argv, "--level_streams");
+    if (Params.LevelStreams && (Series || Params.ChunkDepth > 0))
+      EXIT_ERROR("--level_streams does not apply to --series or --chunk_depth");
+    cstr ModelFile = nullptr, SaveModelFile = nullptr;
+    if (OptVal(Argc, Argv, "--model", &ModelFile))
+      Params.ModelHash = LoadContextModel(ModelFile);
+    OptVal(Argc, Argv, "--save_model", &SaveModelFile);
+#if defined(STATS)
+    cstr StatsFile = nullptr;
+    OptVal(Argc, Argv, "--stats", &StatsFile);
+#endif
+#if defined(CAPTURE_SYMBOLS)
+    cstr TraceFile = nullptr;
+    if (OptVal(Argc, Argv, "--capture_symbols", &TraceFile) && !(SymbolTrace = fopen(TraceFile, "wb")))
+      EXIT_ERROR("cannot write the symbol trace");
+#endif
     FILE* Tp = nullptr;
-    bool Ok = false;
+    if (Series && !(Tp = fopen(Params.InFile, "r")))
+      EXIT_ERROR("cannot open the list of time steps");
+    std::vector<int> BBoxOpt;
+    bool FixedBBox = OptVal(Argc, Argv, "--bbox", &BBoxOpt);
+    if (FixedBBox && (BBoxOpt.size() != 6 || FloatInput))
+      EXIT_ERROR("--bbox takes the min x y z and the max x y z of the integer positions (not with --float)");
+    bbox_int SeriesBBox; // the grid of every time step, unless the positions are floats (mapped per time step)
+    if (FixedBBox)
+      SeriesBBox = bbox_int{vec3i(BBoxOpt[0], BBoxOpt[1], BBoxOpt[2]), vec3i(BBoxOpt[3], BBoxOpt[4], BBoxOpt[5])};
+    else if (Series && !FloatInput)
+      SeriesBBox = SeriesBoundingBox(Tp);
+    FixedBBox = FixedBBox || (Series && !FloatInput);
+    static container_writer Out; // outlives main, for the exit handler
+    if (!BeginContainer(&Out, PRINT("%s.mrt", Params.OutFile)))
+      EXIT_ERROR("cannot write the dataset");
+    atexit([] { AbortContainer(&Out); }); // the encode failed (EXIT_ERROR) if it is still open
+    if (Series)
+      BeginSection(&Out, "series");
+    else if (Params.ChunkDepth > 0)
+      BeginSection(&Out, "chunks");
+    std::vector<chunk_meta> Chunks; // the index of a chunked tree
+    char AttrBuf[512] = {};
+    std::vector<time_step_meta> TimeSteps; // the offset index of a series
+    std::vector<i32> FloatLow; // the low bits of the float positions that do not fit in the tree
+    int NUserAttrs = 0; // of the attribute files
+    tree_pool Pools[2]; // the frame being coded and the previous frame
+#if defined(FRAME_PREDICT)
+    tree* PrevFrame = nullptr;
+#endif
+    i64 BlockStreamSize = 0;
     i32 TimeStep = 0;
-    if (!Series) 
-      goto START;
-    Tp = fopen(Params.InFile, "rb");
-    while (Series) {
-      //Ok = fgets(Buf, sizeof Buf, Tp);
-      Ok = fscanf(Tp, "%s\n", Buf);
-      if (TimeStep >= 2) 
+    while (true) {
+      if (Series) {
+        if (!ReadTimeStepLine(Tp, Buf, AttrBuf))
+          break;
+        AttrFile = AttrBuf[0] ? AttrBuf : nullptr;
+      } else if (TimeStep > 0) {
         break;
-      // TODO: read a text file containing the list of files to process
-      // TODO: go through each file and perform the following
-START:
-      ParticlesInt = ReadParticlesInt(Buf);
+      }
+      TRACE_SCOPE("time step", "time step", TimeStep);
+      ParticlesInt = FloatInput ? ReadParticlesFloatAsInt(Buf, &FloatLow) : ReadParticlesInt(Buf);
       if (ParticlesInt.size() == 0)
         EXIT_ERROR("No particles read");
       Params.NParticles = ParticlesInt.size();
-      if (TreePtrBackup == nullptr) {
-        assert(PrevFramePtrBackup == nullptr);
-        TreePtr      = new tree[Params.NParticles * 8];
-        PrevFramePtr = new tree[Params.NParticles * 8];
-        TreePtrBackup      = TreePtr;
-        PrevFramePtrBackup = PrevFramePtr;
+      int NAttrs = 0;
+      if (AttrFile) {
+        if (!ReadAttributes(AttrFile, &NAttrs, &Params.AttrFloatMask, &Attributes))
+          EXIT_ERROR("cannot read the attribute file");
+        if (i64(Attributes.size()) != Params.NParticles * NAttrs)
+          EXIT_ERROR("the attribute file does not match the particle file");
+        printf("number of attributes = %d\n", NAttrs);
+      } else {
+        Attributes.clear();
+      }
+      if (TimeStep > 0 && NAttrs != NUserAttrs)
+        EXIT_ERROR("all time steps must have the same attributes");
+      NUserAttrs = Params.NAttrs = NAttrs;
+      if (int NLow = FloatInput ? FloatLowAttrs(Params.FloatLowBits3) : 0) { // see MapFloatsToInts
+        if (NAttrs + NLow > 32)
+          EXIT_ERROR("too many attributes, the float positions need up to three more for their low bits");
+        if (!Params.Multiplicity && TimeStep > 0)
+          EXIT_ERROR("a later time step needs the low bits of its float positions coded apart, encode the series with --multiplicity");
+        Params.Multiplicity = true; // positions that only differ in their low bits share a leaf
+        std::vector<i32> Merged(Params.NParticles * (NAttrs+NLow));
+        FOR(i64, I, 0, Params.NParticles) {
+          i32* Row = Merged.data() + I*(NAttrs+NLow);
+          std::copy(Attributes.data() + I*NAttrs, Attributes.data() + (I+1)*NAttrs, Row);
+          std::copy(FloatLow.data() + I*NLow, FloatLow.data() + (I+1)*NLow, Row + NAttrs);
+        }
+        Attributes.swap(Merged);
+        Params.NAttrs = i8(NAttrs + NLow);
+        printf("float low bits = %d %d %d\n", Params.FloatLowBits3[0], Params.FloatLowBits3[1], Params.FloatLowBits3[2]);
       }
       printf("number of particles = %zu\n", ParticlesInt.size());
       double start_time = timer();
       Params.BBoxInt = ComputeBoundingBox(ParticlesInt);
-      //Params.BBoxInt = bbox_int{vec3i{182, 9, 120}, vec3i{706, 1033, 376}};
+      if (FixedBBox) {
+        if (!Inside(Params.BBoxInt.Min, SeriesBBox) || !Inside(Params.BBoxInt.Max, SeriesBBox))
+          EXIT_ERROR("the particles are outside --bbox");
+        Params.BBoxInt = SeriesBBox;
+      }
       printf("bbox = (%d %d %d) - (%d %d %d)\n", 
         Params.BBoxInt.Min[0], Params.BBoxInt.Min[1], Params.BBoxInt.Min[2],
         Params.BBoxInt.Max[0], Params.BBoxInt.Max[1], Params.BBoxInt.Max[2]);
-      WriteVarByte(&BlockStream, ParticlesInt.size());
+      if (Params.ChunkDepth == 0) // otherwise the chunk index has the counts
+        WriteVarByte(&BlockStream, ParticlesInt.size());
       Params.Dims3 = Params.BBoxInt.Max - Params.BBoxInt.Min + 1; //vec3i(1 << Params.LogDims3.x, 1 << Params.LogDims3.y, 1 << Params.LogDims3.z);
       printf("dims = %d %d %d\n", Params.Dims3[0], Params.Dims3[1], Params.Dims3[2]);
       Params.Dims3 = EnlargeToPow2(Params.Dims3);
       Params.BBoxInt.Max = Params.BBoxInt.Min + Params.Dims3 - 1;
       printf("enlarged dims = %d %d %d\n", Params.Dims3[0], Params.Dims3[1], Params.Dims3[2]);
-      Params.LogDims3 = ComputeGrid(&ParticlesInt, Params.BBoxInt, 0, ParticlesInt.size(), 0, Params.DimsStr);
+      {
+        TIME_STAGE(stage::Grid);
+        Params.LogDims3 = ComputeGrid(&ParticlesInt, Params.BBoxInt, 0, ParticlesInt.size(), 0, Params.DimsStr);
+      }
       Params.W3[0] = Params.Dims3[0] / (1<<Params.LogDims3[0]);
       Params.W3[1] = Params.Dims3[1] / (1<<Params.LogDims3[1]);
       Params.W3[2] = Params.Dims3[2] / (1<<Params.LogDims3[2]);
+      if (Series && !TimeSteps.empty() && FitsGrid(TimeSteps.back())) { // stay on the previous frame's grid
+        const time_step_meta& Prev = TimeSteps.back();
+        Params.W3 = Prev.W3;
+        FOR(int, D, 0, 3) { Params.LogDims3[D] = Msb(u64(Params.Dims3[D] / Params.W3[D])); }
+        memcpy(Params.DimsStr, Prev.DimsStr, sizeof(Params.DimsStr));
+      }
       printf("log dims = %d %d %d\n", Params.LogDims3[0], Params.LogDims3[1], Params.LogDims3[2]);
       printf("w3 = %d %d %d\n", Params.W3[0], Params.W3[1], Params.W3[2]);
+      if (Params.TemporalLeaves && Params.W3 == vec3i(1)) // see FindPrevFrameLeaf
+        EXIT_ERROR("--temporal_leaves needs refinement bits, but a time step has w3 = 1 on every axis");
       Params.Dims3 = Params.Dims3 / Params.W3;
       Params.MaxDepth = ComputeMaxDepth(Params.Dims3);
-      // TODO: maybe not clear the context at the end of each time step?
-      /*ContextS .clear();*/ ContextS .resize((Params.MaxDepth+1)*Params.NLevels);
-      /*ContextTS.clear();*/ ContextTS.resize((Params.MaxDepth+1)*Params.NLevels);
-      /*ContextTS.clear();*/ ContextTS2.resize((Params.MaxDepth+1)*Params.NLevels);
-      /*ContextR .clear();*/ ContextR .resize((Params.MaxDepth+1)*Params.NLevels);
       //FOR_EACH (C, ContextS ) { C->reserve(512); }
       //FOR_EACH (C, ContextTS) { C->reserve(512); }
       //FOR_EACH (C, ContextR ) { C->reserve(512); }
       printf("max depth = %d\n", Params.MaxDepth);
+      bool SpatialAboveChunks = Params.StartResolutionSplit > 0 ? Params.ChunkDepth <= Params.StartResolutionSplit : Params.NLevels == 1;
+      if (Params.ChunkDepth > 0 && (Params.ChunkDepth >= Params.MaxDepth || !SpatialAboveChunks))
+        EXIT_ERROR("--chunk_depth must be below the max depth and at most --start_depth (only spatial splits above the chunks)");
+      tree_pool* Pool = &Pools[TimeStep & 1]; // the other pool holds the previous frame
+      Reserve(Pool, TreePoolSize(Params.NParticles, Params.MaxDepth, 8));
+      TreePtr = Pool->Nodes;
+      time_step_meta Meta = MakeTimeStepMeta();
+      Meta.Keyframe = IsKeyframe(TimeStep, Meta, TimeSteps);
+      if (Meta.Keyframe || !Params.CarryContexts)
+        ResetContexts(); // the time step starts from fresh counts (or the model's)
+      else
+        RescaleContexts(ContextPriorMaxTotal);
+      InitAttributeCoder(!Meta.Keyframe && Params.CarryContexts);
+      if (Params.LevelStreams)
+        InitLevelStreamsWrite();
+      UseTemporalLeaves = Params.TemporalLeaves && !Meta.Keyframe;
+      NTemporalLeaves = 0;
       grid_int Grid{.From3 = vec3i(0), .Dims3 = Params.Dims3, .Stride3 = vec3i(1)};
       printf("bounding box = (" PRIvec3i ") - (" PRIvec3i ")\n", EXPvec3(Params.BBoxInt.Min), EXPvec3(Params.BBoxInt.Max));
       printf("dims string = %s\n", Params.DimsStr);
@@ -4305,24 +6673,67 @@ START:
       i8 T = Msb(u64(N)) + 1;
       split_type Split = (Params.NLevels>1 && Params.StartResolutionSplit==0) ? ResolutionSplit : SpatialSplit;
       printf("--------------- Encoding %s\n", Buf);
-      tree* MyNode = BuildTreeIntPredict(TimeStep==0?nullptr:PrevFramePtr, ParticlesInt, 0, ParticlesInt.size(), T, Grid, Split, 0, 0);
-      PrevFramePtr = MyNode;
-      i64 BlockStreamSize = Size(BlockStream) + Size(Coder.BitStream);
-      printf("Stream size                        = %lld\n", BlockStreamSize);
-      //TreePtr = MyNode;
-      //PrevFramePtr = PrevFramePtrBackup;
-      //std::swap(TreePtr, PrevFramePtr);
-      //std::swap(TreePtrBackup, PrevFramePtrBackup);
-      // TODO: free the previous frame's memory
+      tree* MyNode = nullptr;
+      {
+        TIME_STAGE(stage::TreeBuild);
+        if (Params.ChunkDepth > 0)
+          BuildTreeChunks(ParticlesInt, 0, ParticlesInt.size(), Grid, 0, &Out, &Chunks);
+        else
+#if defined(FRAME_PREDICT)
+          MyNode = BuildTreeIntPredict(Meta.Keyframe?nullptr:PrevFrame, ParticlesInt, 0, ParticlesInt.size(), T, Grid, Split, 0, 0);
+#else
+          MyNode = BuildTreeIntPredict(nullptr, ParticlesInt, 0, ParticlesInt.size(), T, Grid, Split, 0, 0);
+#endif
+      }
+#if defined(FRAME_PREDICT)
+      PrevFrame = MyNode;
+#endif
+      if (Params.TemporalLeaves)
+        IndexFrameLeaves(ParticlesInt);
+      if (Series) { // close the time step's segment so it can be read on its own
+        Coder.EncodeFinalize();
+        Flush(&BlockStream);
+        Meta.Offset = BlockStreamSize;
+        Meta.BlockStreamSize = Size(BlockStream);
+        Meta.CoderStreamSize = Size(Coder.BitStream);
+        Meta.Checksum = HashBytes(Coder.BitStream.Stream.Data, Meta.CoderStreamSize,
+                                  HashBytes(BlockStream.Stream.Data, Meta.BlockStreamSize));
+        {
+          TIME_STAGE(stage::FileWrite);
+          AppendSection(&Out, BlockStream.Stream.Data, Meta.BlockStreamSize);
+          AppendSection(&Out, Coder.BitStream.Stream.Data, Meta.CoderStreamSize);
+        }
+        BlockStreamSize += Meta.BlockStreamSize + Meta.CoderStreamSize;
+        TimeSteps.push_back(Meta);
+        i64 Bytes = Meta.BlockStreamSize + Meta.CoderStreamSize;
+        printf("Time step %d (%s) = %lld bytes, %f bits/particle, %lld temporally predicted leaves\n", TimeStep,
+          Meta.Keyframe ? "key frame" : "predicted", Bytes, f64(Bytes*8) / Meta.NParticles, NTemporalLeaves);
+        Rewind(&BlockStream);
+        Coder.RewindWrite();
+      } else if (Params.ChunkDepth > 0) {
+        printf("Stream size                        = %lld (%zu chunks)\n", Out.Open->Bytes, Chunks.size());
+      } else if (!Params.LevelStreams) { // the levels are printed when written
+        printf("Stream size                        = %lld\n", Size(BlockStream) + Size(Coder.BitStream));
+      }
+      if (FloatInput)
+        FloatRuns.insert(FloatRuns.end(), Params.FloatRuns3, Params.FloatRuns3 + 3);
       double dec_time = timer() - start_time;
       printf("Time: %f s\n", dec_time);
       ++TimeStep;
     }
-    delete[] TreePtrBackup;
-    delete[] PrevFramePtrBackup;
-    Coder.EncodeFinalize();
-    //Coder2.EncodeFinalize();
-    Flush(&BlockStream);
+    if (Tp) fclose(Tp);
+    FOR(int, I, 0, 2) { delete[] Pools[I].Nodes; }
+    if (SaveModelFile)
+      SaveContextModel(SaveModelFile);
+#if defined(STATS)
+    if (StatsFile)
+      WriteStats(StatsFile);
+#endif
+    if (!Series && Params.ChunkDepth == 0) {
+      Coder.EncodeFinalize();
+      //Coder2.EncodeFinalize();
+      Flush(&BlockStream);
+    }
     printf("block count = %lld\n", BlockCount);
     //for (i64 I = 0; I < Residuals.size(); ++I) {
     //  printf("%d\n", Residuals[I]);
@@ -4343,17 +6754,30 @@ START:
     printf("Residual code length gamma  = %lld\n", i64((ResidualCodeLengthGamma+7)/8));
     //Rans64EncFlush(&Rans, &RansPtr);
     //printf("RANS stream size = %d bytes\n", int(OutEnd - RansPtr) * sizeof(u32));
-    WriteMetaFile(Params, PRINT("%s.idx", Params.OutFile));
+    stage_scope WriteScope(stage::FileWrite);
+    if (Series) { // the offset index goes after the segments
+      EndSection(&Out);
+      Params.NTimeSteps = TimeSteps.size();
+      WriteSection(&Out, "steps", TimeSteps.data(), TimeSteps.size() * sizeof(time_step_meta));
+    } else if (Params.ChunkDepth > 0) {
+      BlockStreamSize = Out.Open->Bytes;
+      EndSection(&Out);
+      WriteChunkIndex(&Out, Chunks);
+    } else if (Params.LevelStreams) {
+      BlockStreamSize = WriteLevelStreams(&Out);
+    } else {
+      BlockStreamSize = Size(BlockStream) + Size(Coder.BitStream);
+      WriteSection(&Out, "blocks", BlockStream.Stream.Data, Size(BlockStream));
+      WriteSection(&Out, "coder", Coder.BitStream.Stream.Data, Size(Coder.BitStream));
+    }
+    if (FloatInput)
+      WriteSection(&Out, "float-runs", FloatRuns.data(), FloatRuns.size() * sizeof(float_runs));
+    if (!EndContainer(&Out, Params)) {
+      remove(Out.FileName);
+      EXIT_ERROR("cannot write the dataset");
+    }
+    WriteScope.End();
     printf("%s\n", Params.DimsStr);
-    i64 BlockStreamSize = Size(BlockStream) + Size(Coder.BitStream);
-    FILE* Fp = fopen(PRINT("%s.bin", Params.OutFile), "wb");
-    i64 FirstStreamSize = Size(BlockStream);
-    i64 SecondStreamSize = Size(Coder.BitStream);
-    fwrite(BlockStream.Stream.Data, FirstStreamSize, 1, Fp);
-    fwrite(Coder.BitStream.Stream.Data, SecondStreamSize, 1, Fp);
-    fwrite(&FirstStreamSize, sizeof(FirstStreamSize), 1, Fp);
-    fwrite(&SecondStreamSize, sizeof(SecondStreamSize), 1, Fp);
-    fclose(Fp);
     //printf("Uniform code size 1                = %lld\n", (UniformCodeSize1 + 7) / 8);
     printf("Max depth                          = %d\n", Params.MaxDepth);
     printf("Binomial stream size               = %lld\n", (BinomialCodeSize + 7) / 8);
@@ -4383,7 +6807,8 @@ START:
   } else if (Params.Action == action::Decode) { /* decoding */
     if (!OptVal(Argc, Argv, "--in", &Params.InFile)) EXIT_ERROR("missing --in");
     if (!OptVal(Argc, Argv, "--out", &Params.OutFile)) EXIT_ERROR("missing --out");
-    ReadMetaFile(PRINT("%s.idx", Params.InFile));
+    if (!OpenDataset(PRINT("%s.mrt", Params.InFile)))
+      EXIT_ERROR("cannot open the dataset (or it is corrupt)");
     u8 MaxHeight = 0;
     f32 Accuracy = 0;
     if (!OptVal(Argc, Argv, "--height", &MaxHeight)) {
@@ -4395,29 +6820,101 @@ START:
     OptVal(Argc, Argv, "--max_level", &Params.MaxLevel);
     OptVal(Argc, Argv, "--max_num_blocks", &Params.MaxNBlocks);
     OptVal(Argc, Argv, "--max_subsampling", &Params.MaxParticleSubSampling);
+    OptVal(Argc, Argv, "--max_bytes", &Budget.MaxBytes);
+    OptVal(Argc, Argv, "--max_time", &Budget.MaxTime);
+    Budget.Fill = Budget.MaxBytes > 0 || Budget.MaxTime > 0;
+    if (Budget.MaxBytes > 0 && !Params.LevelStreams)
+      EXIT_ERROR("--max_bytes needs a dataset encoded with --level_streams");
+    if (Budget.MaxTime > 0 && Params.NTimeSteps > 0)
+      EXIT_ERROR("--max_time does not apply to a series (the next frames are predicted from the whole tree)");
+    cstr ModelFile = nullptr;
+    if (OptVal(Argc, Argv, "--model", &ModelFile)) {
+      if (LoadContextModel(ModelFile) != Params.ModelHash)
+        EXIT_ERROR("the stream was encoded with a different context model");
+    } else if (Params.ModelHash != 0) {
+      EXIT_ERROR("the stream was encoded with a context model, pass it with --model");
+    }
+    if (Params.NTimeSteps > 0) { // a series
+      i32 TimeStep = -1; // all time steps
+      OptVal(Argc, Argv, "--timestep", &TimeStep);
+      DecodeSeries(TimeStep);
+      PrintStageTimes();
+      WriteTrace();
+      return 0;
+    }
+    std::vector<int> Roi;
+    if (OptVal(Argc, Argv, "--roi", &Roi) && (Roi.empty() || Roi.size()%6 != 0))
+      EXIT_ERROR("--roi takes the min x y z and the max x y z of each region");
+    i64 CacheMB = ChunkCache.Budget >> 20;
+    if (OptVal(Argc, Argv, "--chunk_cache", &CacheMB))
+      ChunkCache.Budget = MAX(CacheMB, i64(0)) << 20;
+    OptVal(Argc, Argv, "--prefetch", &Prefetcher.Depth);
+    OptVal(Argc, Argv, "--io_threads", &Prefetcher.NThreads);
+    if (Params.ChunkDepth > 0) { // decode the chunks in each region (the whole domain by default)
+      std::vector<bbox_int> Queries;
+      for (size_t I = 0; I < Roi.size(); I += 6)
+        Queries.push_back(bbox_int{vec3i(Roi[I], Roi[I+1], Roi[I+2]), vec3i(Roi[I+3], Roi[I+4], Roi[I+5])});
+      if (Queries.empty())
+        Queries.push_back(Params.BBoxInt);
+      Params.MaxDepth = ComputeMaxDepth(Params.Dims3);
+      TreePtr = new tree[TreePoolSize(Params.NParticles, Params.MaxDepth, 2)];
+      tree* TreePtrBackup = TreePtr;
+      StartBudgetClock();
+      FOR(int, Q, 0, int(Queries.size())) {
+        double start_time = timer();
+        ParticlesInt.clear();
+        Attributes.clear();
+        {
+          TIME_STAGE(stage::TreeBuild);
+          DecodeRegion(Queries[Q]);
+        }
+        printf("decoded %zu particles in %f s\n", ParticlesInt.size(), timer() - start_time);
+        char OutFile[512];
+        if (Queries.size() == 1)
+          snprintf(OutFile, sizeof(OutFile), "%s", Params.OutFile);
+        else
+          snprintf(OutFile, sizeof(OutFile), "%s-%04d", Params.OutFile, Q);
+        WriteDecodedParticles(OutFile);
+      }
+      delete[] TreePtrBackup;
+      if (Queries.size() > 1)
+        printf("chunk cache: %lld hits, %lld misses, %lld bytes, %lld chunks with u16 offsets\n", ChunkCache.Hits,
+          ChunkCache.Misses, ChunkCache.Used, ChunkCache.NCompact);
+      if (Prefetcher.Depth > 0)
+        printf("prefetch: %lld chunks read ahead, %lld used, %lld of them read before they were needed\n",
+          Prefetcher.Issued, Prefetcher.Used, Prefetcher.Ready);
+      PrintStageTimes();
+      WriteTrace();
+      return 0;
+    }
+    if (!Roi.empty())
+      EXIT_ERROR("--roi needs a dataset encoded with --chunk_depth");
 
     printf("%s\n", Params.DimsStr);
     Params.MaxDepth = ComputeMaxDepth(Params.Dims3);
-    ContextS.resize((Params.MaxDepth+1)*Params.NLevels);
-    ContextTS.resize((Params.MaxDepth+1)*Params.NLevels);
-    ContextR.resize((Params.MaxDepth+1)*Params.NLevels);
+    ResetContexts();
     //FOR_EACH (C, ContextS) { C->reserve(512); }
     //FOR_EACH (C, ContextTS) { C->reserve(512); }
     //FOR_EACH (C, ContextR) { C->reserve(512); }
     printf("baseheight = %d maxheight = %d\n", Params.BaseHeight, Params.MaxHeight);
-    FILE* Fp = fopen(PRINT("%s.bin", Params.InFile), "rb");
-    FSEEK(Fp, 0, SEEK_END);
-    i64 FirstStreamSize = 0, SecondStreamSize = 0, ThirdStreamSize = 0;
-    //ReadBackwardPOD(Fp, &ThirdStreamSize);
-    ReadBackwardPOD(Fp, &SecondStreamSize);
-    ReadBackwardPOD(Fp, &FirstStreamSize);
-    AllocBuf(&BlockStream.Stream, FirstStreamSize);
-    AllocBuf(&Coder.BitStream.Stream, SecondStreamSize);
-    //AllocBuf(&Coder2.BitStream.Stream, T);
-    FSEEK(Fp, 0, SEEK_SET);
-    fread(BlockStream.Stream.Data, FirstStreamSize, 1, Fp);
-    fread(Coder.BitStream.Stream.Data, SecondStreamSize, 1, Fp);
-    if (Fp) fclose(Fp);
+    stage_scope ReadScope(stage::FileRead);
+    if (Params.LevelStreams) { // only the levels up to --max_level
+      InitAttributeCoder();
+      ReadLevelStreams();
+    } else {
+      const container_section* FirstStream = FindSection(Dataset, "blocks");
+      const container_section* SecondStream = FindSection(Dataset, "coder");
+      if (!FirstStream || !SecondStream)
+        EXIT_ERROR("the dataset has no streams");
+      /* pad with zeros since Refill() always loads a whole u64 and the arithmetic decoder reads one register ahead */
+      CallocBuf(&BlockStream.Stream, FirstStream->Bytes + 2*sizeof(u64));
+      CallocBuf(&Coder.BitStream.Stream, SecondStream->Bytes + 2*sizeof(u64));
+      //AllocBuf(&Coder2.BitStream.Stream, T);
+      if (!ReadSection(Dataset, *FirstStream, BlockStream.Stream.Data) ||
+          !ReadSection(Dataset, *SecondStream, Coder.BitStream.Stream.Data))
+        EXIT_ERROR("the dataset is corrupt");
+    }
+    ReadScope.End();
     double start_time = timer();
     uint64_t dec_start_time = __rdtsc();
     //BinomialTables = CreateGeneralBinomialTables();
@@ -4440,20 +6937,27 @@ START:
     //  fread(&SRList[I], sizeof(SRList[I]), 1, Ff);
     //}
     //fclose(Ff);
-    TreePtr = new tree[Params.NParticles * 2]; // TODO: avoid this
+    TreePtr = new tree[TreePoolSize(Params.NParticles, Params.MaxDepth, 2)]; // TODO: avoid this
     auto TreePtrBackup = TreePtr;
     ParticlesInt.reserve(N);
-    tree* MyNode = DecodeTreeIntPredict(nullptr, ParticlesInt, 0, N, Msb(u64(N))+1, Grid, Split, 0, 0);
+    Attributes.reserve(N * Params.NAttrs);
+    InitAttributeCoder();
+    StartBudgetClock();
+    {
+      TIME_STAGE(stage::TreeBuild);
+      DecodeTreeIntPredict(nullptr, ParticlesInt, 0, N, Msb(u64(N))+1, Grid, Split, 0, 0);
+    }
     delete[] TreePtrBackup;
     uint64_t dec_clocks = __rdtsc() - dec_start_time;
     double dec_time = timer() - start_time;
     printf("%lld clocks, %f s\n", dec_clocks, dec_time);
     printf("consumed stream size = %lld\n", Size(BlockStream));
-    WritePLYInt(PRINT("%s.ply", Params.OutFile), ParticlesInt.begin(), ParticlesInt.end());
+    WriteDecodedParticles(Params.OutFile);
     printf("num particles decoded = %lld\n", NParticlesDecoded);
     printf("num particles generated = %lld\n", NParticlesGenerated);
+    // NOTE: nothing writes the block-based format (FlushBlocksToFiles) anymore, so the progressive
+    // refinement below has no options until it does
     //Blocks.resize(Params.NLevels + 1);
-    //Blocks[Params.NLevels].resize(1);
     //Heap.insert(block_data{.Level = Params.NLevels, .Height = 0, .BlockId = 0}, block_priority{.Level = Params.NLevels, .BlockId = 0, .Error = 0});
     //bool Continue = true;
     //int NBlocks = 0;
@@ -4511,23 +7015,44 @@ START:
   } else if (Params.Action == action::Error) {
     if (!OptVal(Argc, Argv, "--in", &Params.InFile)) EXIT_ERROR("missing --in");
     if (!OptVal(Argc, Argv, "--out", &Params.OutFile)) EXIT_ERROR("missing --out");
-    if (!OptVal(Argc, Argv, "--dims", &Params.Dims3)) EXIT_ERROR("missing --dims");
-    auto Particles1 = ReadParticlesInt(Params.InFile);
-    auto Particles2 = ReadParticlesInt(Params.OutFile);
-    //f32 Err1 = Error3(Particles1, Particles2, Params.Dims3);
-    //f32 Err2 = Error3(Particles2, Particles1, Params.Dims3);
-    //printf("error = %f %f %f\n", Err1, Err2, MAX(Err1, Err2));
-    if (!CheckSame(Particles1, Particles2))
-      printf("not same\n");
-    else
-      printf("same\n");
+    int NThreads = DefaultNumThreads();
+    OptVal(Argc, Argv, "--threads", &NThreads);
+    NThreads = MAX(NThreads, 1);
+    if (OptExists(Argc, Argv, "--metrics")) { // --in is the reference
+      f64 Peak = 0;
+      OptVal(Argc, Argv, "--peak", &Peak);
+      bool Float = OptExists(Argc, Argv, "--float");
+      PrintMetrics(ReadMetricPoints(Params.InFile, Float), ReadMetricPoints(Params.OutFile, Float), Peak, NThreads);
+    } else {
+      auto Particles1 = ReadParticlesInt(Params.InFile);
+      auto Particles2 = ReadParticlesInt(Params.OutFile);
+      multiset_hash Hash1 = HashPositions(Particles1, NThreads);
+      multiset_hash Hash2 = HashPositions(Particles2, NThreads);
+      printf("hash = %016llx%016llx %016llx%016llx\n", Hash1.Sum1, Hash1.Sum2, Hash2.Sum1, Hash2.Sum2);
+      if (!(Hash1 == Hash2)) {
+        printf("not same\n");
+        if (OptExists(Argc, Argv, "--diff"))
+          PrintPositionDiff(Particles1, Particles2, NThreads, 20);
+      } else {
+        printf("same\n");
+      }
+    }
   //================= CONVERT =======================
   } else if (Params.Action == action::Convert) {
     if (!OptVal(Argc, Argv, "--in", &Params.InFile)) EXIT_ERROR("missing --in");
     if (!OptVal(Argc, Argv, "--out", &Params.OutFile)) EXIT_ERROR("missing --out");
     bool Quantize = OptExists(Argc, Argv, "--quantize");
+    int NThreads = DefaultNumThreads();
+    OptVal(Argc, Argv, "--threads", &NThreads);
+    NThreads = MAX(NThreads, 1);
     f32 MaxAbsX = 0, MaxAbsY = 0, MaxAbsZ = 0;
-    Particles = ReadParticles(Params.InFile);
+    if (strstr(Params.InFile, ".dat")) { // keep the velocities
+      Particles = ReadCosmo(Params.InFile, &Attributes);
+      Params.NAttrs = 3;
+      Params.AttrFloatMask = 0x7;
+    } else {
+      Particles = ReadParticles(Params.InFile);
+    }
     fprintf(stderr, "Done reading particles\n");
     ParticlesInt.resize(Particles.size());
     if (Quantize) { // quantize everything to 23 bits
@@ -4546,23 +7071,32 @@ START:
         ParticlesInt[I].Pos.z = i32(ScaleZ * Particles[I].Pos.z);
       }
       fprintf(stderr, "Done quantizing\n");
-      ParticlesInt = RemoveRepeatedParticles(ParticlesInt);
+      i64 NRepeated = RemoveRepeatedParticles(&ParticlesInt, NThreads, &Attributes, Params.NAttrs);
+      fprintf(stderr, "Removed %lld repeated particles\n", NRepeated);
       fprintf(stderr, "Writing particles\n");
       WriteParticlesInt(Params.OutFile, ParticlesInt);
+      if (Params.NAttrs > 0)
+        WriteAttributes(PRINT("%s.attr", Params.OutFile), Params.NAttrs, Params.AttrFloatMask, Attributes);
     } else {
       fprintf(stderr, "Writing particles\n");
       WriteParticles(Params.OutFile, Particles);
+      if (Params.NAttrs > 0)
+        WriteAttributes(PRINT("%s.attr", Params.OutFile), Params.NAttrs, Params.AttrFloatMask, Attributes);
     }
   } else if (Params.Action == action::Dedup) {
     if (!OptVal(Argc, Argv, "--in", &Params.InFile)) EXIT_ERROR("missing --in");
     if (!OptVal(Argc, Argv, "--out", &Params.OutFile)) EXIT_ERROR("missing --out");
+    int NThreads = DefaultNumThreads();
+    OptVal(Argc, Argv, "--threads", &NThreads);
     auto ParticlesInt = ReadParticlesInt(Params.InFile);
-    ParticlesInt = RemoveRepeatedParticles(ParticlesInt);
+    i64 NRepeated = RemoveRepeatedParticles(&ParticlesInt, MAX(NThreads, 1));
+    if (OptExists(Argc, Argv, "--count"))
+      printf("%lld repeated particles removed, %zu left\n", NRepeated, ParticlesInt.size());
     WriteParticlesInt(Params.OutFile, ParticlesInt);
   }
+  PrintStageTimes();
+  WriteTrace();
 
   //RandomLevels(&Particles);
 }
-// TODO: we need to swap the roles of Particles1 and Particles2 when computing the error
-// and also pass in the bounding box from outside the function Error
 